@@ -45,10 +45,6 @@
 #include <sys/time.h>
 #endif
 
-#ifdef HAVE_SYS_IOCTL_H
-#include <sys/ioctl.h>
-#endif
-
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
@@ -347,43 +343,32 @@ evbuffer_drain(struct evbuffer *buf, size_t len)
 
 /*
  * Reads data from a file descriptor into a buffer.
+ *
+ * Instead of asking the kernel how much data is pending, which costs an
+ * additional system call for every read, we remember how large the recent
+ * reads were.  A read that fills the requested size suggests that more
+ * data is waiting, so the next read is twice as large; a read that returns
+ * less than half of it shrinks the next read again.
  */
 
-#define EVBUFFER_MAX_READ	4096
+#define EVBUFFER_MAX_READ	4096	/* initial read size */
+#define EVBUFFER_MIN_READSIZE	1024
+#define EVBUFFER_MAX_READSIZE	65536
 
 int
 evbuffer_read(struct evbuffer *buf, int fd, int howmuch)
 {
 	u_char *p;
 	size_t oldoff = buf->off;
-	int n = EVBUFFER_MAX_READ;
+	int n;
 
-#if defined(FIONREAD)
-#ifdef WIN32
-	long lng = n;
-	if (ioctlsocket(fd, FIONREAD, &lng) == -1 || (n=lng) == 0) {
-#else
-	if (ioctl(fd, FIONREAD, &n) == -1 || n == 0) {
-#endif
-		n = EVBUFFER_MAX_READ;
-	} else if (n > EVBUFFER_MAX_READ && n > howmuch) {
-		/*
-		 * It's possible that a lot of data is available for
-		 * reading.  We do not want to exhaust resources
-		 * before the reader has a chance to do something
-		 * about it.  If the reader does not tell us how much
-		 * data we should read, we artifically limit it.
-		 */
-		if (n > buf->totallen << 2)
-			n = buf->totallen << 2;
-		if (n < EVBUFFER_MAX_READ)
-			n = EVBUFFER_MAX_READ;
-	}
-#endif	
+	if (buf->readsize == 0)
+		buf->readsize = EVBUFFER_MAX_READ;
+
+	n = buf->readsize;
 	if (howmuch < 0 || howmuch > n)
 		howmuch = n;
 
-	/* If we don't have FIONREAD, we might waste some space here */
 	if (evbuffer_expand(buf, howmuch) == -1)
 		return (-1);
 
@@ -402,6 +387,19 @@ evbuffer_read(struct evbuffer *buf, int fd, int howmuch)
 
 	buf->off += n;
 
+	buf->nreads++;
+	buf->nread_bytes += n;
+	if ((size_t)n == buf->readsize) {
+		/* Only a read of the full size tells us to grow */
+		buf->nread_full++;
+		if (buf->readsize < EVBUFFER_MAX_READSIZE)
+			buf->readsize <<= 1;
+	} else if (n < howmuch && (size_t)n < buf->readsize / 2) {
+		buf->nread_short++;
+		if (buf->readsize > EVBUFFER_MIN_READSIZE)
+			buf->readsize >>= 1;
+	}
+
 	/* Tell someone about changes in this buffer */
 	if (buf->off != oldoff && buf->cb != NULL)
 		(*buf->cb)(buf, oldoff, buf->off, buf->cbarg);
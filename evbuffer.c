@@ -42,9 +42,14 @@
 #ifdef HAVE_STDARG_H
 #include <stdarg.h>
 #endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #ifdef WIN32
 #include <winsock2.h>
+#else
+#include <sys/socket.h>
 #endif
 
 #include "evutil.h"
@@ -54,6 +59,7 @@
 
 void bufferevent_setwatermark(struct bufferevent *, short, size_t, size_t);
 void bufferevent_read_pressure_cb(struct evbuffer *, size_t, size_t, void *);
+static void bufferevent_pair_schedule(struct bufferevent *);
 
 static int
 bufferevent_add(struct event *ev, int timeout)
@@ -85,7 +91,13 @@ bufferevent_read_pressure_cb(struct evbuffer *buf, size_t old, size_t now,
 	if (bufev->wm_read.high == 0 || now < bufev->wm_read.high) {
 		evbuffer_setcb(buf, NULL, NULL);
 
-		if (bufev->enabled & EV_READ)
+		if (!(bufev->enabled & EV_READ))
+			return;
+		if (bufev->flags & BUFFEREVENT_PAIR) {
+			/* let the other end continue moving data to us */
+			if (bufev->partner != NULL)
+				bufferevent_pair_schedule(bufev->partner);
+		} else
 			bufferevent_add(&bufev->ev_read, bufev->timeout_read);
 	}
 }
@@ -96,35 +108,56 @@ bufferevent_readcb(int fd, short event, void *arg)
 	struct bufferevent *bufev = arg;
 	int res = 0;
 	short what = EVBUFFER_READ;
-	size_t len;
-	int howmuch = -1;
+	size_t len, total = 0;
+	int howmuch, calls = 0;
 
 	if (event == EV_TIMEOUT) {
 		what |= EVBUFFER_TIMEOUT;
 		goto error;
 	}
 
-	/*
-	 * If we have a high watermark configured then we don't want to
-	 * read more data than would make us reach the watermark.
-	 */
-	if (bufev->wm_read.high != 0)
-		howmuch = bufev->wm_read.high;
-
-	res = evbuffer_read(bufev->input, fd, howmuch);
-	if (res == -1) {
-		if (errno == EAGAIN || errno == EINTR)
-			goto reschedule;
-		/* error case */
-		what |= EVBUFFER_ERROR;
-	} else if (res == 0) {
-		/* eof case */
-		what |= EVBUFFER_EOF;
+	for (;;) {
+		howmuch = -1;
+
+		/*
+		 * If we have a high watermark configured then we don't want
+		 * to read more data than would make us reach the watermark.
+		 */
+		if (bufev->wm_read.high != 0)
+			howmuch = bufev->wm_read.high;
+		if (bufev->drain_read.bytes != 0 &&
+		    (howmuch == -1 ||
+		     bufev->drain_read.bytes - total < (size_t)howmuch))
+			howmuch = (int)(bufev->drain_read.bytes - total);
+
+		res = evbuffer_read(bufev->input, fd, howmuch);
+		if (res <= 0) {
+			/* Deliver what we have; we will see this again */
+			if (calls != 0)
+				break;
+			if (res == 0) {
+				/* eof case */
+				what |= EVBUFFER_EOF;
+				goto error;
+			}
+			if (errno == EAGAIN || errno == EINTR)
+				goto reschedule;
+			/* error case */
+			what |= EVBUFFER_ERROR;
+			goto error;
+		}
+
+		total += res;
+		if (++calls == bufev->drain_read.calls)
+			break;
+		if (bufev->drain_read.bytes != 0 &&
+		    total >= bufev->drain_read.bytes)
+			break;
+		if (bufev->wm_read.high != 0 &&
+		    EVBUFFER_LENGTH(bufev->input) >= bufev->wm_read.high)
+			break;
 	}
 
-	if (res <= 0)
-		goto error;
-
 	bufferevent_add(&bufev->ev_read, bufev->timeout_read);
 
 	/* See if this callbacks meets the water marks */
@@ -153,21 +186,69 @@ bufferevent_readcb(int fd, short event, void *arg)
 	(*bufev->errorcb)(bufev, what, bufev->cbarg);
 }
 
+static void
+bufferevent_connectcb(struct bufferevent *bufev, int fd, short event)
+{
+	short what = EVBUFFER_WRITE;
+	int error;
+	socklen_t errsz = sizeof(error);
+
+	bufev->flags &= ~BUFFEREVENT_CONNECTING;
+
+	if (event == EV_TIMEOUT) {
+		what |= EVBUFFER_TIMEOUT;
+		goto error;
+	}
+
+	/* Check if the connection completed */
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *)&error,
+		&errsz) == -1)
+		error = EVUTIL_SOCKET_ERROR();
+	if (error) {
+		EVUTIL_SET_SOCKET_ERROR(error);
+		what |= EVBUFFER_ERROR;
+		goto error;
+	}
+
+	/* Start the I/O that was requested while we were connecting */
+	if (bufev->enabled & EV_READ)
+		bufferevent_add(&bufev->ev_read, bufev->timeout_read);
+	if ((bufev->enabled & EV_WRITE) && EVBUFFER_LENGTH(bufev->output))
+		bufferevent_add(&bufev->ev_write, bufev->timeout_write);
+
+	/* Invoke the user callback - must always be called last */
+	(*bufev->errorcb)(bufev, EVBUFFER_CONNECTED, bufev->cbarg);
+	return;
+
+ error:
+	(*bufev->errorcb)(bufev, what, bufev->cbarg);
+}
+
 static void
 bufferevent_writecb(int fd, short event, void *arg)
 {
 	struct bufferevent *bufev = arg;
 	int res = 0;
 	short what = EVBUFFER_WRITE;
+	size_t len, total = 0;
+	int calls = 0;
+
+	if (bufev->flags & BUFFEREVENT_CONNECTING) {
+		bufferevent_connectcb(bufev, fd, event);
+		return;
+	}
 
 	if (event == EV_TIMEOUT) {
 		what |= EVBUFFER_TIMEOUT;
 		goto error;
 	}
 
-	if (EVBUFFER_LENGTH(bufev->output)) {
+	while ((len = EVBUFFER_LENGTH(bufev->output)) != 0) {
 	    res = evbuffer_write(bufev->output, fd);
 	    if (res == -1) {
+		    /* Report what we have written; we will see this again */
+		    if (calls != 0)
+			    break;
 #ifndef WIN32
 /*todo. evbuffer uses WriteFile when WIN32 is set. WIN32 system calls do not
  *set errno. thus this error checking is not portable*/
@@ -183,11 +264,23 @@ bufferevent_writecb(int fd, short event, void *arg)
 #endif
 
 	    } else if (res == 0) {
+		    if (calls != 0)
+			    break;
 		    /* eof case */
 		    what |= EVBUFFER_EOF;
 	    }
 	    if (res <= 0)
 		    goto error;
+
+	    total += res;
+	    if (++calls == bufev->drain_write.calls)
+		    break;
+	    if (bufev->drain_write.bytes != 0 &&
+		total >= bufev->drain_write.bytes)
+		    break;
+	    /* A short write means that the socket buffer is full */
+	    if ((size_t)res < len)
+		    break;
 	}
 
 	if (EVBUFFER_LENGTH(bufev->output) != 0)
@@ -212,6 +305,122 @@ bufferevent_writecb(int fd, short event, void *arg)
 	(*bufev->errorcb)(bufev, what, bufev->cbarg);
 }
 
+/*
+ * In-memory pairs do not have a file descriptor.  Their events are never
+ * added to the event base; instead we activate them directly whenever
+ * there is work to do, so that all callbacks run from the event loop.
+ */
+
+static void
+bufferevent_pair_schedule(struct bufferevent *bufev)
+{
+	if ((bufev->enabled & EV_WRITE) && EVBUFFER_LENGTH(bufev->output))
+		event_active(&bufev->ev_write, EV_WRITE, 1);
+}
+
+/*
+ * Moves as much of the output of src into the input of its partner as
+ * the read high watermark of the partner allows.  Returns the number of
+ * bytes moved or -1 on error.
+ */
+
+static int
+bufferevent_pair_transfer(struct bufferevent *src)
+{
+	struct bufferevent *dst = src->partner;
+	size_t n = EVBUFFER_LENGTH(src->output);
+	int res;
+
+	if (n == 0 || !(dst->enabled & EV_READ))
+		return (0);
+
+	if (dst->wm_read.high != 0) {
+		size_t len = EVBUFFER_LENGTH(dst->input);
+		if (len >= dst->wm_read.high)
+			return (0);
+		if (n > dst->wm_read.high - len)
+			n = dst->wm_read.high - len;
+	}
+
+	if (n == EVBUFFER_LENGTH(src->output)) {
+		/* Swaps the buffers if the destination is empty */
+		res = evbuffer_add_buffer(dst->input, src->output);
+	} else {
+		res = evbuffer_add(dst->input, EVBUFFER_DATA(src->output), n);
+		if (res == 0)
+			evbuffer_drain(src->output, n);
+	}
+	if (res == -1)
+		return (-1);
+
+	/* Resume once the reader has drained its buffer again */
+	if (dst->wm_read.high != 0 &&
+	    EVBUFFER_LENGTH(dst->input) >= dst->wm_read.high)
+		evbuffer_setcb(dst->input, bufferevent_read_pressure_cb, dst);
+
+	event_active(&dst->ev_read, EV_READ, 1);
+
+	return (n);
+}
+
+static void
+bufferevent_pair_readcb(int fd, short event, void *arg)
+{
+	struct bufferevent *bufev = arg;
+	size_t len;
+
+	if (!(event & EV_READ)) {
+		/* Activated without new data: the other end is gone */
+		(*bufev->errorcb)(bufev, EVBUFFER_READ | EVBUFFER_EOF,
+		    bufev->cbarg);
+		return;
+	}
+
+	/* Report EOF after the data that the other end left behind */
+	if (bufev->partner == NULL)
+		event_active(&bufev->ev_read, 0, 1);
+
+	/* See if this callbacks meets the water marks */
+	len = EVBUFFER_LENGTH(bufev->input);
+	if (bufev->wm_read.low != 0 && len < bufev->wm_read.low)
+		return;
+
+	/* Invoke the user callback - must always be called last */
+	if (bufev->readcb != NULL)
+		(*bufev->readcb)(bufev, bufev->cbarg);
+}
+
+static void
+bufferevent_pair_writecb(int fd, short event, void *arg)
+{
+	struct bufferevent *bufev = arg;
+	short what = EVBUFFER_WRITE;
+
+	if (bufev->partner == NULL) {
+		/* nobody is left to receive our data */
+		what |= EVBUFFER_EOF;
+		goto error;
+	}
+
+	if (bufferevent_pair_transfer(bufev) == -1) {
+		what |= EVBUFFER_ERROR;
+		goto error;
+	}
+
+	/*
+	 * Invoke the user callback if our buffer is drained or below the
+	 * low watermark.
+	 */
+	if (bufev->writecb != NULL &&
+	    EVBUFFER_LENGTH(bufev->output) <= bufev->wm_write.low)
+		(*bufev->writecb)(bufev, bufev->cbarg);
+
+	return;
+
+ error:
+	(*bufev->errorcb)(bufev, what, bufev->cbarg);
+}
+
 /*
  * Create a new buffered event object.
  *
@@ -252,6 +461,10 @@ bufferevent_new(int fd, evbuffercb readcb, evbuffercb writecb,
 
 	bufev->cbarg = cbarg;
 
+	/* One read or write per wakeup unless told otherwise */
+	bufev->drain_read.calls = 1;
+	bufev->drain_write.calls = 1;
+
 	/*
 	 * Set to EV_WRITE so that using bufferevent_write is going to
 	 * trigger a callback.  Reading needs to be explicitly enabled
@@ -262,6 +475,55 @@ bufferevent_new(int fd, evbuffercb readcb, evbuffercb writecb,
 	return (bufev);
 }
 
+/*
+ * Creates two bufferevents that are linked to each other in memory.
+ * Neither has callbacks yet; use bufferevent_setcb() to assign them.
+ */
+
+int
+bufferevent_pair_new(struct event_base *base, struct bufferevent *pair[2])
+{
+	struct bufferevent *bev[2];
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		bev[i] = bufferevent_new(-1, NULL, NULL, NULL, NULL);
+		if (bev[i] == NULL) {
+			if (i == 1)
+				bufferevent_free(bev[0]);
+			return (-1);
+		}
+
+		event_set(&bev[i]->ev_read, -1, EV_READ,
+		    bufferevent_pair_readcb, bev[i]);
+		event_set(&bev[i]->ev_write, -1, EV_WRITE,
+		    bufferevent_pair_writecb, bev[i]);
+		if (base != NULL)
+			bufferevent_base_set(base, bev[i]);
+
+		bev[i]->flags |= BUFFEREVENT_PAIR;
+	}
+
+	bev[0]->partner = bev[1];
+	bev[1]->partner = bev[0];
+
+	pair[0] = bev[0];
+	pair[1] = bev[1];
+
+	return (0);
+}
+
+void
+bufferevent_setcb(struct bufferevent *bufev,
+    evbuffercb readcb, evbuffercb writecb, everrorcb errorcb, void *cbarg)
+{
+	bufev->readcb = readcb;
+	bufev->writecb = writecb;
+	bufev->errorcb = errorcb;
+
+	bufev->cbarg = cbarg;
+}
+
 int
 bufferevent_priority_set(struct bufferevent *bufev, int priority)
 {
@@ -278,9 +540,19 @@ bufferevent_priority_set(struct bufferevent *bufev, int priority)
 void
 bufferevent_free(struct bufferevent *bufev)
 {
+	struct bufferevent *partner = bufev->partner;
+
 	event_del(&bufev->ev_read);
 	event_del(&bufev->ev_write);
 
+	if (partner != NULL) {
+		/* Hand over what is left and tell the other end about EOF */
+		bufferevent_pair_transfer(bufev);
+		partner->partner = NULL;
+		if (partner->enabled & EV_READ)
+			event_active(&partner->ev_read, 0, 1);
+	}
+
 	evbuffer_free(bufev->input);
 	evbuffer_free(bufev->output);
 
@@ -303,8 +575,23 @@ bufferevent_write(struct bufferevent *bufev, const void *data, size_t size)
 		return (res);
 
 	/* If everything is okay, we need to schedule a write */
-	if (size > 0 && (bufev->enabled & EV_WRITE))
-		bufferevent_add(&bufev->ev_write, bufev->timeout_write);
+	if (size > 0 && (bufev->enabled & EV_WRITE)) {
+		if (bufev->flags & BUFFEREVENT_CONNECTING)
+			return (res);	/* written once we are connected */
+		if (bufev->flags & BUFFEREVENT_PAIR)
+			event_active(&bufev->ev_write, EV_WRITE, 1);
+		else if (bufev->flags & BUFFEREVENT_DEFERRED) {
+			/*
+			 * Try to write once the active callbacks are done,
+			 * unless we are already waiting for the socket to
+			 * become writable.
+			 */
+			if (!(bufev->ev_write.ev_flags &
+				(EVLIST_INSERTED|EVLIST_ACTIVE)))
+				event_active(&bufev->ev_write, EV_WRITE, 1);
+		} else
+			bufferevent_add(&bufev->ev_write, bufev->timeout_write);
+	}
 
 	return (res);
 }
@@ -341,6 +628,26 @@ bufferevent_read(struct bufferevent *bufev, void *data, size_t size)
 int
 bufferevent_enable(struct bufferevent *bufev, short event)
 {
+	if (bufev->flags & BUFFEREVENT_PAIR) {
+		bufev->enabled |= event;
+
+		if (event & EV_READ) {
+			if (bufev->partner != NULL)
+				bufferevent_pair_schedule(bufev->partner);
+			else
+				event_active(&bufev->ev_read, 0, 1);
+		}
+		if (event & EV_WRITE)
+			bufferevent_pair_schedule(bufev);
+		return (0);
+	}
+
+	if (bufev->flags & BUFFEREVENT_CONNECTING) {
+		/* The events are added once the connect has finished */
+		bufev->enabled |= event;
+		return (0);
+	}
+
 	if (event & EV_READ) {
 		if (bufferevent_add(&bufev->ev_read, bufev->timeout_read) == -1)
 			return (-1);
@@ -361,7 +668,9 @@ bufferevent_disable(struct bufferevent *bufev, short event)
 		if (event_del(&bufev->ev_read) == -1)
 			return (-1);
 	}
-	if (event & EV_WRITE) {
+	/* Do not cancel a connect that is in progress */
+	if ((event & EV_WRITE) &&
+	    !(bufev->flags & BUFFEREVENT_CONNECTING)) {
 		if (event_del(&bufev->ev_write) == -1)
 			return (-1);
 	}
@@ -370,6 +679,89 @@ bufferevent_disable(struct bufferevent *bufev, short event)
 	return (0);
 }
 
+/*
+ * Points the events of a bufferevent at a different file descriptor while
+ * keeping their event base and priority.
+ */
+
+static void
+bufferevent_setfd(struct bufferevent *bufev, int fd)
+{
+	struct event_base *base = bufev->ev_read.ev_base;
+	int pri = bufev->ev_read.ev_pri;
+
+	event_del(&bufev->ev_read);
+	event_del(&bufev->ev_write);
+
+	event_set(&bufev->ev_read, fd, EV_READ, bufferevent_readcb, bufev);
+	event_set(&bufev->ev_write, fd, EV_WRITE, bufferevent_writecb, bufev);
+
+	bufev->ev_read.ev_base = bufev->ev_write.ev_base = base;
+	bufev->ev_read.ev_pri = bufev->ev_write.ev_pri = pri;
+}
+
+/*
+ * Starts a non-blocking connect.  The outcome is reported to the error
+ * callback from the write event, so that the caller never sees it before
+ * this function has returned.
+ */
+
+int
+bufferevent_socket_connect(struct bufferevent *bufev,
+    struct sockaddr *sa, int socklen, int timeout)
+{
+	int fd = EVENT_FD(&bufev->ev_write);
+	int made_fd = 0;
+
+	if (bufev->flags & (BUFFEREVENT_PAIR|BUFFEREVENT_CONNECTING)) {
+		EVUTIL_SET_SOCKET_ERROR(EINVAL);
+		return (-1);
+	}
+
+	if (fd < 0) {
+		if ((fd = socket(sa->sa_family, SOCK_STREAM, 0)) == -1)
+			return (-1);
+		if (evutil_make_socket_nonblocking(fd) == -1) {
+			EVUTIL_CLOSESOCKET(fd);
+			return (-1);
+		}
+		made_fd = 1;
+	}
+	bufferevent_setfd(bufev, fd);
+
+	if (connect(fd, sa, socklen) == -1) {
+		int error = EVUTIL_SOCKET_ERROR();
+#ifdef WIN32
+		if (error != WSAEWOULDBLOCK && error != WSAEINVAL &&
+		    error != WSAEINPROGRESS)
+			goto out;
+#else
+		if (error != EINPROGRESS && error != EINTR)
+			goto out;
+#endif
+		bufev->flags |= BUFFEREVENT_CONNECTING;
+		if (bufferevent_add(&bufev->ev_write, timeout) == -1) {
+			bufev->flags &= ~BUFFEREVENT_CONNECTING;
+			goto out;
+		}
+	} else {
+		/* Connected right away; report it from the event loop */
+		bufev->flags |= BUFFEREVENT_CONNECTING;
+		event_active(&bufev->ev_write, EV_WRITE, 1);
+	}
+
+	return (0);
+
+ out:
+	if (made_fd) {
+		int serrno = EVUTIL_SOCKET_ERROR();
+		bufferevent_setfd(bufev, -1);
+		EVUTIL_CLOSESOCKET(fd);
+		EVUTIL_SET_SOCKET_ERROR(serrno);
+	}
+	return (-1);
+}
+
 /*
  * Sets the read and write timeout for a buffered event.
  */
@@ -404,6 +796,38 @@ bufferevent_setwatermark(struct bufferevent *bufev, short events,
 	    0, EVBUFFER_LENGTH(bufev->input), bufev);
 }
 
+/*
+ * Sets how much I/O may be done for a single wakeup
+ */
+
+void
+bufferevent_setdrain(struct bufferevent *bufev, short events,
+    int calls, size_t bytes)
+{
+	if (events & EV_READ) {
+		bufev->drain_read.calls = calls;
+		bufev->drain_read.bytes = bytes;
+	}
+
+	if (events & EV_WRITE) {
+		bufev->drain_write.calls = calls;
+		bufev->drain_write.bytes = bytes;
+	}
+}
+
+/*
+ * Toggles deferred write scheduling
+ */
+
+void
+bufferevent_setdeferred(struct bufferevent *bufev, int deferred)
+{
+	if (deferred)
+		bufev->flags |= BUFFEREVENT_DEFERRED;
+	else
+		bufev->flags &= ~BUFFEREVENT_DEFERRED;
+}
+
 int
 bufferevent_base_set(struct event_base *base, struct bufferevent *bufev)
 {
@@ -300,6 +300,8 @@ struct evkeyval {
 
 	char *key;
 	char *value;
+
+	int flags;	/* internal to evhttp; zero for caller allocated pairs */
 };
 
 #ifdef _EVENT_DEFINED_TQENTRY
@@ -802,6 +804,13 @@ struct evbuffer {
 
 	void (*cb)(struct evbuffer *, size_t, size_t, void *);
 	void *cbarg;
+
+	/* adaptive read sizing and statistics, see evbuffer_read() */
+	size_t readsize;	/* size of the next read, 0 until first read */
+	ev_uint64_t nreads;	/* number of successful reads */
+	ev_uint64_t nread_bytes;	/* bytes read in total */
+	ev_uint64_t nread_full;	/* reads that filled the read size */
+	ev_uint64_t nread_short;	/* reads that returned less than half */
 };
 
 /* Just for error reporting - use other constants otherwise */
@@ -810,6 +819,8 @@ struct evbuffer {
 #define EVBUFFER_EOF		0x10
 #define EVBUFFER_ERROR		0x20
 #define EVBUFFER_TIMEOUT	0x40
+/* Not an error: a connect started by bufferevent_socket_connect() finished */
+#define EVBUFFER_CONNECTED	0x80
 
 struct bufferevent;
 typedef void (*evbuffercb)(struct bufferevent *, void *);
@@ -820,6 +831,12 @@ struct event_watermark {
 	size_t high;
 };
 
+/* Limits the amount of I/O that is done for a single wakeup */
+struct event_drain {
+	int calls;		/* system calls per wakeup, 0 for no limit */
+	size_t bytes;		/* bytes per wakeup, 0 for no limit */
+};
+
 struct bufferevent {
 	struct event ev_read;
 	struct event ev_write;
@@ -830,6 +847,9 @@ struct bufferevent {
 	struct event_watermark wm_read;
 	struct event_watermark wm_write;
 
+	struct event_drain drain_read;
+	struct event_drain drain_write;
+
 	evbuffercb readcb;
 	evbuffercb writecb;
 	everrorcb errorcb;
@@ -839,8 +859,18 @@ struct bufferevent {
 	int timeout_write;	/* in seconds */
 
 	short enabled;	/* events that are currently enabled */
+	short flags;	/* BUFFEREVENT_* flags, see below */
+
+	struct bufferevent *partner;	/* other end of an in-memory pair */
 };
 
+/* The bufferevent is one end of a pair created by bufferevent_pair_new() */
+#define BUFFEREVENT_PAIR	0x01
+/* Writes are scheduled from the event loop, see bufferevent_setdeferred() */
+#define BUFFEREVENT_DEFERRED	0x02
+/* A connect started by bufferevent_socket_connect() is in progress */
+#define BUFFEREVENT_CONNECTING	0x04
+
 
 /**
   Create a new bufferevent.
@@ -880,6 +910,71 @@ struct bufferevent *bufferevent_new(int fd,
     evbuffercb readcb, evbuffercb writecb, everrorcb errorcb, void *cbarg);
 
 
+/**
+  Create two linked in-memory bufferevents.
+
+  Data written to the output buffer of one end is moved directly into the
+  input buffer of the other end without going through the kernel.  The
+  transfer happens from the event loop, so the callbacks of both ends are
+  never invoked from within bufferevent_write().  Read watermarks and the
+  write low watermark behave as they do for socket based bufferevents.
+  Timeouts set with bufferevent_settimeout() are ignored for pairs.
+
+  Neither end has any callbacks after creation; they have to be assigned
+  with bufferevent_setcb() before the bufferevents are enabled.  When one
+  end is freed, its remaining output is handed to the other end, which then
+  sees EVBUFFER_EOF on its error callback.
+
+  @param base the event_base to use, or NULL for the current base
+  @param pair an array that receives the two new bufferevents
+  @return 0 if successful, or -1 if an error occurred
+  @see bufferevent_setcb(), bufferevent_free()
+ */
+int bufferevent_pair_new(struct event_base *base, struct bufferevent *pair[2]);
+
+
+/**
+  Changes the callbacks of a bufferevent.
+
+  @param bufev the bufferevent object for which to change callbacks
+  @param readcb callback to invoke when there is data to be read, or NULL if
+         no callback is desired
+  @param writecb callback to invoke when the output buffer has been drained,
+         or NULL if no callback is desired
+  @param errorcb callback to invoke when there is an error or EOF
+  @param cbarg an argument that will be supplied to each of the callbacks
+  @see bufferevent_new()
+ */
+void bufferevent_setcb(struct bufferevent *bufev,
+    evbuffercb readcb, evbuffercb writecb, everrorcb errorcb, void *cbarg);
+
+
+struct sockaddr;
+
+/**
+  Connect a bufferevent to a remote address without blocking.
+
+  If the bufferevent was created with a file descriptor of -1, a new
+  non-blocking stream socket is created for the address family of sa;
+  IPv4, IPv6 and Unix domain addresses are supported.  The caller is
+  responsible for closing it, see EVENT_FD(&bufev->ev_read).
+
+  The result of the connect is reported to the error callback: what is
+  EVBUFFER_CONNECTED on success, or EVBUFFER_WRITE combined with
+  EVBUFFER_ERROR or EVBUFFER_TIMEOUT on failure.  Data may be written and
+  reading may be enabled while the connect is in progress; the I/O starts
+  once the connection has been established.
+
+  @param bufev the bufferevent to connect
+  @param sa the address to connect to
+  @param socklen the length of the address
+  @param timeout the connect timeout in seconds, or 0 for no timeout
+  @return 0 if the connect was started, or -1 if an error occurred
+ */
+int bufferevent_socket_connect(struct bufferevent *bufev,
+    struct sockaddr *sa, int socklen, int timeout);
+
+
 /**
   Assign a bufferevent to a specific event_base.
 
@@ -983,6 +1078,44 @@ void bufferevent_settimeout(struct bufferevent *bufev,
     int timeout_read, int timeout_write);
 
 
+/**
+  Set the drain policy for a buffered event.
+
+  By default a bufferevent performs a single read or write system call
+  each time its file descriptor becomes ready.  A drain policy lets it keep
+  reading or writing until the call would block or until one of the limits
+  is reached.  The timeout is re-armed and the user callback is invoked only
+  once for all of the I/O done in a single wakeup.
+
+  Reads never exceed the byte limit; for writes the limit is checked
+  between system calls.  A limit of 0 means no limit.
+
+  @param bufev the bufferevent to be modified
+  @param events any combination of EV_READ | EV_WRITE
+  @param calls the maximum number of system calls per wakeup
+  @param bytes the maximum number of bytes per wakeup
+ */
+void bufferevent_setdrain(struct bufferevent *bufev, short events,
+    int calls, size_t bytes);
+
+
+/**
+  Enable or disable deferred writes for a buffered event.
+
+  Normally every bufferevent_write() re-registers the write event and
+  updates its timeout.  In deferred mode bufferevent_write() only appends
+  to the output buffer; the first write schedules the write callback to run
+  after the events that are currently active, where all the data that was
+  added in the meantime is written with as few system calls as possible.
+  This batches many small writes made from the same callback without
+  having to cork the socket.
+
+  @param bufev the bufferevent to be modified
+  @param deferred 1 to enable deferred writes, 0 to disable them
+ */
+void bufferevent_setdeferred(struct bufferevent *bufev, int deferred);
+
+
 #define EVBUFFER_LENGTH(x)	(x)->off
 #define EVBUFFER_DATA(x)	(x)->buffer
 #define EVBUFFER_INPUT(x)	(x)->input
@@ -1117,9 +1250,16 @@ int evbuffer_write(struct evbuffer *, int);
 /**
   Read from a file descriptor and store the result in an evbuffer.
 
+  The amount of data that is read at once adapts to the traffic seen by
+  the buffer: it doubles after a read that filled the requested size and
+  halves after a read that returned less than half of it.  The readsize,
+  nreads, nread_bytes, nread_full and nread_short members of the evbuffer
+  record the current size and how often it changed.
+
   @param buf the evbuffer to store the result
   @param fd the file descriptor to read from
-  @param howmuch the number of bytes to be read
+  @param howmuch the maximum number of bytes to be read, or -1 to let
+         the buffer decide
   @return the number of bytes read, or -1 if an error occurred
   @see evbuffer_write()
  */
@@ -59,11 +59,16 @@ extern "C" {
 #define HTTP_NOTMODIFIED	304
 #define HTTP_BADREQUEST		400
 #define HTTP_NOTFOUND		404
+#define HTTP_ENTITYTOOLARGE	413
+#define HTTP_BADGATEWAY		502
 #define HTTP_SERVUNAVAIL	503
 
 struct evhttp;
 struct evhttp_request;
 struct evkeyvalq;
+struct evhttp_header_arena;
+struct evhttp_deflate;
+struct evhttp_cb;
 
 /** Create a new HTTP server
  *
@@ -78,14 +83,33 @@ struct evhttp *evhttp_new(struct event_base *base);
  * Can be called multiple times to bind the same http server
  * to multiple different ports.
  *
+ * An address of the form "unix:/path" binds to a Unix domain socket
+ * instead; the port is ignored.  A stale socket at the path is replaced,
+ * but binding fails with EADDRINUSE while another server still accepts
+ * connections on it.  The socket is removed when the server is freed.
+ * On Linux, "unix:@name" binds to a name in the abstract namespace.
+ * The same addresses can be given to evhttp_connection_new().
+ *
  * @param http a pointer to an evhttp object
  * @param address a string containing the IP address to listen(2) on
  * @param port the port number to listen on
- * @return a newly allocated evhttp struct
- * @see evhttp_free()
+ * @return 0 on success, -1 on failure
+ * @see evhttp_free(), evhttp_accept_socket()
  */
 int evhttp_bind_socket(struct evhttp *http, const char *address, u_short port);
 
+/**
+ * Makes an HTTP server accept connections on a socket that has been bound
+ * already, e.g. one that was inherited or passed from another process.
+ * The socket is made to listen if it does not yet.  It is closed when the
+ * server is freed.
+ *
+ * @param http a pointer to an evhttp object
+ * @param fd a bound stream socket of any address family
+ * @return 0 on success, -1 on failure
+ */
+int evhttp_accept_socket(struct evhttp *http, int fd);
+
 /**
  * Free the previously created HTTP server.
  *
@@ -96,13 +120,66 @@ int evhttp_bind_socket(struct evhttp *http, const char *address, u_short port);
  */
 void evhttp_free(struct evhttp* http);
 
-/** Set a callback for a specified URI */
+enum evhttp_cmd_type { EVHTTP_REQ_GET, EVHTTP_REQ_POST, EVHTTP_REQ_HEAD };
+
+enum evhttp_request_kind { EVHTTP_REQUEST, EVHTTP_RESPONSE };
+
+/**
+ * Set a callback for a specified URI.
+ *
+ * The URI is matched against the path of a request, i.e. without the
+ * query.  A "*" segment matches any single path segment; as the last
+ * segment it matches the rest of the path, so that a callback can serve
+ * everything below a directory.  Exact segments take precedence over
+ * wildcards.  If several callbacks are set for the same URI, the first
+ * one wins.
+ */
 void evhttp_set_cb(struct evhttp *, const char *,
     void (*)(struct evhttp_request *, void *), void *);
 
-/** Removes the callback for a specified URI */
+/**
+ * Set a callback for a specified URI that is only called for requests of
+ * the given type.  Requests of other types continue to look for a match.
+ *
+ * @see evhttp_set_cb()
+ */
+void evhttp_set_method_cb(struct evhttp *, enum evhttp_cmd_type,
+    const char *, void (*)(struct evhttp_request *, void *), void *);
+
+/**
+ * Set a callback for a specified URI that receives the body of a request
+ * while it arrives.  chunk_cb is called whenever data was read; it finds
+ * the data in the input_buffer of the request, which is drained after it
+ * returned.  cb is called once the body is complete.
+ *
+ * @see evhttp_set_cb()
+ */
+void evhttp_set_chunked_cb(struct evhttp *, const char *,
+    void (*chunk_cb)(struct evhttp_request *, void *),
+    void (*cb)(struct evhttp_request *, void *), void *);
+
+/**
+ * Like evhttp_set_chunked_cb() but chunk_cb finds the data in chunk_data
+ * and chunk_len of the request without it being copied.  Chunks are handed
+ * over as they arrive, even before a chunk is complete.
+ *
+ * @see evhttp_set_chunked_cb()
+ */
+void evhttp_set_chunked_view_cb(struct evhttp *, const char *,
+    void (*chunk_cb)(struct evhttp_request *, void *),
+    void (*cb)(struct evhttp_request *, void *), void *);
+
+/** Removes the first callback for a specified URI */
 int evhttp_del_cb(struct evhttp *, const char *);
 
+/**
+ * Passes requests for a specified URI on to an upstream server.
+ *
+ * @see evhttp_proxy_new()
+ */
+struct evhttp_proxy;
+void evhttp_set_proxy(struct evhttp *, const char *, struct evhttp_proxy *);
+
 /** Set a callback for all requests that are not caught by specific callbacks
  */
 void evhttp_set_gencb(struct evhttp *,
@@ -116,6 +193,179 @@ void evhttp_set_gencb(struct evhttp *,
  */
 void evhttp_set_timeout(struct evhttp *, int timeout_in_secs);
 
+/**
+ * Compress the bodies of responses with gzip or deflate if the client
+ * accepts one of them.  Replies sent as a whole are only compressed if
+ * they have at least min_size bytes and no Content-Length set by the
+ * caller; replies sent with evhttp_send_reply_chunk() are compressed
+ * chunk by chunk.  Every reply that could have been compressed carries
+ * Vary: Accept-Encoding.
+ *
+ * @param level the zlib compression level from 1 to 9, -1 for the
+ *   default level or 0 to turn compression off
+ * @return 0 on success, -1 if the level is invalid or libevent was built
+ *   without zlib (configure --without-zlib)
+ */
+int evhttp_set_compression(struct evhttp *, int level, size_t min_size);
+
+/** Counters of the response cache of an http server */
+struct evhttp_cache_stats {
+	ev_uint64_t hits;		/* served from the cache */
+	ev_uint64_t misses;		/* passed on to the callbacks */
+	ev_uint64_t evictions;		/* dropped to make room */
+	size_t size;			/* bytes held by the cache */
+	int entries;
+};
+
+/**
+ * Cache responses to GET and HEAD requests in memory.  A response is
+ * stored if it allows caching with a max-age or s-maxage in its
+ * Cache-Control header and does not vary with a request header that is
+ * not a key header; later requests with the same method, URI and key
+ * headers are answered from the cache without calling a callback until
+ * the response expired.  Host is always a key header.  The least recently
+ * used responses are dropped once the cache holds more than max_size
+ * bytes.
+ *
+ * @param max_size the memory used by the cache; 0 turns the cache off
+ * @return 0 on success, -1 on failure
+ */
+int evhttp_set_cache(struct evhttp *, size_t max_size);
+
+/**
+ * Make a request header part of the cache key, for example if responses
+ * depend on Accept-Language.
+ *
+ * @return 0 on success, -1 if the cache is off or too many headers are set
+ */
+int evhttp_cache_add_key_header(struct evhttp *, const char *header);
+
+/** Drops all cached responses */
+void evhttp_cache_flush(struct evhttp *);
+
+/** Returns the counters of the response cache */
+void evhttp_cache_get_stats(struct evhttp *, struct evhttp_cache_stats *);
+
+/** The phases of a request that the server keeps histograms of */
+enum evhttp_phase {
+	EVHTTP_PHASE_HEADERS,		/* first byte read to headers parsed */
+	EVHTTP_PHASE_BODY,		/* headers parsed to body complete */
+	EVHTTP_PHASE_CALLBACK,		/* user callback called to returned */
+	EVHTTP_PHASE_REPLY,		/* body complete to first byte written */
+	EVHTTP_PHASE_WRITE,		/* first to last byte written */
+	EVHTTP_PHASE_TOTAL,		/* first byte read to last byte written */
+	EVHTTP_PHASE_MAX
+};
+
+#define EVHTTP_STATS_BUCKETS	24
+
+/**
+ * Durations of a phase.  Bucket i counts the durations of less than 2^i
+ * microseconds that did not fit a smaller bucket; the last bucket counts
+ * all longer ones.
+ */
+struct evhttp_histogram {
+	ev_uint64_t count;
+	ev_uint64_t total_usec;
+	ev_uint64_t max_usec;
+	ev_uint64_t buckets[EVHTTP_STATS_BUCKETS];
+};
+
+/** Counters of an http server since it started or the last reset */
+struct evhttp_stats {
+	struct timeval since;		/* when counting started */
+	double requests_per_sec;	/* requests over the time since then */
+	int active_connections;
+	ev_uint64_t connections;	/* accepted */
+	ev_uint64_t requests;		/* replies completely written */
+	ev_uint64_t parse_errors;	/* bad request lines or headers */
+	ev_uint64_t rejected;		/* answered with 503 when overloaded */
+	ev_uint64_t shed;		/* idle connections closed for room */
+	ev_uint64_t log_dropped;	/* access log lines without room */
+	ev_uint64_t bytes_in;
+	ev_uint64_t bytes_out;
+	struct evhttp_histogram phases[EVHTTP_PHASE_MAX];
+};
+
+/**
+ * Returns the counters of an http server.  They are always kept; a
+ * request costs a few additions and reading the clock once before its
+ * callback.
+ */
+void evhttp_get_stats(struct evhttp *, struct evhttp_stats *);
+
+/** Starts counting again; active_connections is kept */
+void evhttp_reset_stats(struct evhttp *);
+
+/**
+ * Log every reply of a server to fd.  Lines are formatted into a ring
+ * buffer and written out in batches from a timer, so that a request does
+ * not cost a system call of its own; lines that do not fit into the ring
+ * are dropped and counted in log_dropped.
+ *
+ * The flags of fd are left alone.  A pipe or socket that the caller made
+ * non-blocking never holds up the server, as what it does not take stays
+ * in the ring until the next flush; a write to a regular file may still
+ * wait for a slow disk.
+ *
+ * The format knows %h (remote host), %t (time), %r (request line),
+ * %m (method), %U (uri), %s (status), %b (bytes written, headers
+ * included), %D (microseconds from the first byte read to the last byte
+ * written), %{Name}i (a request header) and %%.
+ *
+ * @param fd the file to write to; -1 turns logging off
+ * @param format the format of a line, or NULL for the common log format
+ * @param size the size of the ring buffer, or 0 for a default
+ * @return 0 on success, -1 on failure
+ */
+int evhttp_set_access_log(struct evhttp *, int fd, const char *format,
+    size_t size);
+
+/**
+ * Limit the size of the request line and headers of a request; larger
+ * requests are answered with 400 Bad Request.  -1 means no limit.
+ */
+void evhttp_set_max_headers_size(struct evhttp *, ev_int64_t max_size);
+
+/**
+ * Limit the size of the body of a request; larger requests are answered
+ * with 413 Request Entity Too Large as soon as the length is known.  -1
+ * means no limit.
+ */
+void evhttp_set_max_body_size(struct evhttp *, ev_int64_t max_size);
+
+/**
+ * Limit the number of connections of a server.  At the limit, a new
+ * connection takes the place of a persistent connection that waits for
+ * another request, the longest waiting first; if there are none, no more
+ * connections are accepted until one was closed or waits.  -1 means no
+ * limit.
+ */
+void evhttp_set_max_connections(struct evhttp *, int max);
+
+/**
+ * Limit the number of requests that a server works on at the same time.
+ * A request beyond the limit is answered with 503 Service Unavailable as
+ * soon as its headers were read.  -1 means no limit.
+ */
+void evhttp_set_max_requests(struct evhttp *, int max);
+
+/**
+ * Limit the bytes of replies that wait to be written by a server; new
+ * requests are answered with 503 Service Unavailable while more is
+ * queued.  -1 means no limit.
+ */
+void evhttp_set_max_queued(struct evhttp *, ev_int64_t max_size);
+
+/**
+ * Limit the number of finished request and connection objects that are
+ * kept to be reused for new requests.
+ *
+ * @param http an evhttp object
+ * @param max the number of objects of each kind; 0 disables pooling
+ */
+void evhttp_set_max_pooled(struct evhttp *, int max);
+
 /* Request/Response functionality */
 
 /**
@@ -144,6 +394,45 @@ void evhttp_send_reply_start(struct evhttp_request *, int, const char *);
 void evhttp_send_reply_chunk(struct evhttp_request *, struct evbuffer *);
 void evhttp_send_reply_end(struct evhttp_request *);
 
+/*
+ * Broadcasts: the same chunk to many streaming replies.
+ *
+ * A broadcast encodes each message once and shares it between all
+ * subscribed requests, which must have been started with
+ * evhttp_send_reply_start().  A subscriber whose unsent data would grow
+ * beyond the maximum backlog is disconnected; its close callback tells
+ * the user.  evhttp_send_reply_end() ends the subscription.
+ */
+
+struct evhttp_broadcast;
+
+/** Creates a broadcast without subscribers */
+struct evhttp_broadcast *evhttp_broadcast_new(void);
+
+/** Frees a broadcast; the subscribed streams stay open */
+void evhttp_broadcast_free(struct evhttp_broadcast *);
+
+/** Sets how many bytes a subscriber may have pending; 0 means no limit */
+void evhttp_broadcast_set_max_backlog(struct evhttp_broadcast *, size_t);
+
+/** Subscribes a started reply; returns -1 if its connection is gone */
+int evhttp_broadcast_add(struct evhttp_broadcast *, struct evhttp_request *);
+
+/** Unsubscribes a reply; does nothing if it is not subscribed */
+void evhttp_broadcast_remove(struct evhttp_broadcast *,
+    struct evhttp_request *);
+
+/** Returns the number of subscribed replies */
+int evhttp_broadcast_get_subscribers(struct evhttp_broadcast *);
+
+/**
+ * Sends the contents of the buffer as one chunk to every subscriber and
+ * drains the buffer.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int evhttp_broadcast_send(struct evhttp_broadcast *, struct evbuffer *);
+
 /**
  * Start an HTTP server on the specified address and port
  *
@@ -158,9 +447,22 @@ struct evhttp *evhttp_start(const char *address, u_short port);
 /*
  * Interfaces for making requests
  */
-enum evhttp_cmd_type { EVHTTP_REQ_GET, EVHTTP_REQ_POST, EVHTTP_REQ_HEAD };
 
-enum evhttp_request_kind { EVHTTP_REQUEST, EVHTTP_RESPONSE };
+/**
+ * When the phases of a request happened, taken from a monotonic clock
+ * where the system has one; only their differences are meaningful.  Phases that did not happen yet are zero.  Only requests
+ * received by a server are accepted and have their callback timed.
+ */
+struct evhttp_request_timing {
+	struct timeval accepted;	/* the connection was accepted */
+	struct timeval first_read;	/* first byte of the request read */
+	struct timeval headers_done;	/* request line and headers parsed */
+	struct timeval body_done;	/* body complete */
+	struct timeval cb_start;	/* user callback called */
+	struct timeval cb_end;		/* user callback returned */
+	struct timeval first_write;	/* first byte of the reply written */
+	struct timeval last_write;	/* last byte of the reply written */
+};
 
 /**
  * the request structure that a server receives.
@@ -182,9 +484,17 @@ struct {
 	int flags;
 #define EVHTTP_REQ_OWN_CONNECTION	0x0001
 #define EVHTTP_PROXY_REQUEST		0x0002
+#define EVHTTP_REQ_CHUNK_VIEW		0x0004	/* chunk_cb gets chunk_data */
+#define EVHTTP_REQ_CACHEABLE		0x0008	/* reply goes into the cache */
+#define EVHTTP_REQ_BODY_PENDING	0x0010	/* more of the body follows */
+#define EVHTTP_REQ_IN_FLIGHT	0x0020	/* counted against max_requests */
+#define EVHTTP_REQ_STREAM_BODY	0x0040	/* chunk_cb gets partial bodies */
 
 	struct evkeyvalq *input_headers;
 	struct evkeyvalq *output_headers;
+	struct evhttp_header_arena *header_arena; /* input header storage */
+	struct evhttp_deflate *deflate;	/* compressor of a streamed reply */
+	struct evhttp_cb *route;	/* callback matched by the server */
 
 	/* address of the remote host and the port connection came from */
 	char *remote_host;
@@ -199,12 +509,16 @@ struct {
 	char minor;			/* HTTP Minor number */
 
 	int got_firstline;
+	size_t line_scanned;		/* bytes of the current line scanned */
 	int response_code;		/* HTTP Response code */
 	char *response_code_line;	/* Readable response */
 
 	struct evbuffer *input_buffer;	/* read data */
 	ev_int64_t ntoread;
 	int chunked;
+	size_t headers_size;		/* bytes of headers read */
+	ev_int64_t body_size;		/* bytes of body read */
+	ev_int64_t bytes_written;	/* of the request or reply */
 
 	struct evbuffer *output_buffer;	/* outgoing post or data */
 
@@ -215,9 +529,22 @@ struct {
 	/*
 	 * Chunked data callback - call for each completed chunk if
 	 * specified.  If not specified, all the data is delivered via
-	 * the regular callback.
+	 * the regular callback.  With EVHTTP_REQ_STREAM_BODY, which the
+	 * server sets for evhttp_set_chunked_cb(), it is called whenever
+	 * body data arrived.
 	 */
 	void (*chunk_cb)(struct evhttp_request *, void *);
+	void *chunk_cb_arg;		/* cb_arg unless set by the server */
+
+	/*
+	 * With EVHTTP_REQ_CHUNK_VIEW, chunk_cb finds the data in place in
+	 * the read buffer of the connection instead of in input_buffer.
+	 * The data is only valid until chunk_cb returns.
+	 */
+	const u_char *chunk_data;
+	size_t chunk_len;
+
+	struct evhttp_request_timing timing;
 };
 
 /**
@@ -228,7 +555,10 @@ struct {
 struct evhttp_request *evhttp_request_new(
 	void (*cb)(struct evhttp_request *, void *), void *arg);
 
-/** enable delivery of chunks to requestor */
+/**
+ * enable delivery of chunks to requestor; if the request has the flag
+ * EVHTTP_REQ_CHUNK_VIEW the chunks are delivered in place.
+ */
 void evhttp_request_set_chunked_cb(struct evhttp_request *,
     void (*cb)(struct evhttp_request *, void *));
 
@@ -254,10 +584,28 @@ void evhttp_connection_set_local_address(struct evhttp_connection *evcon,
 void evhttp_connection_set_timeout(struct evhttp_connection *evcon,
     int timeout_in_secs);
 
+/** Limits the size of the headers received on this connection */
+void evhttp_connection_set_max_headers_size(struct evhttp_connection *evcon,
+    ev_int64_t max_size);
+
+/** Limits the size of the bodies received on this connection */
+void evhttp_connection_set_max_body_size(struct evhttp_connection *evcon,
+    ev_int64_t max_size);
+
 /** Sets the retry limit for this connection - -1 repeats indefnitely */
 void evhttp_connection_set_retries(struct evhttp_connection *evcon,
     int retry_max);
 
+/**
+ * Sets how many requests may be sent on this connection before the
+ * response to the first of them arrived; 1, the default, disables
+ * pipelining.  POST requests are never pipelined.  If the connection
+ * fails, all requests that have been sent on it fail; requests that
+ * were not sent yet are retried on a new connection.
+ */
+void evhttp_connection_set_pipeline(struct evhttp_connection *evcon,
+    int depth);
+
 /** Set a callback for connection close. */
 void evhttp_connection_set_closecb(struct evhttp_connection *evcon,
     void (*)(struct evhttp_connection *, void *), void *);
@@ -278,6 +626,55 @@ int evhttp_make_request(struct evhttp_connection *evcon,
     struct evhttp_request *req,
     enum evhttp_cmd_type type, const char *uri);
 
+/**
+ * A pool of persistent client connections.  Requests made through the
+ * pool are sent on an idle connection to the same host and port if there
+ * is one, on a new connection if the host has fewer than the maximum
+ * number of connections, and are queued otherwise.  Connections that stay
+ * idle are closed after the idle timeout.
+ */
+struct evhttp_pool;
+
+/** Creates a connection pool; base may be NULL for the current base */
+struct evhttp_pool *evhttp_pool_new(struct event_base *base);
+
+/** Frees the pool, its connections and all requests still queued */
+void evhttp_pool_free(struct evhttp_pool *pool);
+
+/** Sets the maximum number of connections per host and port */
+void evhttp_pool_set_max_connections(struct evhttp_pool *pool, int max);
+
+/** Sets after how many seconds an idle connection is closed; -1 never */
+void evhttp_pool_set_idle_timeout(struct evhttp_pool *pool,
+    int timeout_in_secs);
+
+/** Sets the timeout for events related to the pool's connections */
+void evhttp_pool_set_timeout(struct evhttp_pool *pool, int timeout_in_secs);
+
+/** The pool gets ownership of the request */
+int evhttp_pool_make_request(struct evhttp_pool *pool,
+    const char *address, unsigned short port,
+    struct evhttp_request *req,
+    enum evhttp_cmd_type type, const char *uri);
+
+/**
+ * A reverse proxy.  Requests are sent to the upstream server through
+ * connections of the pool, and bodies are streamed in both directions as
+ * they arrive instead of being buffered.  Reading from one side stops
+ * while more than the maximum backlog waits to be written to the other.
+ * Hop-by-hop headers are removed and X-Forwarded-For is added; all other
+ * headers are passed on unchanged.  The pool and the proxy must outlive
+ * the requests that are in flight.
+ */
+struct evhttp_proxy *evhttp_proxy_new(struct evhttp_pool *pool,
+    const char *address, unsigned short port);
+
+/** Frees the proxy */
+void evhttp_proxy_free(struct evhttp_proxy *proxy);
+
+/** Sets how many bytes may wait for a slow side before reading stops */
+void evhttp_proxy_set_max_backlog(struct evhttp_proxy *proxy, size_t size);
+
 const char *evhttp_request_uri(struct evhttp_request *req);
 
 /* Interfaces for dealing with HTTP headers */
@@ -300,6 +697,20 @@ void evhttp_clear_headers(struct evkeyvalq *);
  */
 char *evhttp_encode_uri(const char *uri);
 
+/**
+  Appends the URI-encoding of the first len bytes of uri to a buffer.
+
+  The encoding is written directly into the buffer without intermediate
+  copies.
+
+  @param buf the evbuffer to append to
+  @param uri an unencoded URI, not necessarily NUL-terminated
+  @param len the number of bytes to encode
+  @return 0 on success, -1 on failure
+ */
+int evhttp_encode_uri_buffer(struct evbuffer *buf, const char *uri,
+    size_t len);
+
 
 /**
   Helper function to decode a URI.
@@ -311,6 +722,22 @@ char *evhttp_encode_uri(const char *uri);
  */
 char *evhttp_decode_uri(const char *uri);
 
+/**
+  Decodes the first len bytes of a URI into caller-provided space.
+
+  The result is NUL-terminated and never longer than the input, so out
+  must hold len + 1 bytes and may be the same as uri.  A '+' is decoded
+  as a space after a '?', or everywhere if decode_plus is set.
+
+  @param out where to store the decoded URI
+  @param uri an encoded URI, not necessarily NUL-terminated
+  @param len the number of bytes to decode
+  @param decode_plus whether the input is part of a query
+  @return the length of the decoded URI
+ */
+size_t evhttp_decode_uri_buffer(char *out, const char *uri, size_t len,
+    int decode_plus);
+
 
 /**
  * Helper function to parse out arguments in a query.
@@ -319,6 +746,31 @@ char *evhttp_decode_uri(const char *uri);
  */
 void evhttp_parse_query(const char *uri, struct evkeyvalq *);
 
+/** Iterator over the arguments in the query of a URI */
+struct evhttp_query_iter {
+	const char *next;
+	const char *end;
+};
+
+/**
+ * Prepares an iterator over the query arguments of a URI.
+ *
+ * The URI must stay valid while the iterator is in use.
+ */
+void evhttp_query_iter_init(struct evhttp_query_iter *, const char *uri);
+
+/**
+ * Returns the next argument of a query without allocating any memory.
+ *
+ * Key and value point into the URI and are still encoded; use
+ * evhttp_decode_uri_buffer() to decode them.  If the argument has no '='
+ * the value is NULL.
+ *
+ * @return 1 if an argument was returned, 0 at the end of the query
+ */
+int evhttp_query_next(struct evhttp_query_iter *iter,
+    const char **key, size_t *keylen, const char **value, size_t *valuelen);
+
 
 /**
  * Escape HTML character entities in a string.
@@ -13,6 +13,11 @@
 #define HTTP_CONNECT_TIMEOUT	45
 #define HTTP_WRITE_TIMEOUT	50
 #define HTTP_READ_TIMEOUT	50
+#define HTTP_BROADCAST_BACKLOG	(256 * 1024)
+#define HTTP_PROXY_BACKLOG	(64 * 1024)
+#define HTTP_LOG_SIZE		(256 * 1024)
+#define HTTP_LOG_FLUSH_MSEC	250
+#define HTTP_LOG_LINE_MAX	2048
 
 #define HTTP_PREFIX		"http://"
 #define HTTP_DEFAULTPORT	80
@@ -20,12 +25,15 @@
 enum evhttp_connection_error {
 	EVCON_HTTP_TIMEOUT,
 	EVCON_HTTP_EOF,
-	EVCON_HTTP_INVALID_HEADER
+	EVCON_HTTP_INVALID_HEADER,
+	EVCON_HTTP_DATA_TOO_LONG
 };
 
 struct evbuffer;
 struct addrinfo;
 struct evhttp_request;
+struct evhttp_dns_request;
+struct evhttp_deflate;
 
 /* A stupid connection object - maybe make this a bufferevent later */
 
@@ -37,13 +45,36 @@ enum evhttp_connection_state {
 
 struct event_base;
 
+struct evhttp_pool_host;
+
+/*
+ * Data that a connection writes without copying it into its output buffer;
+ * release is called once it has been written or the connection is gone.
+ */
+struct evhttp_segment {
+	TAILQ_ENTRY(evhttp_segment) next;
+	const u_char *data;
+	size_t len;			/* bytes left to write */
+	void (*release)(void *);
+	void *arg;
+};
+
+TAILQ_HEAD(evhttp_segmentq, evhttp_segment);
+
+#define EVHTTP_SEGMENTS_IOV	16	/* segments written at once */
+#define EVHTTP_CHUNK_HEADER_MAX	(sizeof(size_t) * 2 + 2) /* hex size, CRLF */
+
 struct evhttp_connection {
-	/* we use tailq only if they were created for an http server */
+	/* on the list of an http server or of a client pool */
 	TAILQ_ENTRY(evhttp_connection) (next);
 
 	int fd;
-	struct event ev;
+	struct event ev;		/* persistent while reading or writing */
 	struct event close_ev;
+	struct event timer_ev;		/* fires once ev was idle too long */
+	struct timeval last_io;
+	struct timeval accepted;	/* for server connections */
+	int io_timeout;			/* seconds the timer_ev waits */
 	struct evbuffer *input_buffer;
 	struct evbuffer *output_buffer;
 	
@@ -52,14 +83,26 @@ struct evhttp_connection {
 	char *address;			/* address to connect to */
 	u_short port;
 
+	struct evhttp_dns_request *dns_req; /* pending name resolution */
+
 	int flags;
 #define EVHTTP_CON_INCOMING	0x0001	/* only one request on it ever */
 #define EVHTTP_CON_OUTGOING	0x0002  /* multiple requests possible */
 #define EVHTTP_CON_CLOSEDETECT  0x0004  /* detecting if persistent close */
+#define EVHTTP_CON_PAUSED	0x0008	/* stop reading after this data */
+#define EVHTTP_CON_STALLED	0x0010	/* paused and no longer reading */
+#define EVHTTP_CON_IDLE		0x0020	/* waits for another request */
 
 	int timeout;			/* timeout in seconds for events */
+	int idle_timeout;		/* close after being idle this long */
 	int retry_cnt;			/* retry count */
 	int retry_max;			/* maximum number of retries */
+
+	ev_int64_t max_headers_size;	/* -1 for no limit */
+	ev_int64_t max_body_size;
+
+	int pipeline_max;		/* requests in flight at most */
+	int npipelined;			/* requests sent and not answered */
 	
 	enum evhttp_connection_state state;
 
@@ -75,32 +118,296 @@ struct evhttp_connection {
 	void *closecb_arg;
 
 	struct event_base *base;
+
+	/* for client connections that belong to a pool */
+	struct evhttp_pool_host *pool_host;
+
+	/* shared data that is written after output_buffer */
+	struct evhttp_segmentq segments;
+	size_t segments_len;
+
+	/* the broadcast that the streamed reply on it subscribed to */
+	struct evhttp_broadcast *broadcast;
+	TAILQ_ENTRY(evhttp_connection) broadcast_next;
+
+	/* server connections that wait for another request */
+	TAILQ_ENTRY(evhttp_connection) idle_next;
+	size_t queued;			/* output counted by the server */
+
+	/* the request on it that is passed on by a proxy */
+	struct evhttp_proxy_request *proxy;
 };
 
 struct evhttp_cb {
 	TAILQ_ENTRY(evhttp_cb) next;
 
 	char *what;
+	int methods;			/* bit mask of 1 << evhttp_cmd_type */
+#define EVHTTP_METHOD_ANY	(~0)
 
 	void (*cb)(struct evhttp_request *req, void *);
+	void (*chunk_cb)(struct evhttp_request *req, void *);
+	int chunk_view;			/* chunk_cb takes data in place */
 	void *cbarg;
+
+	struct evhttp_proxy *proxy;	/* passes the requests upstream */
+
+	struct evhttp_cb *route_next;	/* same route, registration order */
+};
+
+/*
+ * Callbacks are looked up in a trie of '/' separated URI segments.  A "*"
+ * segment matches any single segment, a trailing "*" matches whatever is
+ * left of the path.  Children are kept sorted for a binary search.
+ */
+
+struct evhttp_route {
+	char *segment;
+	size_t seglen;
+
+	struct evhttp_route **children;
+	int nchildren;
+	struct evhttp_route *wildcard;	/* child for a "*" segment */
+
+	struct evhttp_cb *exact;	/* paths that end at this node */
+	struct evhttp_cb *rest;		/* paths with more segments */
+};
+
+/*
+ * Headers parsed from the wire are stored in a per-request arena that is
+ * released in one go when the request is freed.  Each such header also
+ * points back to the arena, so that lookups on the list can use a small
+ * open addressing index keyed by a case-insensitive hash of the name.
+ */
+
+#define EVKEYVAL_ARENA		0x0001	/* allocated from a header arena */
+#define EVKEYVAL_REMOVED	0x0002	/* unlinked, memory still in arena */
+
+#define EVHTTP_HEADER_INDEX_SIZE	32	/* power of two */
+#define EVHTTP_HEADER_INDEX_MAX		24	/* fall back to a scan above */
+#define EVHTTP_ARENA_CHUNK		1024
+
+#define EVHTTP_DNS_CACHE_SIZE	64	/* host names resolved by evdns */
+#define EVHTTP_DNS_NAME_MAX	256	/* longer names are not cached */
+
+#define EVHTTP_POOL_MAX		64	/* idle requests and connections */
+#define EVHTTP_POOL_BUFFER_MAX	65536	/* larger buffers are not kept */
+
+struct evhttp_arena_chunk {
+	struct evhttp_arena_chunk *next;
+	size_t size;
+	size_t off;
+	/* data follows */
+};
+
+struct evhttp_header_arena {
+	struct evkeyvalq *headers;	/* the list that is indexed */
+	struct evkeyval *last;		/* last header when index was updated */
+	int nindexed;
+	int overflow;			/* too many names to index */
+
+	struct {
+		u_int hash;
+		struct evkeyval *header;	/* first header with this name */
+	} index[EVHTTP_HEADER_INDEX_SIZE];
+
+	struct evhttp_arena_chunk *chunks;
+};
+
+struct evhttp_header {
+	struct evkeyval kv;		/* must be first */
+	struct evhttp_header_arena *arena;
 };
 
 /* both the http server as well as the rpc system need to queue connections */
 TAILQ_HEAD(evconq, evhttp_connection);
 
-struct evhttp {
+/* connections and waiting requests of a client pool for one host */
+struct evhttp_pool_host {
+	TAILQ_ENTRY(evhttp_pool_host) next;
+
+	char *address;
+	u_short port;
+
+	struct evconq connections;
+	int nconnections;
+
+	/* requests that wait for a connection to become idle */
+	struct evcon_requestq requests;
+
+	struct evhttp_pool *pool;
+};
+
+struct evhttp_pool {
+	TAILQ_HEAD(evhttp_pool_hostq, evhttp_pool_host) hosts;
+
+	int max_connections;		/* per host */
+	int idle_timeout;
+	int timeout;
+
+	struct event_base *base;
+};
+
+#define EVHTTP_POOL_MAX_CONNECTIONS	4
+#define EVHTTP_POOL_IDLE_TIMEOUT	60
+
+/* a socket that a server accepts connections on */
+struct evhttp_bound_socket {
+	TAILQ_ENTRY(evhttp_bound_socket) next;
+
 	struct event bind_ev;
+	char *path;			/* of a Unix socket that we created */
+};
+
+#define EVHTTP_UNIX_PREFIX	"unix:"	/* addresses of Unix sockets */
+
+struct evhttp {
+	TAILQ_HEAD(boundq, evhttp_bound_socket) sockets;
 
 	TAILQ_HEAD(httpcbq, evhttp_cb) callbacks;
+	struct evhttp_route routes;
         struct evconq connections;
 
         int timeout;
 
+	ev_int64_t max_headers_size;
+	ev_int64_t max_body_size;
+
 	void (*gencb)(struct evhttp_request *req, void *);
 	void *gencbarg;
 
 	struct event_base *base;
+
+	/* finished requests and connections that are kept for reuse */
+	struct evcon_requestq free_requests;
+	struct evconq free_connections;
+	int nfree_requests;
+	int nfree_connections;
+	int max_pooled;
+
+	/* response compression; a level of 0 turns it off */
+	int compress_level;
+	size_t compress_min_size;
+	struct evhttp_deflate *free_deflate;
+	int nfree_deflate;
+
+	/* the Date header; emptied by date_ev when its second is over */
+	struct event date_ev;
+	char date[32];
+
+	struct evhttp_cache *cache;	/* NULL unless responses are cached */
+
+	struct evhttp_stats *stats;
+	struct evhttp_access_log *access_log;	/* NULL unless logging */
+	struct evhttp_request *dispatching; /* its callback is running */
+
+	/* overload protection; -1 for no limit */
+	int max_connections;
+	int max_requests;
+	ev_int64_t max_queued;
+	int nrequests;			/* requests being worked on */
+	size_t queued;			/* reply bytes not yet written */
+	int accept_paused;
+	struct evconq idle_connections;	/* longest idle first */
+};
+
+/*
+ * A cached response.  The entry is a single allocation that holds the key,
+ * the headers and the body; it is shared with the connections that are
+ * writing its body and freed once the last reference is gone.
+ */
+struct evhttp_cache_entry {
+	TAILQ_ENTRY(evhttp_cache_entry) next;	/* most recently used first */
+	struct evhttp_cache_entry *hash_next;
+	u_int hash;
+	int refcnt;			/* the cache and writing connections */
+	size_t size;			/* memory accounted to the cache */
+	time_t stored;
+	time_t expires;
+
+	char *key;
+	size_t keylen;
+	int code;
+	char *reason;
+	struct {
+		char *key;
+		char *value;
+	} *headers;
+	int nheaders;
+	u_char *body;
+	size_t body_len;
+};
+
+TAILQ_HEAD(evhttp_cacheq, evhttp_cache_entry);
+
+#define EVHTTP_CACHE_KEY_MAX		1024
+#define EVHTTP_CACHE_KEY_HEADERS	8
+#define EVHTTP_CACHE_MIN_BUCKETS	64
+
+struct evhttp_cache {
+	struct evhttp_cache_entry **buckets;
+	u_int nbuckets;
+	struct evhttp_cacheq entries;	/* in LRU order */
+	size_t max_size;
+
+	/* request headers that are part of the key besides method and URI */
+	char *key_headers[EVHTTP_CACHE_KEY_HEADERS];
+	int nkey_headers;
+
+	ev_uint64_t hits;
+	ev_uint64_t misses;
+	ev_uint64_t evictions;
+	size_t size;			/* bytes held by all entries */
+	int nentries;
+};
+
+/* a chunk that is shared by all subscribers of a broadcast */
+struct evhttp_broadcast_msg {
+	int refcnt;
+	size_t hdrlen;			/* length of the chunk header */
+	size_t len;			/* header, payload and trailing CRLF */
+	u_char data[1];
+};
+
+struct evhttp_broadcast {
+	TAILQ_HEAD(evhttp_subscriberq, evhttp_connection) subscribers;
+	int nsubscribers;
+	size_t max_backlog;		/* 0 for no limit */
+};
+
+struct evhttp_proxy {
+	struct evhttp_pool *pool;
+	char *address;			/* of the upstream server */
+	u_short port;
+	size_t max_backlog;
+};
+
+/* a client request and the request that passes it on upstream */
+struct evhttp_proxy_request {
+	struct evhttp_proxy *proxy;
+	struct evhttp_request *req;	/* NULL once the client is gone */
+	struct evhttp_request *upstream; /* NULL once it completed */
+	int chunked;			/* the body goes upstream chunked */
+	int body_done;			/* the client sent all of the body */
+	int replying;			/* the reply to the client started */
+};
+
+/*
+ * The access log of a server.  Lines are collected in a ring buffer and
+ * written from a timer, never while a request is handled.
+ */
+struct evhttp_access_log {
+	int fd;
+	char *format;
+	char *ring;
+	size_t size;
+	size_t head;			/* first byte not written yet */
+	size_t len;			/* bytes waiting in the ring */
+	struct event flush_ev;
+
+	/* the time is formatted at most once per second */
+	time_t date_sec;
+	char date[32];
 };
 
 /* resets the connection; can be reused for more requests */
@@ -46,14 +46,17 @@
 #ifndef WIN32
 #include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/un.h>
 #endif
 
 #include <sys/queue.h>
 
 #ifndef WIN32
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <netdb.h>
 #endif
 
@@ -64,6 +67,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -78,6 +82,10 @@
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
+#if defined(HAVE_LIBZ) && defined(HAVE_ZLIB_H)
+#define EVHTTP_ZLIB
+#include <zlib.h>
+#endif
 
 #undef timeout_pending
 #undef timeout_initialized
@@ -86,6 +94,7 @@
 #include "event.h"
 #include "evhttp.h"
 #include "evutil.h"
+#include "evdns.h"
 #include "log.h"
 #include "http-internal.h"
 
@@ -151,7 +160,11 @@ fake_freeaddrinfo(struct addrinfo *ai)
 
 extern int debug;
 
-static int socket_connect(int fd, const char *address, unsigned short port);
+static int socket_connect_sa(int fd, struct sockaddr *sa, socklen_t salen);
+#ifndef WIN32
+static int unix_address(const char *, struct sockaddr_un *, socklen_t *);
+static int bind_socket_unix(struct sockaddr_un *, socklen_t);
+#endif
 static int bind_socket_ai(struct addrinfo *);
 static int bind_socket(const char *, u_short);
 static void name_from_addr(struct sockaddr *, socklen_t, char **, char **);
@@ -162,10 +175,37 @@ static void evhttp_connection_start_detectclose(
 static void evhttp_connection_stop_detectclose(
 	struct evhttp_connection *evcon);
 static void evhttp_request_dispatch(struct evhttp_connection* evcon);
+static void evhttp_connection_connect_failed(struct evhttp_connection *);
+static void evhttp_connection_cancel_resolve(struct evhttp_connection *);
+static void evhttp_pool_connection_idle(struct evhttp_connection *);
+static void evhttp_parse_header(struct evhttp_connection *);
+static void evhttp_read_buffered(int, short, void *);
+static void evhttp_deliver_chunk(struct evhttp_request *);
+static int evhttp_body_too_long(struct evhttp_connection *,
+    struct evhttp_request *);
+static struct evhttp_cb *evhttp_dispatch_callback(struct evhttp *,
+    struct evhttp_request *);
+static void evhttp_header_arena_reset(struct evhttp_header_arena *);
+static void evhttp_trim_pools(struct evhttp *);
+static void evhttp_cache_store(struct evhttp *, struct evhttp_request *);
+static void evhttp_stats_request_done(struct evhttp *,
+    struct evhttp_request *);
+static int evhttp_admit_request(struct evhttp *, struct evhttp_request *);
+static void evhttp_access_log_request(struct evhttp *,
+    struct evhttp_request *);
+static void evhttp_resume_accept(struct evhttp *);
+static void evhttp_limit_connections(struct evhttp *);
+static void evhttp_broadcast_unlink(struct evhttp_connection *);
+static struct evhttp_proxy_request *evhttp_proxy_start(
+	struct evhttp_request *, struct evhttp_proxy *);
+static void evhttp_proxy_abort(struct evhttp_connection *);
+static void evhttp_proxy_upstream_drained(struct evhttp_request *);
 
 void evhttp_read(int, short, void *);
 void evhttp_write(int, short, void *);
 
+static const signed char uri_hex_values[256];
+
 #ifndef HAVE_STRSEP
 /* strsep replacement for platforms that lack it.  Only works if
  * del is one character long. */
@@ -281,23 +321,147 @@ evhttp_add_event(struct event *ev, int timeout, int default_timeout)
 	}
 }
 
+/*
+ * Reading and writing.  While a connection reads or writes, evcon->ev is a
+ * persistent event, so that partial reads and writes do not register it
+ * again.  Instead of a timeout on the event, a single timer checks when
+ * the connection saw I/O last and is only moved once it fires.  Like the
+ * timers of the event loop, that time comes from the monotonic clock, so
+ * that changing the wall clock does not fire or delay timeouts.
+ */
+
+static void
+evhttp_gettime(struct timeval *tv)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec	ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+		tv->tv_sec = ts.tv_sec;
+		tv->tv_usec = ts.tv_nsec / 1000;
+		return;
+	}
+#endif
+	gettimeofday(tv, NULL);
+}
+
+static void
+evhttp_connection_timeoutcb(int fd, short what, void *arg)
+{
+	struct evhttp_connection *evcon = arg;
+	void (*cb)(int, short, void *) = evcon->ev.ev_callback;
+	struct timeval now, deadline;
+
+	evhttp_gettime(&now);
+	deadline = evcon->last_io;
+	deadline.tv_sec += evcon->io_timeout;
+	if (timercmp(&now, &deadline, <)) {
+		struct timeval tv;
+		timersub(&deadline, &now, &tv);
+		event_add(&evcon->timer_ev, &tv);
+		return;
+	}
+
+	/* the callback fails the connection like a timeout on ev would */
+	event_del(&evcon->ev);
+	(*cb)(evcon->fd, EV_TIMEOUT, evcon);
+}
+
+static void
+evhttp_connection_wait(struct evhttp_connection *evcon, short what,
+    void (*cb)(int, short, void *), int default_timeout)
+{
+	struct event *ev = &evcon->ev;
+	int timeout = evcon->timeout != -1 ? evcon->timeout : default_timeout;
+
+	/* the event stays registered as long as it waits for the same */
+	if (!event_initialized(ev) || !event_pending(ev, what, NULL) ||
+	    !(ev->ev_events & EV_PERSIST) || ev->ev_callback != cb) {
+		if (event_initialized(ev))
+			event_del(ev);
+		event_set(ev, evcon->fd, what | EV_PERSIST, cb, evcon);
+		EVHTTP_BASE_SET(evcon, ev);
+		event_add(ev, NULL);
+	}
+
+	evhttp_gettime(&evcon->last_io);
+	if (timeout == 0) {
+		if (event_initialized(&evcon->timer_ev))
+			event_del(&evcon->timer_ev);
+	} else if (!event_initialized(&evcon->timer_ev) ||
+	    !evtimer_pending(&evcon->timer_ev, NULL) ||
+	    evcon->io_timeout != timeout) {
+		struct timeval tv;
+
+		if (event_initialized(&evcon->timer_ev))
+			event_del(&evcon->timer_ev);
+		evtimer_set(&evcon->timer_ev, evhttp_connection_timeoutcb,
+		    evcon);
+		EVHTTP_BASE_SET(evcon, &evcon->timer_ev);
+		evcon->io_timeout = timeout;
+		evutil_timerclear(&tv);
+		tv.tv_sec = timeout;
+		event_add(&evcon->timer_ev, &tv);
+	}
+}
+
+/* Stops reading or writing and the timer that goes with it */
+static void
+evhttp_connection_stop_io(struct evhttp_connection *evcon)
+{
+	if (event_initialized(&evcon->ev))
+		event_del(&evcon->ev);
+	if (event_initialized(&evcon->timer_ev))
+		event_del(&evcon->timer_ev);
+}
+
+/*
+ * Lets a connection read the data that arrived but stop reading after
+ * that, until the reader of the data catches up and resumes it.
+ */
+static void
+evhttp_connection_pause(struct evhttp_connection *evcon)
+{
+	evcon->flags |= EVHTTP_CON_PAUSED;
+}
+
+static void
+evhttp_connection_resume(struct evhttp_connection *evcon)
+{
+	int stalled = evcon->flags & EVHTTP_CON_STALLED;
+
+	evcon->flags &= ~(EVHTTP_CON_PAUSED | EVHTTP_CON_STALLED);
+	if (stalled)
+		evhttp_connection_wait(evcon, EV_READ, evhttp_read,
+		    HTTP_READ_TIMEOUT);
+}
+
+/* keeps the count of reply bytes that a server has not written yet */
+static void
+evhttp_connection_queued(struct evhttp_connection *evcon)
+{
+	size_t queued = EVBUFFER_LENGTH(evcon->output_buffer) +
+	    evcon->segments_len;
+
+	if (evcon->http_server != NULL)
+		evcon->http_server->queued += queued - evcon->queued;
+	evcon->queued = queued;
+}
+
 void
 evhttp_write_buffer(struct evhttp_connection *evcon,
     void (*cb)(struct evhttp_connection *, void *), void *arg)
 {
 	event_debug(("%s: preparing to write buffer\n", __func__));
 
+	evhttp_connection_queued(evcon);
+
 	/* Set call back */
 	evcon->cb = cb;
 	evcon->cb_arg = arg;
 
-	/* check if the event is already pending */
-	if (event_pending(&evcon->ev, EV_WRITE|EV_TIMEOUT, NULL))
-		event_del(&evcon->ev);
-
-	event_set(&evcon->ev, evcon->fd, EV_WRITE, evhttp_write, evcon);
-	EVHTTP_BASE_SET(evcon, &evcon->ev);
-	evhttp_add_event(&evcon->ev, evcon->timeout, HTTP_WRITE_TIMEOUT);
+	evhttp_connection_wait(evcon, EV_WRITE, evhttp_write,
+	    HTTP_WRITE_TIMEOUT);
 }
 
 /*
@@ -321,7 +485,9 @@ evhttp_make_header_request(struct evhttp_connection *evcon,
 
 	/* Add the content length on a post request if missing */
 	if (req->type == EVHTTP_REQ_POST &&
-	    evhttp_find_header(req->output_headers, "Content-Length") == NULL){
+	    evhttp_find_header(req->output_headers, "Content-Length") == NULL &&
+	    evhttp_find_header(req->output_headers,
+		"Transfer-Encoding") == NULL) {
 		char size[12];
 		snprintf(size, sizeof(size), "%ld",
 			 (long)EVBUFFER_LENGTH(req->output_buffer));
@@ -350,27 +516,61 @@ evhttp_is_connection_keepalive(struct evkeyvalq* headers)
 	    && strncasecmp(connection, "keep-alive", 10) == 0);
 }
 
-static void
-evhttp_maybe_add_date_header(struct evkeyvalq *headers)
+static int
+evhttp_format_date(time_t t, char *date, size_t len)
 {
-	if (evhttp_find_header(headers, "Date") == NULL) {
-		char date[50];
 #ifndef WIN32
-		struct tm cur;
+	struct tm cur;
 #endif
-		struct tm *cur_p;
-		time_t t = time(NULL);
+	struct tm *cur_p;
 #ifdef WIN32
-		cur_p = gmtime(&t);
+	cur_p = gmtime(&t);
 #else
-		gmtime_r(&t, &cur);
-		cur_p = &cur;
+	gmtime_r(&t, &cur);
+	cur_p = &cur;
 #endif
-		if (strftime(date, sizeof(date),
-			"%a, %d %b %Y %H:%M:%S GMT", cur_p) != 0) {
+	return (strftime(date, len, "%a, %d %b %Y %H:%M:%S GMT", cur_p) != 0);
+}
+
+/* The Date of a server is made again once the second it was made in ends */
+static void
+evhttp_date_expirecb(int fd, short what, void *arg)
+{
+	struct evhttp *http = arg;
+
+	http->date[0] = '\0';
+}
+
+static void
+evhttp_maybe_add_date_header(struct evhttp *http, struct evkeyvalq *headers)
+{
+	struct timeval now, tv;
+	char date[50];
+
+	if (evhttp_find_header(headers, "Date") != NULL)
+		return;
+
+	if (http == NULL) {
+		if (evhttp_format_date(time(NULL), date, sizeof(date)))
 			evhttp_add_header(headers, "Date", date);
+		return;
+	}
+
+	/* a server reads the clock at most once per second */
+	if (http->date[0] == '\0') {
+		gettimeofday(&now, NULL);
+		if (!evhttp_format_date(now.tv_sec, http->date,
+			sizeof(http->date))) {
+			http->date[0] = '\0';
+			return;
 		}
+		evutil_timerclear(&tv);
+		tv.tv_usec = 1000000 - now.tv_usec;
+		evtimer_set(&http->date_ev, evhttp_date_expirecb, http);
+		EVHTTP_BASE_SET(http, &http->date_ev);
+		evtimer_add(&http->date_ev, &tv);
 	}
+	evhttp_add_header(headers, "Date", http->date);
 }
 
 static void
@@ -389,18 +589,85 @@ evhttp_maybe_add_content_length_header(struct evkeyvalq *headers,
  * Create the headers needed for an HTTP reply
  */
 
+/*
+ * Status lines for the common codes with their standard reason phrases;
+ * other responses have their status line formatted.
+ */
+
+#define EVHTTP_STATUS(code, reason) { code, reason,			\
+	"HTTP/1.0 " #code " " reason "\r\n",					\
+	"HTTP/1.1 " #code " " reason "\r\n",					\
+	sizeof("HTTP/1.1 " #code " " reason "\r\n") - 1 }
+
+static const struct evhttp_status_line {
+	int code;
+	const char *reason;
+	const char *line10;
+	const char *line11;
+	size_t len;
+} evhttp_status_lines[] = {
+	EVHTTP_STATUS(100, "Continue"),
+	EVHTTP_STATUS(200, "OK"),
+	EVHTTP_STATUS(201, "Created"),
+	EVHTTP_STATUS(202, "Accepted"),
+	EVHTTP_STATUS(204, "No Content"),
+	EVHTTP_STATUS(206, "Partial Content"),
+	EVHTTP_STATUS(301, "Moved Permanently"),
+	EVHTTP_STATUS(302, "Found"),
+	EVHTTP_STATUS(303, "See Other"),
+	EVHTTP_STATUS(304, "Not Modified"),
+	EVHTTP_STATUS(307, "Temporary Redirect"),
+	EVHTTP_STATUS(400, "Bad Request"),
+	EVHTTP_STATUS(401, "Unauthorized"),
+	EVHTTP_STATUS(403, "Forbidden"),
+	EVHTTP_STATUS(404, "Not Found"),
+	EVHTTP_STATUS(405, "Method Not Allowed"),
+	EVHTTP_STATUS(408, "Request Timeout"),
+	EVHTTP_STATUS(411, "Length Required"),
+	EVHTTP_STATUS(413, "Request Entity Too Large"),
+	EVHTTP_STATUS(414, "Request-URI Too Long"),
+	EVHTTP_STATUS(500, "Internal Server Error"),
+	EVHTTP_STATUS(501, "Not Implemented"),
+	EVHTTP_STATUS(502, "Bad Gateway"),
+	EVHTTP_STATUS(503, "Service Unavailable"),
+	EVHTTP_STATUS(504, "Gateway Timeout"),
+	{ 0, NULL, NULL, NULL, 0 }
+};
+
 static void
-evhttp_make_header_response(struct evhttp_connection *evcon,
-    struct evhttp_request *req)
+evhttp_add_status_line(struct evbuffer *buf, struct evhttp_request *req)
 {
+	const struct evhttp_status_line *status;
 	char line[1024];
+
+	if (req->major == 1 && (req->minor == 0 || req->minor == 1) &&
+	    req->response_code_line != NULL) {
+		for (status = evhttp_status_lines; status->code; status++) {
+			if (status->code != req->response_code)
+				continue;
+			if (strcmp(status->reason, req->response_code_line))
+				break;
+			evbuffer_add(buf, req->minor ?
+			    status->line11 : status->line10, status->len);
+			return;
+		}
+	}
+
 	snprintf(line, sizeof(line), "HTTP/%d.%d %d %s\r\n",
 	    req->major, req->minor, req->response_code,
 	    req->response_code_line);
-	evbuffer_add(evcon->output_buffer, line, strlen(line));
+	evbuffer_add(buf, line, strlen(line));
+}
+
+static void
+evhttp_make_header_response(struct evhttp_connection *evcon,
+    struct evhttp_request *req)
+{
+	evhttp_add_status_line(evcon->output_buffer, req);
 
 	if (req->major == 1 && req->minor == 1)
-		evhttp_maybe_add_date_header(req->output_headers);
+		evhttp_maybe_add_date_header(evcon->http_server,
+		    req->output_headers);
 
 	if (req->major == 1 && 
 	    (req->minor == 1 || 
@@ -435,7 +702,6 @@ evhttp_make_header_response(struct evhttp_connection *evcon,
 void
 evhttp_make_header(struct evhttp_connection *evcon, struct evhttp_request *req)
 {
-	char line[1024];
 	struct evkeyval *header;
 
 	/*
@@ -449,9 +715,15 @@ evhttp_make_header(struct evhttp_connection *evcon, struct evhttp_request *req)
 	}
 
 	TAILQ_FOREACH(header, req->output_headers, next) {
-		snprintf(line, sizeof(line), "%s: %s\r\n",
-		    header->key, header->value);
-		evbuffer_add(evcon->output_buffer, line, strlen(line));
+		size_t keylen = strlen(header->key);
+		size_t valuelen = strlen(header->value);
+
+		/* one allocation at most, then just copies */
+		evbuffer_expand(evcon->output_buffer, keylen + valuelen + 4);
+		evbuffer_add(evcon->output_buffer, header->key, keylen);
+		evbuffer_add(evcon->output_buffer, ": ", 2);
+		evbuffer_add(evcon->output_buffer, header->value, valuelen);
+		evbuffer_add(evcon->output_buffer, "\r\n", 2);
 	}
 	evbuffer_add(evcon->output_buffer, "\r\n", 2);
 
@@ -535,7 +807,15 @@ evhttp_connection_incoming_fail(struct evhttp_request *req,
 		 * connection open and we timeout on the read.
 		 */
 		return (-1);
+	case EVCON_HTTP_DATA_TOO_LONG:
+		/* the connection is closed once the reply was sent */
+		evhttp_send_error(req, HTTP_ENTITYTOOLARGE,
+		    "Request Entity Too Large");
+		break;
 	case EVCON_HTTP_INVALID_HEADER:
+		if (req->evcon->http_server != NULL)
+			req->evcon->http_server->stats->parse_errors++;
+		/* FALLTHROUGH */
 	default:	/* xxx: probably should just error on default */
 		/* the callback looks at the uri to determine errors */
 		if (req->uri) {
@@ -558,11 +838,18 @@ evhttp_connection_fail(struct evhttp_connection *evcon,
     enum evhttp_connection_error error)
 {
 	struct evhttp_request* req = TAILQ_FIRST(&evcon->requests);
+	struct evcon_requestq failed;
 	void (*cb)(struct evhttp_request *, void *);
 	void *cb_arg;
 	assert(req != NULL);
+
+	evhttp_connection_stop_io(evcon);
 	
 	if (evcon->flags & EVHTTP_CON_INCOMING) {
+		/* a proxied request is not passed on any further */
+		if (evcon->proxy != NULL)
+			evhttp_proxy_abort(evcon);
+
 		/* 
 		 * for incoming requests, there are two different
 		 * failure cases.  it's either a network level error
@@ -576,14 +863,18 @@ evhttp_connection_fail(struct evhttp_connection *evcon,
 		return;
 	}
 
-	/* save the callback for later; the cb might free our object */
-	cb = req->cb;
-	cb_arg = req->cb_arg;
-
-	TAILQ_REMOVE(&evcon->requests, req, next);
-	evhttp_request_free(req);
-
-	/* xxx: maybe we should fail all requests??? */
+	/*
+	 * the server might have acted on the other requests that we sent
+	 * already; they fail as well and only the unsent ones are retried.
+	 */
+	TAILQ_INIT(&failed);
+	do {
+		req = TAILQ_FIRST(&evcon->requests);
+		TAILQ_REMOVE(&evcon->requests, req, next);
+		req->evcon = NULL;
+		TAILQ_INSERT_TAIL(&failed, req, next);
+	} while (--evcon->npipelined > 0 &&
+	    TAILQ_FIRST(&evcon->requests) != NULL);
 
 	/* reset the connection */
 	evhttp_connection_reset(evcon);
@@ -591,24 +882,174 @@ evhttp_connection_fail(struct evhttp_connection *evcon,
 	/* We are trying the next request that was queued on us */
 	if (TAILQ_FIRST(&evcon->requests) != NULL)
 		evhttp_connection_connect(evcon);
+	else
+		evhttp_pool_connection_idle(evcon);
+
+	/* inform the user; the cb might free our object */
+	while ((req = TAILQ_FIRST(&failed)) != NULL) {
+		cb = req->cb;
+		cb_arg = req->cb_arg;
+
+		TAILQ_REMOVE(&failed, req, next);
+		evhttp_request_free(req);
+		if (cb != NULL)
+			(*cb)(NULL, cb_arg);
+	}
+}
+
+/*
+ * Segments.  Data that is shared between connections, like cached bodies
+ * or broadcast chunks, is queued by reference and written after the output
+ * buffer.  Data that is added while segments are queued is copied into a
+ * segment of its own, so that everything goes out in order.
+ */
+
+static void
+evhttp_segment_free(struct evhttp_segment *seg)
+{
+	if (seg->release != NULL)
+		(*seg->release)(seg->arg);
+	free(seg);
+}
+
+static int
+evhttp_connection_add_segment(struct evhttp_connection *evcon,
+    const u_char *data, size_t len, void (*release)(void *), void *arg)
+{
+	struct evhttp_segment *seg;
+
+	if ((seg = malloc(sizeof(struct evhttp_segment))) == NULL) {
+		event_warn("%s: malloc", __func__);
+		return (-1);
+	}
+
+	seg->data = data;
+	seg->len = len;
+	seg->release = release;
+	seg->arg = arg;
+	TAILQ_INSERT_TAIL(&evcon->segments, seg, next);
+	evcon->segments_len += len;
+
+	return (0);
+}
+
+/* Appends data behind everything the connection has to write */
+static void
+evhttp_connection_add(struct evhttp_connection *evcon, const void *data,
+    size_t len)
+{
+	struct evhttp_segment *seg;
+
+	if (TAILQ_EMPTY(&evcon->segments)) {
+		evbuffer_add(evcon->output_buffer, data, len);
+		return;
+	}
+
+	if ((seg = malloc(sizeof(struct evhttp_segment) + len)) == NULL) {
+		event_warn("%s: malloc", __func__);
+		return;
+	}
+	memcpy(seg + 1, data, len);
+
+	seg->data = (u_char *)(seg + 1);
+	seg->len = len;
+	seg->release = NULL;
+	TAILQ_INSERT_TAIL(&evcon->segments, seg, next);
+	evcon->segments_len += len;
+}
+
+static void
+evhttp_connection_add_buffer(struct evhttp_connection *evcon,
+    struct evbuffer *buf)
+{
+	if (TAILQ_EMPTY(&evcon->segments)) {
+		evbuffer_add_buffer(evcon->output_buffer, buf);
+		return;
+	}
+
+	evhttp_connection_add(evcon, EVBUFFER_DATA(buf), EVBUFFER_LENGTH(buf));
+	evbuffer_drain(buf, EVBUFFER_LENGTH(buf));
+}
+
+static void
+evhttp_connection_clear_segments(struct evhttp_connection *evcon)
+{
+	struct evhttp_segment *seg;
+
+	while ((seg = TAILQ_FIRST(&evcon->segments)) != NULL) {
+		TAILQ_REMOVE(&evcon->segments, seg, next);
+		evhttp_segment_free(seg);
+	}
+	evcon->segments_len = 0;
+	evhttp_connection_queued(evcon);
+}
+
+static int
+evhttp_write_segments(struct evhttp_connection *evcon, int fd)
+{
+	struct evhttp_segment *seg;
+	size_t left;
+	int n;
+#ifndef WIN32
+	struct iovec iov[EVHTTP_SEGMENTS_IOV];
+	int niov = 0;
+
+	TAILQ_FOREACH(seg, &evcon->segments, next) {
+		if (niov == EVHTTP_SEGMENTS_IOV)
+			break;
+		iov[niov].iov_base = (void *)seg->data;
+		iov[niov].iov_len = seg->len;
+		niov++;
+	}
+	if (niov == 0)
+		return (0);
+	n = writev(fd, iov, niov);
+#else
+	if ((seg = TAILQ_FIRST(&evcon->segments)) == NULL)
+		return (0);
+	n = send(fd, seg->data, seg->len, 0);
+#endif
+	if (n <= 0)
+		return (n);
+
+	evcon->segments_len -= n;
+	for (left = n; left > 0; ) {
+		seg = TAILQ_FIRST(&evcon->segments);
+		if (left < seg->len) {
+			seg->data += left;
+			seg->len -= left;
+			break;
+		}
+		left -= seg->len;
+		TAILQ_REMOVE(&evcon->segments, seg, next);
+		evhttp_segment_free(seg);
+	}
 
-	/* inform the user */
-	if (cb != NULL)
-		(*cb)(NULL, cb_arg);
+	return (n);
 }
 
 void
 evhttp_write(int fd, short what, void *arg)
 {
 	struct evhttp_connection *evcon = arg;
-	int n;
+	struct evhttp_request *req;
+	int n, m;
 
 	if (what == EV_TIMEOUT) {
 		evhttp_connection_fail(evcon, EVCON_HTTP_TIMEOUT);
 		return;
 	}
 
-	n = evbuffer_write(evcon->output_buffer, fd);
+	if (EVBUFFER_LENGTH(evcon->output_buffer) != 0) {
+		n = evbuffer_write(evcon->output_buffer, fd);
+		/* shared data follows right away if the socket takes it */
+		if (EVBUFFER_LENGTH(evcon->output_buffer) == 0 &&
+		    !TAILQ_EMPTY(&evcon->segments) &&
+		    (m = evhttp_write_segments(evcon, fd)) > 0)
+			n += m;
+	} else {
+		n = evhttp_write_segments(evcon, fd);
+	}
 	if (n == -1) {
 		event_debug(("%s: evbuffer_write", __func__));
 		evhttp_connection_fail(evcon, EVCON_HTTP_EOF);
@@ -621,11 +1062,22 @@ evhttp_write(int fd, short what, void *arg)
 		return;
 	}
 
-	if (EVBUFFER_LENGTH(evcon->output_buffer) != 0) {
-		evhttp_add_event(&evcon->ev, 
-		    evcon->timeout, HTTP_WRITE_TIMEOUT);
-		return;
+	evhttp_gettime(&evcon->last_io);
+	req = TAILQ_FIRST(&evcon->requests);
+	if (req != NULL) {
+		if (!timerisset(&req->timing.first_write))
+			req->timing.first_write = evcon->last_io;
+		req->bytes_written += n;
 	}
+	if (evcon->http_server != NULL)
+		evcon->http_server->stats->bytes_out += n;
+	evhttp_connection_queued(evcon);
+
+	if (EVBUFFER_LENGTH(evcon->output_buffer) != 0 ||
+	    !TAILQ_EMPTY(&evcon->segments))
+		return;
+
+	evhttp_connection_stop_io(evcon);
 
 	/* Activate our call back */
 	if (evcon->cb != NULL)
@@ -638,6 +1090,12 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
 	int con_outgoing = evcon->flags & EVHTTP_CON_OUTGOING;
 
+	req->timing.body_done = evcon->last_io;
+
+	/* nothing is read until the next request or response is due */
+	evhttp_connection_stop_io(evcon);
+	evcon->flags &= ~(EVHTTP_CON_PAUSED | EVHTTP_CON_STALLED);
+
 	/*
 	 * if this is an incoming connection, we need to leave the request
 	 * on the connection, so that we can reply to it.
@@ -646,6 +1104,7 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 	        int need_close;
 		TAILQ_REMOVE(&evcon->requests, req, next);
 		req->evcon = NULL;
+		evcon->npipelined--;
 
 		need_close = 
 		    evhttp_is_connection_close(req->flags, req->input_headers) ||
@@ -658,8 +1117,8 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 		if (TAILQ_FIRST(&evcon->requests) != NULL) {
 			/*
 			 * We have more requests; reset the connection
-			 * and deal with the next request.  xxx: no
-			 * persistent connection right now
+			 * and deal with the next request or read the
+			 * response to one that was pipelined.
 			 */
 			if (evcon->state != EVCON_CONNECTED)
 				evhttp_connection_connect(evcon);
@@ -672,6 +1131,9 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 			 */
 			evhttp_connection_start_detectclose(evcon);
 		}
+
+		/* a pooled connection takes the next waiting request */
+		evhttp_pool_connection_idle(evcon);
 	}
 
 	/* notify the user of the request */
@@ -683,6 +1145,56 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 	}
 }
 
+/*
+ * Parses a chunk-size line in place; extensions after the size are
+ * ignored.  Returns -1 if the line does not start with a size.
+ */
+
+static int
+evhttp_parse_chunk_size(const u_char *p, size_t len, ev_int64_t *size)
+{
+	const u_char *end = p + len;
+	ev_int64_t value = 0;
+	int ndigits = 0, digit;
+
+	for (; p < end && (digit = uri_hex_values[*p]) >= 0; p++) {
+		/* sizes that do not fit are refused */
+		if (++ndigits > 15)
+			return (-1);
+		value = (value << 4) | digit;
+	}
+
+	if (ndigits == 0 ||
+	    (p < end && *p != ' ' && *p != ';' && *p != '\r'))
+		return (-1);
+
+	*size = value;
+	return (0);
+}
+
+/*
+ * Hands len bytes of buf to a reader that takes views of the body; the
+ * data is drained once the callback returned.
+ */
+
+static void
+evhttp_deliver_view(struct evhttp_request *req, struct evbuffer *buf,
+    size_t len)
+{
+	req->body_size += len;
+	req->chunk_data = EVBUFFER_DATA(buf);
+	req->chunk_len = len;
+	(*req->chunk_cb)(req, req->chunk_cb_arg);
+	req->chunk_data = NULL;
+	req->chunk_len = 0;
+	evbuffer_drain(buf, len);
+}
+
+#define EVHTTP_CHUNK_VIEW(req) \
+	((req)->chunk_cb != NULL && ((req)->flags & EVHTTP_REQ_CHUNK_VIEW))
+#define EVHTTP_STREAM_BODY(req) \
+	((req)->chunk_cb != NULL && ((req)->flags & EVHTTP_REQ_STREAM_BODY))
+
 /*
  * Handles reading from a chunked request.
  * return 1: all data has been read
@@ -693,62 +1205,140 @@ evhttp_connection_done(struct evhttp_connection *evcon)
 static int
 evhttp_handle_chunked_read(struct evhttp_request *req, struct evbuffer *buf)
 {
-	int len;
+	size_t len;
 
 	while ((len = EVBUFFER_LENGTH(buf)) > 0) {
+		if (req->ntoread == 0) {
+			/* the trailer after the last chunk ends with a CRLF */
+			u_char *p = EVBUFFER_DATA(buf);
+			u_char *eol = memchr(p, '\n', len);
+			size_t linelen;
+			int last;
+			if (eol == NULL)
+				break;
+			linelen = eol - p + 1;
+			last = linelen == 1 || (linelen == 2 && *p == '\r');
+			req->headers_size += linelen;
+			if (req->evcon->max_headers_size != -1 &&
+			    req->headers_size > req->evcon->max_headers_size)
+				return (-1);
+			evbuffer_drain(buf, linelen);
+			if (last)
+				return (1);
+			continue;
+		}
+
 		if (req->ntoread < 0) {
 			/* Read chunk size */
-			char *p = evbuffer_readline(buf);
-			char *endp;
-			int error;
-			if (p == NULL)
+			u_char *p = EVBUFFER_DATA(buf);
+			u_char *eol = memchr(p, '\n', len);
+			size_t linelen;
+			if (eol == NULL)
 				break;
+			linelen = eol - p;
+			if (linelen > 0 && p[linelen - 1] == '\r')
+				linelen--;
 			/* the last chunk is on a new line? */
-			if (strlen(p) == 0) {
-				free(p);
+			if (linelen == 0) {
+				evbuffer_drain(buf, eol - p + 1);
 				continue;
 			}
-			req->ntoread = evutil_strtoll(p, &endp, 16);
-			error = *p == '\0' || (*endp != '\0' && *endp != ' ');
-			free(p);
-			if (error) {
+			if (evhttp_parse_chunk_size(p, linelen,
+				&req->ntoread) == -1) {
 				/* could not get chunk size */
 				return (-1);
 			}
+			evbuffer_drain(buf, eol - p + 1);
 			if (req->ntoread == 0) {
-				/* Last chunk */
-				return (1);
+				/* Last chunk; its trailer follows */
+				continue;
 			}
+			/* our caller refuses the chunk before it is read */
+			if (evhttp_body_too_long(req->evcon, req))
+				return (0);
+			continue;
+		}
+
+		if (EVHTTP_CHUNK_VIEW(req)) {
+			/* partial chunks are handed over as they arrive */
+			if (len > req->ntoread)
+				len = req->ntoread;
+			req->ntoread -= len;
+			evhttp_deliver_view(req, buf, len);
+			if (req->ntoread == 0)
+				req->ntoread = -1;
 			continue;
 		}
 
 		/* don't have enough to complete a chunk; wait for more */
-		if (len < req->ntoread)
+		if (len < req->ntoread) {
+			if (!EVHTTP_STREAM_BODY(req))
+				return (0);
+
+			/* a streaming reader gets the part we have */
+			req->ntoread -= len;
+			req->body_size += len;
+			evbuffer_add_buffer(req->input_buffer, buf);
+			evhttp_deliver_chunk(req);
 			return (0);
+		}
 
 		/* Completed chunk */
 		evbuffer_add(req->input_buffer,
 		    EVBUFFER_DATA(buf), req->ntoread);
 		evbuffer_drain(buf, req->ntoread);
+		req->body_size += req->ntoread;
 		req->ntoread = -1;
-		if (req->chunk_cb != NULL) {
-			(*req->chunk_cb)(req, req->cb_arg);
-			evbuffer_drain(req->input_buffer,
-			    EVBUFFER_LENGTH(req->input_buffer));
-		}
+		evhttp_deliver_chunk(req);
 	}
 
 	return (0);
 }
 
+/* Hands the data read so far to a streaming reader */
+
+static void
+evhttp_deliver_chunk(struct evhttp_request *req)
+{
+	if (req->chunk_cb == NULL || EVBUFFER_LENGTH(req->input_buffer) == 0)
+		return;
+
+	(*req->chunk_cb)(req, req->chunk_cb_arg);
+	evbuffer_drain(req->input_buffer, EVBUFFER_LENGTH(req->input_buffer));
+}
+
+/* Checks the body read so far and the announced rest against the limit */
+
+static int
+evhttp_body_too_long(struct evhttp_connection *evcon,
+    struct evhttp_request *req)
+{
+	ev_int64_t size = req->body_size;
+
+	if (evcon->max_body_size == -1)
+		return (0);
+	if (req->ntoread > 0)
+		size += req->ntoread;
+	return (size > evcon->max_body_size);
+}
+
 static void
 evhttp_read_body(struct evhttp_connection *evcon, struct evhttp_request *req)
 {
 	struct evbuffer *buf = evcon->input_buffer;
+
+	if (evhttp_body_too_long(evcon, req)) {
+		evhttp_connection_fail(evcon, EVCON_HTTP_DATA_TOO_LONG);
+		return;
+	}
 	
 	if (req->chunked) {
 		int res = evhttp_handle_chunked_read(req, buf);
-		if (res == 1) {
+		if (res != -1 && evhttp_body_too_long(evcon, req)) {
+			evhttp_connection_fail(evcon,
+			    EVCON_HTTP_DATA_TOO_LONG);
+			return;
+		} else if (res == 1) {
 			/* finished last chunk */
 			evhttp_connection_done(evcon);
 			return;
@@ -758,22 +1348,65 @@ evhttp_read_body(struct evhttp_connection *evcon, struct evhttp_request *req)
 			    EVCON_HTTP_INVALID_HEADER);
 			return;
 		}
+	} else if (EVHTTP_CHUNK_VIEW(req)) {
+		/* the body is handed over in place as it arrives */
+		size_t len = EVBUFFER_LENGTH(buf);
+
+		if (req->ntoread >= 0 && len > req->ntoread) {
+			len = req->ntoread;
+		} else if (req->ntoread < 0 && evcon->max_body_size != -1 &&
+		    req->body_size + len > evcon->max_body_size) {
+			evhttp_connection_fail(evcon,
+			    EVCON_HTTP_DATA_TOO_LONG);
+			return;
+		}
+		if (len > 0) {
+			if (req->ntoread > 0)
+				req->ntoread -= len;
+			evhttp_deliver_view(req, buf, len);
+		}
+		if (req->ntoread == 0) {
+			evhttp_connection_done(evcon);
+			return;
+		}
 	} else if (req->ntoread < 0) {
 		/* Read until connection close. */
+		req->body_size += EVBUFFER_LENGTH(buf);
 		evbuffer_add_buffer(req->input_buffer, buf);
+		if (evhttp_body_too_long(evcon, req)) {
+			evhttp_connection_fail(evcon,
+			    EVCON_HTTP_DATA_TOO_LONG);
+			return;
+		}
+		if (EVHTTP_STREAM_BODY(req))
+			evhttp_deliver_chunk(req);
 	} else if (EVBUFFER_LENGTH(buf) >= req->ntoread) {
 		/* Completed content length */
 		evbuffer_add(req->input_buffer, EVBUFFER_DATA(buf),
 		    req->ntoread);
 		evbuffer_drain(buf, req->ntoread);
+		req->body_size += req->ntoread;
 		req->ntoread = 0;
+		if (EVHTTP_STREAM_BODY(req))
+			evhttp_deliver_chunk(req);
 		evhttp_connection_done(evcon);
 		return;
+	} else if (EVHTTP_STREAM_BODY(req) && EVBUFFER_LENGTH(buf) > 0) {
+		/* a streaming reader gets the part we have */
+		req->ntoread -= EVBUFFER_LENGTH(buf);
+		req->body_size += EVBUFFER_LENGTH(buf);
+		evbuffer_add_buffer(req->input_buffer, buf);
+		evhttp_deliver_chunk(req);
 	}
+	if (evcon->flags & EVHTTP_CON_PAUSED) {
+		/* the reader cannot take more until it resumes us */
+		evhttp_connection_stop_io(evcon);
+		evcon->flags |= EVHTTP_CON_STALLED;
+		return;
+	}
+
 	/* Read more! */
-	event_set(&evcon->ev, evcon->fd, EV_READ, evhttp_read, evcon);
-	EVHTTP_BASE_SET(evcon, &evcon->ev);
-	evhttp_add_event(&evcon->ev, evcon->timeout, HTTP_READ_TIMEOUT);
+	evhttp_connection_wait(evcon, EV_READ, evhttp_read, HTTP_READ_TIMEOUT);
 }
 
 /*
@@ -808,6 +1441,9 @@ evhttp_read(int fd, short what, void *arg)
 		evhttp_connection_done(evcon);
 		return;
 	}
+	evhttp_gettime(&evcon->last_io);
+	if (evcon->http_server != NULL)
+		evcon->http_server->stats->bytes_in += n;
 	evhttp_read_body(evcon, req);
 }
 
@@ -821,9 +1457,185 @@ evhttp_write_connectioncb(struct evhttp_connection *evcon, void *arg)
 	/* We are done writing our header and are now expecting the response */
 	req->kind = EVHTTP_RESPONSE;
 
+	/* the rest of a streamed body is still to come */
+	if (req->flags & EVHTTP_REQ_BODY_PENDING) {
+		evhttp_proxy_upstream_drained(req);
+		return;
+	}
+
+	if (EVBUFFER_LENGTH(evcon->input_buffer) != 0) {
+		/*
+		 * a pipelined response arrived together with the previous
+		 * one; it is parsed from the event loop so that the user
+		 * callbacks run in the order of the requests.
+		 */
+		evhttp_connection_stop_io(evcon);
+		event_set(&evcon->ev, evcon->fd, EV_READ,
+		    evhttp_read_buffered, evcon);
+		EVHTTP_BASE_SET(evcon, &evcon->ev);
+		event_active(&evcon->ev, EV_READ, 1);
+		return;
+	}
+
 	evhttp_start_read(evcon);
 }
 
+static void
+evhttp_read_buffered(int fd, short what, void *arg)
+{
+	struct evhttp_connection *evcon = arg;
+
+	/* the header event is only added if more lines are needed */
+	evhttp_parse_header(evcon);
+}
+
+/*
+ * Object pools.  Requests and connections of a server are not freed but
+ * reset and kept on a list of the evhttp object, together with their
+ * header queues and buffers, so that a busy server does not need to go
+ * through malloc for every request.
+ */
+
+static int
+evhttp_buffer_recycle(struct evbuffer **pbuf)
+{
+	struct evbuffer *buf = *pbuf;
+
+	if (buf->totallen <= EVHTTP_POOL_BUFFER_MAX) {
+		evbuffer_drain(buf, EVBUFFER_LENGTH(buf));
+		return (0);
+	}
+
+	/* do not hold on to the memory of an unusually large body */
+	if ((*pbuf = evbuffer_new()) == NULL) {
+		*pbuf = buf;
+		return (-1);
+	}
+	evbuffer_free(buf);
+
+	return (0);
+}
+
+static int
+evhttp_connection_pool(struct evhttp *http, struct evhttp_connection *evcon)
+{
+	struct evbuffer *input_buffer = evcon->input_buffer;
+	struct evbuffer *output_buffer = evcon->output_buffer;
+
+	if (http->nfree_connections >= http->max_pooled ||
+	    input_buffer == NULL || output_buffer == NULL ||
+	    evhttp_buffer_recycle(&input_buffer) == -1 ||
+	    evhttp_buffer_recycle(&output_buffer) == -1) {
+		evcon->input_buffer = input_buffer;
+		evcon->output_buffer = output_buffer;
+		return (-1);
+	}
+
+	memset(evcon, 0, sizeof(struct evhttp_connection));
+	evcon->fd = -1;
+	evcon->input_buffer = input_buffer;
+	evcon->output_buffer = output_buffer;
+	TAILQ_INIT(&evcon->requests);
+	TAILQ_INIT(&evcon->segments);
+
+	TAILQ_INSERT_HEAD(&http->free_connections, evcon, next);
+	http->nfree_connections++;
+
+	return (0);
+}
+
+/* The state of a connection that was never used, whatever its memory */
+static void
+evhttp_connection_init(struct evhttp_connection *evcon, unsigned short port)
+{
+	evcon->fd = -1;
+	evcon->port = port;
+
+	evcon->timeout = -1;
+	evcon->idle_timeout = -1;
+	evcon->pipeline_max = 1;
+	evcon->max_headers_size = evcon->max_body_size = -1;
+	evcon->retry_cnt = evcon->retry_max = 0;
+
+	evcon->state = EVCON_DISCONNECTED;
+	TAILQ_INIT(&evcon->requests);
+	TAILQ_INIT(&evcon->segments);
+}
+
+static struct evhttp_connection *
+evhttp_connection_new_pooled(struct evhttp *http,
+    const char *address, unsigned short port)
+{
+	struct evhttp_connection *evcon = TAILQ_FIRST(&http->free_connections);
+
+	if (evcon == NULL)
+		return (evhttp_connection_new(address, port));
+
+	TAILQ_REMOVE(&http->free_connections, evcon, next);
+	http->nfree_connections--;
+
+	evhttp_connection_init(evcon, port);
+
+	if ((evcon->address = strdup(address)) == NULL) {
+		event_warn("%s: strdup failed", __func__);
+		evhttp_connection_free(evcon);
+		return (NULL);
+	}
+
+	return (evcon);
+}
+
+static int
+evhttp_request_pool(struct evhttp *http, struct evhttp_request *req)
+{
+	struct evhttp_request saved;
+
+	if (http->nfree_requests >= http->max_pooled ||
+	    req->input_headers == NULL || req->output_headers == NULL ||
+	    req->input_buffer == NULL || req->output_buffer == NULL ||
+	    evhttp_buffer_recycle(&req->input_buffer) == -1 ||
+	    evhttp_buffer_recycle(&req->output_buffer) == -1)
+		return (-1);
+
+	if (req->header_arena != NULL)
+		evhttp_header_arena_reset(req->header_arena);
+
+	saved = *req;
+	memset(req, 0, sizeof(struct evhttp_request));
+	req->input_headers = saved.input_headers;
+	req->output_headers = saved.output_headers;
+	req->header_arena = saved.header_arena;
+	req->input_buffer = saved.input_buffer;
+	req->output_buffer = saved.output_buffer;
+	/* most requests on a connection come from the same host */
+	req->remote_host = saved.remote_host;
+
+	TAILQ_INSERT_HEAD(&http->free_requests, req, next);
+	http->nfree_requests++;
+
+	return (0);
+}
+
+static struct evhttp_request *
+evhttp_request_new_pooled(struct evhttp *http,
+    void (*cb)(struct evhttp_request *, void *), void *arg)
+{
+	struct evhttp_request *req = TAILQ_FIRST(&http->free_requests);
+
+	if (req == NULL)
+		return (evhttp_request_new(cb, arg));
+
+	TAILQ_REMOVE(&http->free_requests, req, next);
+	http->nfree_requests--;
+
+	req->kind = EVHTTP_RESPONSE;
+	req->cb = cb;
+	req->cb_arg = arg;
+	req->chunk_cb_arg = arg;
+
+	return (req);
+}
+
 /*
  * Clean up a connection object
  */
@@ -831,6 +1643,7 @@ evhttp_write_connectioncb(struct evhttp_connection *evcon, void *arg)
 void
 evhttp_connection_free(struct evhttp_connection *evcon)
 {
+	struct evhttp *http = evcon->http_server;
 	struct evhttp_request *req;
 
 	/* notify interested parties that this connection is going down */
@@ -845,16 +1658,40 @@ evhttp_connection_free(struct evhttp_connection *evcon)
 		evhttp_request_free(req);
 	}
 
-	if (evcon->http_server != NULL) {
-		struct evhttp *http = evcon->http_server;
+	/* output that was never written no longer counts against the server */
+	if (evcon->output_buffer != NULL) {
+		evbuffer_drain(evcon->output_buffer,
+		    EVBUFFER_LENGTH(evcon->output_buffer));
+		evhttp_connection_clear_segments(evcon);
+	}
+
+	if (http != NULL) {
 		TAILQ_REMOVE(&http->connections, evcon, next);
+		if (evcon->flags & EVHTTP_CON_IDLE)
+			TAILQ_REMOVE(&http->idle_connections, evcon,
+			    idle_next);
+		http->stats->active_connections--;
+		if (http->accept_paused &&
+		    http->stats->active_connections < http->max_connections)
+			evhttp_resume_accept(http);
+	}
+
+	if (evcon->pool_host != NULL) {
+		TAILQ_REMOVE(&evcon->pool_host->connections, evcon, next);
+		evcon->pool_host->nconnections--;
 	}
 
 	if (event_initialized(&evcon->close_ev))
 		event_del(&evcon->close_ev);
 
-	if (event_initialized(&evcon->ev))
-		event_del(&evcon->ev);
+	evhttp_connection_stop_io(evcon);
+
+	if (evcon->broadcast != NULL)
+		evhttp_broadcast_unlink(evcon);
+	if (evcon->proxy != NULL)
+		evhttp_proxy_abort(evcon);
+
+	evhttp_connection_cancel_resolve(evcon);
 	
 	if (evcon->fd != -1)
 		EVUTIL_CLOSESOCKET(evcon->fd);
@@ -865,6 +1702,10 @@ evhttp_connection_free(struct evhttp_connection *evcon)
 	if (evcon->address != NULL)
 		free(evcon->address);
 
+	/* server connections are kept around for the next client */
+	if (http != NULL && evhttp_connection_pool(http, evcon) == 0)
+		return;
+
 	if (evcon->input_buffer != NULL)
 		evbuffer_free(evcon->input_buffer);
 
@@ -886,6 +1727,45 @@ evhttp_connection_set_local_address(struct evhttp_connection *evcon,
 }
 
 
+/*
+ * Creates the headers of the requests that can be sent without waiting
+ * for the responses of the ones in flight; returns how many there were.
+ */
+
+static int
+evhttp_connection_fill_pipeline(struct evhttp_connection *evcon)
+{
+	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
+	int n;
+
+	/* skip the requests that have been sent already */
+	for (n = 0; req != NULL && n < evcon->npipelined; n++) {
+		/* a POST is only sent when nothing else is in flight */
+		if (req->type == EVHTTP_REQ_POST)
+			return (0);
+		req = TAILQ_NEXT(req, next);
+	}
+
+	/* Create the headers from the stored arguments */
+	for (n = 0; req != NULL && evcon->npipelined < evcon->pipeline_max;
+	     req = TAILQ_NEXT(req, next)) {
+		if (req->type == EVHTTP_REQ_POST && evcon->npipelined)
+			break;
+
+		/* it might have been sent on a connection that was closed */
+		req->kind = EVHTTP_REQUEST;
+		evhttp_make_header(evcon, req);
+		req->kind = EVHTTP_RESPONSE;
+		evcon->npipelined++;
+		n++;
+
+		if (req->type == EVHTTP_REQ_POST)
+			break;
+	}
+
+	return (n);
+}
+
 static void
 evhttp_request_dispatch(struct evhttp_connection* evcon)
 {
@@ -901,8 +1781,13 @@ evhttp_request_dispatch(struct evhttp_connection* evcon)
 	/* we assume that the connection is connected already */
 	assert(evcon->state == EVCON_CONNECTED);
 
-	/* Create the header from the store arguments */
-	evhttp_make_header(evcon, req);
+	evhttp_connection_fill_pipeline(evcon);
+
+	if (EVBUFFER_LENGTH(evcon->output_buffer) == 0) {
+		/* nothing new to send; wait for the next response */
+		evhttp_write_connectioncb(evcon, NULL);
+		return;
+	}
 
 	evhttp_write_buffer(evcon, evhttp_write_connectioncb, NULL);
 }
@@ -911,8 +1796,19 @@ evhttp_request_dispatch(struct evhttp_connection* evcon)
 void
 evhttp_connection_reset(struct evhttp_connection *evcon)
 {
-	if (event_initialized(&evcon->ev))
-		event_del(&evcon->ev);
+	evhttp_connection_cancel_resolve(evcon);
+
+	evhttp_connection_stop_io(evcon);
+
+	/* nothing that was queued for the old socket goes out on a new one */
+	evbuffer_drain(evcon->output_buffer,
+	    EVBUFFER_LENGTH(evcon->output_buffer));
+	evhttp_connection_clear_segments(evcon);
+
+	if (evcon->broadcast != NULL)
+		evhttp_broadcast_unlink(evcon);
+	if (evcon->proxy != NULL)
+		evhttp_proxy_abort(evcon);
 
 	if (evcon->fd != -1) {
 		/* inform interested parties about connection close */
@@ -923,6 +1819,12 @@ evhttp_connection_reset(struct evhttp_connection *evcon)
 		evcon->fd = -1;
 	}
 	evcon->state = EVCON_DISCONNECTED;
+	evcon->npipelined = 0;
+	evcon->flags &= ~(EVHTTP_CON_PAUSED | EVHTTP_CON_STALLED);
+
+	/* responses of a previous connection are of no use */
+	evbuffer_drain(evcon->input_buffer,
+	    EVBUFFER_LENGTH(evcon->input_buffer));
 
 	/* remove unneeded flags */
 	evcon->flags &= ~EVHTTP_CON_CLOSEDETECT;
@@ -945,7 +1847,15 @@ evhttp_connection_start_detectclose(struct evhttp_connection *evcon)
 	event_set(&evcon->close_ev, evcon->fd, EV_READ,
 	    evhttp_detect_close_cb, evcon);
 	EVHTTP_BASE_SET(evcon, &evcon->close_ev);
-	event_add(&evcon->close_ev, NULL);
+	if (evcon->idle_timeout > 0) {
+		/* an idle connection is closed once it timed out */
+		struct timeval tv;
+		evutil_timerclear(&tv);
+		tv.tv_sec = evcon->idle_timeout;
+		event_add(&evcon->close_ev, &tv);
+	} else {
+		event_add(&evcon->close_ev, NULL);
+	}
 }
 
 static void
@@ -1009,7 +1919,22 @@ evhttp_connectioncb(int fd, short what, void *arg)
 	return;
 
  cleanup:
+	evhttp_connection_connect_failed(evcon);
+}
+
+/*
+ * Retries a failed connection attempt or, once we give up, fails all
+ * requests that are queued on the connection.
+ */
+
+static void
+evhttp_connection_connect_failed(struct evhttp_connection *evcon)
+{
+	/* a timeout may fire while the name is still being resolved */
+	evhttp_connection_cancel_resolve(evcon);
+
 	if (evcon->retry_max < 0 || evcon->retry_cnt < evcon->retry_max) {
+		evhttp_connection_stop_io(evcon);
 		evtimer_set(&evcon->ev, evhttp_connection_retry, evcon);
 		EVHTTP_BASE_SET(evcon, &evcon->ev);
 		evhttp_add_event(&evcon->ev, MIN(3600, 2 << evcon->retry_cnt),
@@ -1029,6 +1954,8 @@ evhttp_connectioncb(int fd, short what, void *arg)
 		request->cb(request, request->cb_arg);
 		evhttp_request_free(request);
 	}
+
+	evhttp_pool_connection_idle(evcon);
 }
 
 /*
@@ -1143,121 +2070,473 @@ evhttp_parse_request_line(struct evhttp_request *req, char *line)
 	return (0);
 }
 
-const char *
-evhttp_find_header(const struct evkeyvalq *headers, const char *key)
+/*
+ * Header names that are stored by reference instead of being copied into
+ * the arena.  Only names that match exactly are interned, so the spelling
+ * seen by the application does not change.
+ */
+
+static const struct evhttp_common_header {
+	const char *name;
+	u_int hash;			/* evhttp_header_hash() of name */
+} evhttp_common_headers[] = {
+	{ "Host", 0xaffea56fU },
+	{ "Connection", 0x38b99ed9U },
+	{ "Proxy-Connection", 0x32c09da6U },
+	{ "Keep-Alive", 0xe18edb80U },
+	{ "Content-Length", 0x4df9451dU },
+	{ "Content-Type", 0xfcf70995U },
+	{ "Content-Encoding", 0x03e2ed88U },
+	{ "Transfer-Encoding", 0xddb4744cU },
+	{ "Date", 0xd472dc59U },
+	{ "Server", 0x40ac3dd2U },
+	{ "User-Agent", 0x24259beeU },
+	{ "Accept", 0x08247e29U },
+	{ "Accept-Charset", 0xda645c68U },
+	{ "Accept-Encoding", 0xc9715a99U },
+	{ "Accept-Language", 0x75f67716U },
+	{ "Authorization", 0x913657beU },
+	{ "Cache-Control", 0x50c8a4cdU },
+	{ "Cookie", 0x77a740bfU },
+	{ "Set-Cookie", 0x6e2be738U },
+	{ "ETag", 0x06c857c0U },
+	{ "Expires", 0x3e8ec783U },
+	{ "If-Modified-Since", 0x83e879a9U },
+	{ "If-None-Match", 0x972b6177U },
+	{ "Last-Modified", 0xc0575a6bU },
+	{ "Location", 0x0bf5a9a6U },
+	{ "Pragma", 0x19fa4625U },
+	{ "Range", 0xfadc0cd2U },
+	{ "Referer", 0xec9af966U },
+	{ NULL, 0 }
+};
+
+/* FNV-1a over the lower-cased name; header names are case-insensitive */
+static u_int
+evhttp_header_hash(const char *key)
 {
-	struct evkeyval *header;
+	u_int hash = 2166136261U;
 
-	TAILQ_FOREACH(header, headers, next) {
-		if (strcasecmp(header->key, key) == 0)
-			return (header->value);
+	for (; *key != '\0'; key++) {
+		hash ^= (u_char)tolower((u_char)*key);
+		hash *= 16777619U;
 	}
 
-	return (NULL);
+	return (hash);
 }
 
-void
-evhttp_clear_headers(struct evkeyvalq *headers)
+static const char *
+evhttp_intern_header(const char *key, u_int hash)
 {
-	struct evkeyval *header;
+	const struct evhttp_common_header *common;
 
-	for (header = TAILQ_FIRST(headers);
-	    header != NULL;
-	    header = TAILQ_FIRST(headers)) {
-		TAILQ_REMOVE(headers, header, next);
-		free(header->key);
-		free(header->value);
-		free(header);
+	for (common = evhttp_common_headers; common->name != NULL; common++) {
+		if (common->hash == hash && strcmp(common->name, key) == 0)
+			return (common->name);
 	}
-}
 
-/*
- * Returns 0,  if the header was successfully removed.
- * Returns -1, if the header could not be found.
- */
+	return (NULL);
+}
 
-int
-evhttp_remove_header(struct evkeyvalq *headers, const char *key)
+static struct evhttp_header_arena *
+evhttp_header_arena_new(struct evkeyvalq *headers)
 {
-	struct evkeyval *header;
+	struct evhttp_header_arena *arena;
 
-	TAILQ_FOREACH(header, headers, next) {
-		if (strcasecmp(header->key, key) == 0)
-			break;
+	if ((arena = calloc(1, sizeof(struct evhttp_header_arena))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (NULL);
 	}
 
-	if (header == NULL)
-		return (-1);
-
-	/* Free and remove the header that we found */
-	TAILQ_REMOVE(headers, header, next);
-	free(header->key);
-	free(header->value);
-	free(header);
+	arena->headers = headers;
+	arena->last = TAILQ_LAST(headers, evkeyvalq);
+	/* headers that are already on the list are not in the index */
+	arena->overflow = !TAILQ_EMPTY(headers);
 
-	return (0);
+	return (arena);
 }
 
-int
-evhttp_add_header(struct evkeyvalq *headers,
-    const char *key, const char *value)
+static void
+evhttp_header_arena_free(struct evhttp_header_arena *arena)
 {
-	struct evkeyval *header = NULL;
+	struct evhttp_arena_chunk *chunk;
 
-	event_debug(("%s: key: %s val: %s\n", __func__, key, value));
+	while ((chunk = arena->chunks) != NULL) {
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
 
-	if (strchr(value, '\r') != NULL || strchr(value, '\n') != NULL ||
-	    strchr(key, '\r') != NULL || strchr(key, '\n') != NULL) {
-		/* drop illegal headers */
-		event_debug(("%s: dropping illegal header\n", __func__));
-		return (-1);
+	free(arena);
+}
+
+/* Keeps the first chunk of an arena so that a pooled request can reuse it */
+static void
+evhttp_header_arena_reset(struct evhttp_header_arena *arena)
+{
+	struct evhttp_arena_chunk *chunk, *first = NULL;
+
+	while ((chunk = arena->chunks) != NULL) {
+		arena->chunks = chunk->next;
+		if (first != NULL)
+			free(first);
+		first = chunk;
 	}
 
-	header = calloc(1, sizeof(struct evkeyval));
-	if (header == NULL) {
-		event_warn("%s: calloc", __func__);
-		return (-1);
+	arena->last = NULL;
+	arena->nindexed = 0;
+	arena->overflow = 0;
+	memset(arena->index, 0, sizeof(arena->index));
+
+	if (first != NULL && first->size == EVHTTP_ARENA_CHUNK) {
+		first->off = 0;
+		first->next = NULL;
+		arena->chunks = first;
+	} else if (first != NULL) {
+		free(first);
 	}
-	if ((header->key = strdup(key)) == NULL) {
-		free(header);
-		event_warn("%s: strdup", __func__);
-		return (-1);
+}
+
+static void *
+evhttp_arena_alloc(struct evhttp_header_arena *arena, size_t size)
+{
+	struct evhttp_arena_chunk *chunk = arena->chunks;
+	void *p;
+
+	/* keep every allocation suitably aligned for a struct */
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	if (chunk == NULL || chunk->size - chunk->off < size) {
+		size_t chunksize = EVHTTP_ARENA_CHUNK;
+		if (chunksize < size)
+			chunksize = size;
+
+		chunk = malloc(sizeof(struct evhttp_arena_chunk) + chunksize);
+		if (chunk == NULL) {
+			event_warn("%s: malloc", __func__);
+			return (NULL);
+		}
+		chunk->size = chunksize;
+		chunk->off = 0;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
 	}
-	if ((header->value = strdup(value)) == NULL) {
-		free(header->key);
-		free(header);
-		event_warn("%s: strdup", __func__);
-		return (-1);
+
+	p = (char *)(chunk + 1) + chunk->off;
+	chunk->off += size;
+
+	return (p);
+}
+
+static void
+evhttp_header_index_add(struct evhttp_header_arena *arena,
+    struct evkeyval *header, u_int hash)
+{
+	u_int slot = hash & (EVHTTP_HEADER_INDEX_SIZE - 1);
+
+	while (arena->index[slot].header != NULL) {
+		if (arena->index[slot].hash == hash &&
+		    strcasecmp(arena->index[slot].header->key,
+			header->key) == 0)
+			return;	/* lookups return the first one */
+		slot = (slot + 1) & (EVHTTP_HEADER_INDEX_SIZE - 1);
 	}
 
-	TAILQ_INSERT_TAIL(headers, header, next);
+	if (arena->nindexed == EVHTTP_HEADER_INDEX_MAX) {
+		arena->overflow = 1;
+		return;
+	}
 
-	return (0);
+	arena->index[slot].hash = hash;
+	arena->index[slot].header = header;
+	arena->nindexed++;
 }
 
 /*
- * Parses header lines from a request or a response into the specified
- * request object given an event buffer.
+ * Looks up a header name in the index of an arena.
  *
  * Returns
- *   -1  on error
- *    0  when we need to read more headers
- *    1  when all headers have been read.
+ *    1  and sets *pheader if the header was found
+ *    0  if there is no header with this name
+ *   -1  if the index cannot answer and the list has to be scanned
  */
 
-int
-evhttp_parse_lines(struct evhttp_request *req, struct evbuffer* buffer)
+static int
+evhttp_header_index_find(struct evhttp_header_arena *arena,
+    const char *key, struct evkeyval **pheader)
 {
-	char *line;
-	int done = 0;
+	u_int hash, slot;
 
-	struct evkeyvalq* headers = req->input_headers;
-	while ((line = evbuffer_readline(buffer)) != NULL) {
-		char *skey, *svalue;
+	if (arena->overflow ||
+	    arena->last != TAILQ_LAST(arena->headers, evkeyvalq))
+		return (-1);
+
+	hash = evhttp_header_hash(key);
+	slot = hash & (EVHTTP_HEADER_INDEX_SIZE - 1);
+
+	while (arena->index[slot].header != NULL) {
+		struct evkeyval *header = arena->index[slot].header;
+		if (arena->index[slot].hash == hash &&
+		    strcasecmp(header->key, key) == 0) {
+			if (header->flags & EVKEYVAL_REMOVED)
+				return (-1);
+			*pheader = header;
+			return (1);
+		}
+		slot = (slot + 1) & (EVHTTP_HEADER_INDEX_SIZE - 1);
+	}
+
+	return (0);
+}
+
+/* Returns the arena that owns this list if there is one */
+static struct evhttp_header_arena *
+evhttp_header_arena_of(const struct evkeyvalq *headers)
+{
+	struct evkeyval *header = TAILQ_FIRST(headers);
+	struct evhttp_header_arena *arena;
+
+	if (header == NULL || !(header->flags & EVKEYVAL_ARENA))
+		return (NULL);
+
+	arena = ((struct evhttp_header *)header)->arena;
+	if (arena->headers != headers)
+		return (NULL);
+
+	return (arena);
+}
+
+static int
+evhttp_arena_add_header(struct evhttp_header_arena *arena,
+    const char *key, const char *value)
+{
+	struct evhttp_header *header;
+	struct evkeyval *last = TAILQ_LAST(arena->headers, evkeyvalq);
+	u_int hash = evhttp_header_hash(key);
+	const char *name = evhttp_intern_header(key, hash);
+	size_t keylen = name == NULL ? strlen(key) + 1 : 0;
+	size_t valuelen = strlen(value) + 1;
+	char *p;
+
+	header = evhttp_arena_alloc(arena,
+	    sizeof(struct evhttp_header) + keylen + valuelen);
+	if (header == NULL)
+		return (-1);
+
+	p = (char *)(header + 1);
+	if (name == NULL) {
+		memcpy(p, key, keylen);
+		name = p;
+		p += keylen;
+	}
+	memcpy(p, value, valuelen);
+
+	header->kv.key = (char *)name;
+	header->kv.value = p;
+	header->kv.flags = EVKEYVAL_ARENA;
+	header->arena = arena;
+
+	TAILQ_INSERT_TAIL(arena->headers, &header->kv, next);
+
+	/* only extend the index if it still describes the whole list */
+	if (arena->last == last) {
+		evhttp_header_index_add(arena, &header->kv, hash);
+		arena->last = &header->kv;
+	}
+
+	return (0);
+}
+
+/* Arena headers are only unlinked; their memory goes with the arena */
+static void
+evhttp_header_free(struct evkeyval *header)
+{
+	if (header->flags & EVKEYVAL_ARENA) {
+		header->flags |= EVKEYVAL_REMOVED;
+		return;
+	}
+
+	free(header->key);
+	free(header->value);
+	free(header);
+}
+
+const char *
+evhttp_find_header(const struct evkeyvalq *headers, const char *key)
+{
+	struct evhttp_header_arena *arena;
+	struct evkeyval *header;
+
+	if ((arena = evhttp_header_arena_of(headers)) != NULL) {
+		switch (evhttp_header_index_find(arena, key, &header)) {
+		case 1:
+			return (header->value);
+		case 0:
+			return (NULL);
+		default:
+			break;
+		}
+	}
+
+	TAILQ_FOREACH(header, headers, next) {
+		if (strcasecmp(header->key, key) == 0)
+			return (header->value);
+	}
+
+	return (NULL);
+}
+
+void
+evhttp_clear_headers(struct evkeyvalq *headers)
+{
+	struct evkeyval *header;
+
+	for (header = TAILQ_FIRST(headers);
+	    header != NULL;
+	    header = TAILQ_FIRST(headers)) {
+		TAILQ_REMOVE(headers, header, next);
+		evhttp_header_free(header);
+	}
+}
+
+/*
+ * Returns 0,  if the header was successfully removed.
+ * Returns -1, if the header could not be found.
+ */
+
+int
+evhttp_remove_header(struct evkeyvalq *headers, const char *key)
+{
+	struct evkeyval *header;
+
+	TAILQ_FOREACH(header, headers, next) {
+		if (strcasecmp(header->key, key) == 0)
+			break;
+	}
+
+	if (header == NULL)
+		return (-1);
+
+	/* Free and remove the header that we found */
+	TAILQ_REMOVE(headers, header, next);
+	evhttp_header_free(header);
+
+	return (0);
+}
+
+static int
+evhttp_header_is_valid(const char *key, const char *value)
+{
+	if (strchr(value, '\r') != NULL || strchr(value, '\n') != NULL ||
+	    strchr(key, '\r') != NULL || strchr(key, '\n') != NULL) {
+		/* drop illegal headers */
+		event_debug(("%s: dropping illegal header\n", __func__));
+		return (0);
+	}
+
+	return (1);
+}
+
+int
+evhttp_add_header(struct evkeyvalq *headers,
+    const char *key, const char *value)
+{
+	struct evhttp_header_arena *arena;
+	struct evkeyval *header = NULL;
+
+	event_debug(("%s: key: %s val: %s\n", __func__, key, value));
+
+	if (!evhttp_header_is_valid(key, value))
+		return (-1);
+
+	/* lists that live in an arena keep growing there */
+	if ((arena = evhttp_header_arena_of(headers)) != NULL)
+		return (evhttp_arena_add_header(arena, key, value));
+
+	header = calloc(1, sizeof(struct evkeyval));
+	if (header == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (-1);
+	}
+	if ((header->key = strdup(key)) == NULL) {
+		free(header);
+		event_warn("%s: strdup", __func__);
+		return (-1);
+	}
+	if ((header->value = strdup(value)) == NULL) {
+		free(header->key);
+		free(header);
+		event_warn("%s: strdup", __func__);
+		return (-1);
+	}
+
+	TAILQ_INSERT_TAIL(headers, header, next);
+
+	return (0);
+}
+
+/*
+ * Finds the end of the next line at the start of the buffer.  The search
+ * resumes where the previous call for this request stopped, so a header
+ * line that arrives in pieces is scanned only once.
+ *
+ * Returns the length of the line including its terminator, or 0 if the
+ * line is not complete yet.
+ */
+
+static size_t
+evhttp_next_line(struct evhttp_request *req, struct evbuffer *buffer)
+{
+	u_char *data = EVBUFFER_DATA(buffer);
+	size_t len = EVBUFFER_LENGTH(buffer);
+	u_char *p;
+
+	if (req->line_scanned > len)
+		req->line_scanned = 0;
+
+	p = memchr(data + req->line_scanned, '\n', len - req->line_scanned);
+	if (p == NULL) {
+		req->line_scanned = len;
+		return (0);
+	}
+
+	req->line_scanned = 0;
+	return (p - data + 1);
+}
+
+/*
+ * Parses header lines from a request or a response into the specified
+ * request object given an event buffer.  Lines are terminated by '\n' or
+ * '\r\n' and are tokenized in place; each line is drained from the buffer
+ * once it has been processed.
+ *
+ * Returns
+ *   -1  on error
+ *    0  when we need to read more headers
+ *    1  when all headers have been read.
+ */
+
+int
+evhttp_parse_lines(struct evhttp_request *req, struct evbuffer* buffer)
+{
+	size_t linelen;
+	int done = 0;
+
+	struct evkeyvalq* headers = req->input_headers;
+	while ((linelen = evhttp_next_line(req, buffer)) != 0) {
+		char *line = (char *)EVBUFFER_DATA(buffer);
+		size_t n = linelen - 1;
+		char *skey, *svalue;
+
+		req->headers_size += linelen;
+
+		/* Terminate the line in place */
+		if (n > 0 && line[n - 1] == '\r')
+			n--;
+		line[n] = '\0';
 
 		if (*line == '\0') { /* Last header - Done */
 			done = 1;
-			free (line);
+			evbuffer_drain(buffer, linelen);
 			break;
 		}
 
@@ -1285,17 +2564,26 @@ evhttp_parse_lines(struct evhttp_request *req, struct evbuffer* buffer)
 
 			svalue += strspn(svalue, " ");
 
-			if (evhttp_add_header(headers, skey, svalue) == -1)
+			if (!evhttp_header_is_valid(skey, svalue))
+				goto error;
+
+			if (req->header_arena == NULL &&
+			    (req->header_arena =
+				evhttp_header_arena_new(headers)) == NULL)
+				goto error;
+
+			if (evhttp_arena_add_header(req->header_arena,
+				skey, svalue) == -1)
 				goto error;
 		}
 
-		free (line);
+		evbuffer_drain(buffer, linelen);
 	}
 
 	return (done);
 
  error:
-	free (line);
+	evbuffer_drain(buffer, linelen);
 	return (-1);
 }
 
@@ -1347,6 +2635,21 @@ evhttp_get_body(struct evhttp_connection *evcon, struct evhttp_request *req)
 		evhttp_connection_done(evcon);
 		return;
 	}
+
+	/* the callback for the request might want to stream the body */
+	if (req->kind == EVHTTP_REQUEST && req->route != NULL) {
+		struct evhttp_cb *cb = req->route;
+		if (cb->chunk_cb != NULL) {
+			req->chunk_cb = cb->chunk_cb;
+			req->chunk_cb_arg = cb->cbarg;
+			req->flags |= EVHTTP_REQ_STREAM_BODY;
+			if (cb->chunk_view)
+				req->flags |= EVHTTP_REQ_CHUNK_VIEW;
+		}
+		/* a proxy sends the request on before the body arrived */
+		if (cb != NULL && cb->proxy != NULL && evcon->proxy == NULL)
+			evhttp_proxy_start(req, cb->proxy);
+	}
 	xfer_enc = evhttp_find_header(req->input_headers, "Transfer-Encoding");
 	if (xfer_enc != NULL && strcasecmp(xfer_enc, "chunked") == 0) {
 		req->chunked = 1;
@@ -1365,8 +2668,7 @@ void
 evhttp_read_header(int fd, short what, void *arg)
 {
 	struct evhttp_connection *evcon = arg;
-	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
-	int n, res;
+	int n;
 
 	if (what == EV_TIMEOUT) {
 		event_debug(("%s: timeout on %d\n", __func__, fd));
@@ -1386,7 +2688,45 @@ evhttp_read_header(int fd, short what, void *arg)
 		return;
 	}
 
+	evhttp_gettime(&evcon->last_io);
+	if (evcon->http_server != NULL)
+		evcon->http_server->stats->bytes_in += n;
+	evhttp_parse_header(evcon);
+}
+
+/*
+ * Parses the header lines that are in the input buffer and continues
+ * with the body once they are complete.
+ */
+
+static void
+evhttp_parse_header(struct evhttp_connection *evcon)
+{
+	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
+	int fd = evcon->fd;
+	int res;
+
+	if (!timerisset(&req->timing.first_read))
+		req->timing.first_read = evcon->last_io;
+
+	/* a persistent connection that waited is busy again */
+	if (evcon->flags & EVHTTP_CON_IDLE) {
+		struct evhttp *http = evcon->http_server;
+		TAILQ_REMOVE(&http->idle_connections, evcon, idle_next);
+		evcon->flags &= ~EVHTTP_CON_IDLE;
+		if (http->max_connections != -1)
+			evhttp_limit_connections(http);
+	}
+
 	res = evhttp_parse_lines(req, evcon->input_buffer);
+	if (res != -1 && evcon->max_headers_size != -1 &&
+	    req->headers_size + (res == 0 ?
+		EVBUFFER_LENGTH(evcon->input_buffer) : 0) >
+	    evcon->max_headers_size) {
+		/* the rest of a partial line counts as well */
+		event_debug(("%s: headers too long on %d\n", __func__, fd));
+		res = -1;
+	}
 	if (res == -1) {
 		/* Error while reading, terminate */
 		event_debug(("%s: bad header lines on %d\n", __func__, fd));
@@ -1394,21 +2734,34 @@ evhttp_read_header(int fd, short what, void *arg)
 		return;
 	} else if (res == 0) {
 		/* Need more header lines */
-		evhttp_add_event(&evcon->ev, 
-		    evcon->timeout, HTTP_READ_TIMEOUT);
+		evhttp_connection_wait(evcon, EV_READ, evhttp_read_header,
+		    HTTP_READ_TIMEOUT);
 		return;
 	}
 
 	/* Done reading headers, do the real work */
+	req->timing.headers_done = evcon->last_io;
 	switch (req->kind) {
 	case EVHTTP_REQUEST:
+		/* an overloaded server does not take on more work */
+		if (evcon->http_server != NULL &&
+		    evhttp_admit_request(evcon->http_server, req) == -1) {
+			evhttp_send_error(req, HTTP_SERVUNAVAIL,
+			    "Service Unavailable");
+			break;
+		}
+		/* the route is found once, for the body and the callback */
+		if (evcon->http_server != NULL && req->uri != NULL)
+			req->route = evhttp_dispatch_callback(
+				evcon->http_server, req);
 		event_debug(("%s: checking for post data on %d\n",
 				__func__, fd));
 		evhttp_get_body(evcon, req);
 		break;
 
 	case EVHTTP_RESPONSE:
-		if (req->response_code == HTTP_NOCONTENT ||
+		if (req->type == EVHTTP_REQ_HEAD ||
+		    req->response_code == HTTP_NOCONTENT ||
 		    req->response_code == HTTP_NOTMODIFIED ||
 		    (req->response_code >= 100 && req->response_code < 200)) {
 			event_debug(("%s: skipping body for code %d\n",
@@ -1449,12 +2802,7 @@ evhttp_connection_new(const char *address, unsigned short port)
 		event_warn("%s: calloc failed", __func__);
 		goto error;
 	}
-
-	evcon->fd = -1;
-	evcon->port = port;
-
-	evcon->timeout = -1;
-	evcon->retry_cnt = evcon->retry_max = 0;
+	evhttp_connection_init(evcon, port);
 
 	if ((evcon->address = strdup(address)) == NULL) {
 		event_warn("%s: strdup failed", __func__);
@@ -1470,9 +2818,6 @@ evhttp_connection_new(const char *address, unsigned short port)
 		event_warn("%s: evbuffer_new failed", __func__);
 		goto error;
 	}
-	
-	evcon->state = EVCON_DISCONNECTED;
-	TAILQ_INIT(&evcon->requests);
 
 	return (evcon);
 	
@@ -1504,6 +2849,26 @@ evhttp_connection_set_retries(struct evhttp_connection *evcon,
 	evcon->retry_max = retry_max;
 }
 
+void
+evhttp_connection_set_max_headers_size(struct evhttp_connection *evcon,
+    ev_int64_t max_size)
+{
+	evcon->max_headers_size = max_size < 0 ? -1 : max_size;
+}
+
+void
+evhttp_connection_set_max_body_size(struct evhttp_connection *evcon,
+    ev_int64_t max_size)
+{
+	evcon->max_body_size = max_size < 0 ? -1 : max_size;
+}
+
+void
+evhttp_connection_set_pipeline(struct evhttp_connection *evcon, int depth)
+{
+	evcon->pipeline_max = depth > 1 ? depth : 1;
+}
+
 void
 evhttp_connection_set_closecb(struct evhttp_connection *evcon,
     void (*cb)(struct evhttp_connection *, void *), void *cbarg)
@@ -1520,45 +2885,401 @@ evhttp_connection_get_peer(struct evhttp_connection *evcon,
 	*port = evcon->port;
 }
 
-int
-evhttp_connection_connect(struct evhttp_connection *evcon)
-{
-	if (evcon->state == EVCON_CONNECTING)
-		return (0);
-	
-	evhttp_connection_reset(evcon);
+/*
+ * Name resolution for outgoing connections.  Host names are resolved with
+ * evdns, which reads the system configuration the first time it is needed;
+ * the system resolver would block the event loop and is never used for
+ * them.  Like evdns, the answers are shared by the whole process: a small
+ * table keeps them for their TTL so that further connections to the same
+ * host can connect right away.  Literal addresses never go to a resolver.
+ */
 
-	assert(!(evcon->flags & EVHTTP_CON_INCOMING));
-	evcon->flags |= EVHTTP_CON_OUTGOING;
-	
-	evcon->fd = bind_socket(evcon->bind_address, 0);
-	if (evcon->fd == -1) {
-		event_debug(("%s: failed to bind to \"%s\"",
-			__func__, evcon->bind_address));
-		return (-1);
-	}
+struct evhttp_dns_request {
+	struct evhttp_connection *evcon;	/* NULL once cancelled */
+	int ipv6;				/* asked for AAAA records */
+};
 
-	if (socket_connect(evcon->fd, evcon->address, evcon->port) == -1) {
-		EVUTIL_CLOSESOCKET(evcon->fd); evcon->fd = -1;
-		return (-1);
+static struct evhttp_dns_entry {
+	char name[EVHTTP_DNS_NAME_MAX];
+	int family;
+	union {
+		struct in_addr in;
+		struct in6_addr in6;
+	} addr;
+	time_t expire;
+} evhttp_dns_cache[EVHTTP_DNS_CACHE_SIZE];
+
+static int evhttp_dns_configured;
+
+/* Builds the address to connect to from a resolved one */
+static socklen_t
+evhttp_dns_sockaddr(int family, const void *addr, u_short port,
+    struct sockaddr_storage *ss)
+{
+	memset(ss, 0, sizeof(*ss));
+	if (family == AF_INET6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		memcpy(&sin6->sin6_addr, addr, sizeof(struct in6_addr));
+		return (sizeof(struct sockaddr_in6));
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		memcpy(&sin->sin_addr, addr, sizeof(struct in_addr));
+		return (sizeof(struct sockaddr_in));
 	}
+}
 
-	/* Set up a callback for successful connection setup */
-	event_set(&evcon->ev, evcon->fd, EV_WRITE, evhttp_connectioncb, evcon);
-	EVHTTP_BASE_SET(evcon, &evcon->ev);
-	evhttp_add_event(&evcon->ev, evcon->timeout, HTTP_CONNECT_TIMEOUT);
+static socklen_t
+evhttp_dns_cache_find(const char *name, u_short port,
+    struct sockaddr_storage *ss)
+{
+	time_t now = time(NULL);
+	int i;
+
+	for (i = 0; i < EVHTTP_DNS_CACHE_SIZE; i++) {
+		struct evhttp_dns_entry *entry = &evhttp_dns_cache[i];
+		if (entry->expire > now &&
+		    strcasecmp(entry->name, name) == 0)
+			return (evhttp_dns_sockaddr(entry->family,
+				&entry->addr, port, ss));
+	}
 
-	evcon->state = EVCON_CONNECTING;
-	
 	return (0);
 }
 
-/*
- * Starts an HTTP request on the provided evhttp_connection object.
- * If the connection object is not connected to the web server already,
- * this will start the connection.
+static void
+evhttp_dns_cache_add(const char *name, int family, const void *addr,
+    int ttl)
+{
+	struct evhttp_dns_entry *entry = NULL;
+	int i;
+
+	if (ttl <= 0 || strlen(name) >= EVHTTP_DNS_NAME_MAX)
+		return;
+
+	/* replace the same name or else the entry that expires first */
+	for (i = 0; i < EVHTTP_DNS_CACHE_SIZE; i++) {
+		struct evhttp_dns_entry *cur = &evhttp_dns_cache[i];
+		if (strcasecmp(cur->name, name) == 0) {
+			entry = cur;
+			break;
+		}
+		if (entry == NULL || cur->expire < entry->expire)
+			entry = cur;
+	}
+
+	strlcpy(entry->name, name, sizeof(entry->name));
+	entry->family = family;
+	memcpy(&entry->addr, addr, family == AF_INET6 ?
+	    sizeof(struct in6_addr) : sizeof(struct in_addr));
+	entry->expire = time(NULL) + ttl;
+}
+
+static int
+evhttp_parse_ipv4(const char *address, struct in_addr *addr)
+{
+#ifdef WIN32
+	unsigned long r = inet_addr(address);
+	if (r == INADDR_NONE)
+		return (0);
+	addr->s_addr = r;
+	return (1);
+#else
+	return (inet_aton(address, addr) != 0);
+#endif
+}
+
+static void
+evhttp_connection_cancel_resolve(struct evhttp_connection *evcon)
+{
+	/* evdns cannot cancel a query; its callback finds no connection */
+	if (evcon->dns_req != NULL) {
+		evcon->dns_req->evcon = NULL;
+		evcon->dns_req = NULL;
+	}
+}
+
+/* Waits for a non-blocking connect on evcon->fd to finish */
+static void
+evhttp_connection_wait_connect(struct evhttp_connection *evcon)
+{
+	/* Set up a callback for successful connection setup */
+	event_set(&evcon->ev, evcon->fd, EV_WRITE, evhttp_connectioncb, evcon);
+	EVHTTP_BASE_SET(evcon, &evcon->ev);
+	evhttp_add_event(&evcon->ev, evcon->timeout, HTTP_CONNECT_TIMEOUT);
+
+	evcon->state = EVCON_CONNECTING;
+}
+
+/* Binds the socket of a connection to its local address, if any */
+static int
+evhttp_connection_bind(struct evhttp_connection *evcon, int family)
+{
+#ifdef HAVE_GETADDRINFO
+	struct addrinfo hints, *local;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = family;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(evcon->bind_address, "0", &hints, &local) != 0) {
+		event_debug(("%s: failed to resolve \"%s\"",
+			__func__, evcon->bind_address));
+		return (-1);
+	}
+	evcon->fd = bind_socket_ai(local);
+	freeaddrinfo(local);
+#else
+	evcon->fd = bind_socket(evcon->bind_address, 0);
+#endif
+	if (evcon->fd == -1) {
+		event_debug(("%s: failed to bind to \"%s\"",
+			__func__, evcon->bind_address));
+		return (-1);
+	}
+
+	return (0);
+}
+
+static int
+evhttp_connection_connect_addr(struct evhttp_connection *evcon,
+    struct sockaddr *sa, socklen_t salen)
+{
+	if (evhttp_connection_bind(evcon, sa->sa_family) == -1)
+		return (-1);
+
+	if (socket_connect_sa(evcon->fd, sa, salen) == -1) {
+		EVUTIL_CLOSESOCKET(evcon->fd); evcon->fd = -1;
+		return (-1);
+	}
+
+	evhttp_connection_wait_connect(evcon);
+
+	return (0);
+}
+
+/* Connects to a literal IPv6 address */
+static int
+evhttp_connection_connect_ipv6(struct evhttp_connection *evcon)
+{
+#ifdef HAVE_GETADDRINFO
+	struct addrinfo hints, *ai;
+	char strport[NI_MAXSERV];
+	int res;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET6;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST;
+	snprintf(strport, sizeof(strport), "%d", evcon->port);
+	if (getaddrinfo(evcon->address, strport, &hints, &ai) != 0) {
+		event_debug(("%s: not an address: \"%s\"",
+			__func__, evcon->address));
+		return (-1);
+	}
+
+	res = evhttp_connection_connect_addr(evcon, ai->ai_addr,
+	    ai->ai_addrlen);
+	freeaddrinfo(ai);
+	return (res);
+#else
+	return (-1);
+#endif
+}
+
+#ifndef WIN32
+static int
+evhttp_connection_connect_unix(struct evhttp_connection *evcon,
+    struct sockaddr_un *su, socklen_t sulen)
+{
+	if ((evcon->fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		event_warn("socket");
+		return (-1);
+	}
+
+	if (evutil_make_socket_nonblocking(evcon->fd) < 0 ||
+	    socket_connect_sa(evcon->fd, (struct sockaddr *)su,
+		sulen) == -1) {
+		EVUTIL_CLOSESOCKET(evcon->fd); evcon->fd = -1;
+		return (-1);
+	}
+
+	evhttp_connection_wait_connect(evcon);
+
+	return (0);
+}
+#endif
+
+static void evhttp_connection_dnscb(int, char, int, int, void *, void *);
+
+static int
+evhttp_connection_query(struct evhttp_connection *evcon, int ipv6)
+{
+	struct evhttp_dns_request *dns_req;
+	int res;
+
+	if ((dns_req = calloc(1, sizeof(struct evhttp_dns_request))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (-1);
+	}
+	dns_req->evcon = evcon;
+	dns_req->ipv6 = ipv6;
+
+	if (ipv6)
+		res = evdns_resolve_ipv6(evcon->address, 0,
+		    evhttp_connection_dnscb, dns_req);
+	else
+		res = evdns_resolve_ipv4(evcon->address, 0,
+		    evhttp_connection_dnscb, dns_req);
+	if (res != 0) {
+		free(dns_req);
+		return (-1);
+	}
+	evcon->dns_req = dns_req;
+
+	return (0);
+}
+
+static void
+evhttp_connection_dnscb(int result, char type, int count, int ttl,
+    void *addresses, void *arg)
+{
+	struct evhttp_dns_request *dns_req = arg;
+	struct evhttp_connection *evcon = dns_req->evcon;
+	struct sockaddr_storage ss;
+	socklen_t sslen;
+	int family, ipv6 = dns_req->ipv6;
+
+	free(dns_req);
+	if (evcon == NULL)
+		return;
+	evcon->dns_req = NULL;
+
+	if (result == DNS_ERR_NONE && count > 0 &&
+	    (type == DNS_IPv4_A || type == DNS_IPv6_AAAA)) {
+		/* stop the timeout for the resolution */
+		event_del(&evcon->ev);
+
+		family = type == DNS_IPv6_AAAA ? AF_INET6 : AF_INET;
+		evhttp_dns_cache_add(evcon->address, family, addresses, ttl);
+		sslen = evhttp_dns_sockaddr(family, addresses, evcon->port,
+		    &ss);
+		if (evhttp_connection_connect_addr(evcon,
+			(struct sockaddr *)&ss, sslen) == -1)
+			evhttp_connection_connect_failed(evcon);
+		return;
+	}
+
+	event_debug(("%s: could not resolve \"%s\": %s",
+		__func__, evcon->address, evdns_err_to_string(result)));
+
+	/*
+	 * An answer without addresses comes back as DNS_ERR_UNKNOWN; the
+	 * host may only have an IPv6 address.  The connect timeout keeps
+	 * running while it is asked for.
+	 */
+	if (!ipv6 && (result == DNS_ERR_NONE || result == DNS_ERR_UNKNOWN) &&
+	    evhttp_connection_query(evcon, 1) == 0)
+		return;
+
+	event_del(&evcon->ev);
+	evhttp_connection_connect_failed(evcon);
+}
+
+static int
+evhttp_connection_resolve(struct evhttp_connection *evcon)
+{
+	/* evdns is set up from the system configuration if nobody did */
+	if (evdns_count_nameservers() == 0 && !evhttp_dns_configured) {
+		evhttp_dns_configured = 1;
+		evdns_init();
+	}
+	if (evdns_count_nameservers() == 0) {
+		event_warnx("%s: no nameservers to resolve \"%s\"",
+		    __func__, evcon->address);
+		return (-1);
+	}
+
+	if (evhttp_connection_query(evcon, 0) == -1)
+		return (-1);
+
+	/* the connect timeout includes the time to resolve the name */
+	evtimer_set(&evcon->ev, evhttp_connectioncb, evcon);
+	EVHTTP_BASE_SET(evcon, &evcon->ev);
+	evhttp_add_event(&evcon->ev, evcon->timeout, HTTP_CONNECT_TIMEOUT);
+
+	evcon->state = EVCON_CONNECTING;
+
+	return (0);
+}
+
+int
+evhttp_connection_connect(struct evhttp_connection *evcon)
+{
+	struct sockaddr_storage ss;
+	socklen_t sslen;
+	struct in_addr addr;
+
+	if (evcon->state == EVCON_CONNECTING)
+		return (0);
+	
+	evhttp_connection_reset(evcon);
+
+	assert(!(evcon->flags & EVHTTP_CON_INCOMING));
+	evcon->flags |= EVHTTP_CON_OUTGOING;
+
+#ifndef WIN32
+	{
+		struct sockaddr_un su;
+		socklen_t sulen;
+
+		switch (unix_address(evcon->address, &su, &sulen)) {
+		case -1:
+			return (-1);
+		case 1:
+			return (evhttp_connection_connect_unix(evcon,
+				&su, sulen));
+		}
+	}
+#endif
+
+	if (evhttp_parse_ipv4(evcon->address, &addr))
+		sslen = evhttp_dns_sockaddr(AF_INET, &addr, evcon->port, &ss);
+	else
+		sslen = evhttp_dns_cache_find(evcon->address, evcon->port,
+		    &ss);
+	if (sslen != 0)
+		return (evhttp_connection_connect_addr(evcon,
+			(struct sockaddr *)&ss, sslen));
+
+	/* host names cannot contain a colon, IPv6 addresses always do */
+	if (strchr(evcon->address, ':') != NULL)
+		return (evhttp_connection_connect_ipv6(evcon));
+
+	return (evhttp_connection_resolve(evcon));
+}
+
+/*
+ * Starts an HTTP request on the provided evhttp_connection object.
+ * If the connection object is not connected to the web server already,
+ * this will start the connection.
  */
 
+/* Goes back to reading the response that was interrupted by the write */
+
+static void
+evhttp_write_pipelinedcb(struct evhttp_connection *evcon, void *arg)
+{
+	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
+
+	evhttp_connection_wait(evcon, EV_READ,
+	    timerisset(&req->timing.headers_done) ?
+	    evhttp_read : evhttp_read_header, HTTP_READ_TIMEOUT);
+}
+
 int
 evhttp_make_request(struct evhttp_connection *evcon,
     struct evhttp_request *req,
@@ -1595,342 +3316,2738 @@ evhttp_make_request(struct evhttp_connection *evcon,
 	 */
 	if (TAILQ_FIRST(&evcon->requests) == req)
 		evhttp_request_dispatch(evcon);
+	else if (evcon->npipelined && evhttp_connection_fill_pipeline(evcon) &&
+	    event_pending(&evcon->ev, EV_READ, NULL)) {
+		/*
+		 * We are waiting for a response; it is read on once the
+		 * request is out.  Otherwise the request goes out with the
+		 * write in progress or after the current response.
+		 */
+		evhttp_write_buffer(evcon, evhttp_write_pipelinedcb, NULL);
+	}
 
 	return (0);
 }
 
 /*
- * Reads data from file descriptor into request structure
- * Request structure needs to be set up correctly.
+ * Client connection pools
  */
 
+struct evhttp_pool *
+evhttp_pool_new(struct event_base *base)
+{
+	struct evhttp_pool *pool;
+
+	if ((pool = calloc(1, sizeof(struct evhttp_pool))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (NULL);
+	}
+
+	TAILQ_INIT(&pool->hosts);
+	pool->max_connections = EVHTTP_POOL_MAX_CONNECTIONS;
+	pool->idle_timeout = EVHTTP_POOL_IDLE_TIMEOUT;
+	pool->timeout = -1;
+	pool->base = base;
+
+	return (pool);
+}
+
 void
-evhttp_start_read(struct evhttp_connection *evcon)
+evhttp_pool_free(struct evhttp_pool *pool)
 {
-	/* Set up an event to read the headers */
-	if (event_initialized(&evcon->ev))
-		event_del(&evcon->ev);
-	event_set(&evcon->ev, evcon->fd, EV_READ, evhttp_read_header, evcon);
-	EVHTTP_BASE_SET(evcon, &evcon->ev);
-	
-	evhttp_add_event(&evcon->ev, evcon->timeout, HTTP_READ_TIMEOUT);
+	struct evhttp_pool_host *host;
+	struct evhttp_connection *evcon;
+	struct evhttp_request *req;
+
+	while ((host = TAILQ_FIRST(&pool->hosts)) != NULL) {
+		TAILQ_REMOVE(&pool->hosts, host, next);
+
+		while ((evcon = TAILQ_FIRST(&host->connections)) != NULL) {
+			TAILQ_REMOVE(&host->connections, evcon, next);
+			evcon->pool_host = NULL;
+			evhttp_connection_free(evcon);
+		}
+
+		while ((req = TAILQ_FIRST(&host->requests)) != NULL) {
+			TAILQ_REMOVE(&host->requests, req, next);
+			evhttp_request_free(req);
+		}
+
+		free(host->address);
+		free(host);
+	}
+
+	free(pool);
 }
 
-static void
-evhttp_send_done(struct evhttp_connection *evcon, void *arg)
+void
+evhttp_pool_set_max_connections(struct evhttp_pool *pool, int max)
 {
-	int need_close;
-	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
-	TAILQ_REMOVE(&evcon->requests, req, next);
+	pool->max_connections = max > 0 ? max : 1;
+}
 
-	/* delete possible close detection events */
-	evhttp_connection_stop_detectclose(evcon);
-	
-	need_close =
-	    (req->minor == 0 &&
-		!evhttp_is_connection_keepalive(req->input_headers))||
-	    evhttp_is_connection_close(req->flags, req->input_headers) ||
-	    evhttp_is_connection_close(req->flags, req->output_headers);
+void
+evhttp_pool_set_idle_timeout(struct evhttp_pool *pool, int timeout_in_secs)
+{
+	struct evhttp_pool_host *host;
+	struct evhttp_connection *evcon;
 
-	assert(req->flags & EVHTTP_REQ_OWN_CONNECTION);
-	evhttp_request_free(req);
+	pool->idle_timeout = timeout_in_secs;
+
+	TAILQ_FOREACH(host, &pool->hosts, next) {
+		TAILQ_FOREACH(evcon, &host->connections, next)
+			evcon->idle_timeout = timeout_in_secs;
+	}
+}
+
+void
+evhttp_pool_set_timeout(struct evhttp_pool *pool, int timeout_in_secs)
+{
+	struct evhttp_pool_host *host;
+	struct evhttp_connection *evcon;
+
+	pool->timeout = timeout_in_secs;
+
+	TAILQ_FOREACH(host, &pool->hosts, next) {
+		TAILQ_FOREACH(evcon, &host->connections, next)
+			evhttp_connection_set_timeout(evcon, timeout_in_secs);
+	}
+}
+
+static struct evhttp_pool_host *
+evhttp_pool_find_host(struct evhttp_pool *pool,
+    const char *address, unsigned short port)
+{
+	struct evhttp_pool_host *host;
+
+	TAILQ_FOREACH(host, &pool->hosts, next) {
+		if (host->port == port && strcmp(host->address, address) == 0)
+			return (host);
+	}
+
+	return (NULL);
+}
+
+static struct evhttp_pool_host *
+evhttp_pool_get_host(struct evhttp_pool *pool,
+    const char *address, unsigned short port)
+{
+	struct evhttp_pool_host *host;
+
+	if ((host = evhttp_pool_find_host(pool, address, port)) != NULL)
+		return (host);
+
+	if ((host = calloc(1, sizeof(struct evhttp_pool_host))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	if ((host->address = strdup(address)) == NULL) {
+		event_warn("%s: strdup", __func__);
+		free(host);
+		return (NULL);
+	}
+	host->port = port;
+	host->pool = pool;
+	TAILQ_INIT(&host->connections);
+	TAILQ_INIT(&host->requests);
+
+	TAILQ_INSERT_TAIL(&pool->hosts, host, next);
+
+	return (host);
+}
+
+/*
+ * Returns a connection that can take a request right away: an idle one,
+ * preferably still connected, or a new one if the host has room for it.
+ */
+
+static struct evhttp_connection *
+evhttp_pool_get_connection(struct evhttp_pool_host *host)
+{
+	struct evhttp_pool *pool = host->pool;
+	struct evhttp_connection *evcon, *idle = NULL;
+
+	TAILQ_FOREACH(evcon, &host->connections, next) {
+		if (TAILQ_FIRST(&evcon->requests) != NULL)
+			continue;
+		if (evcon->state == EVCON_CONNECTED)
+			return (evcon);
+		if (idle == NULL)
+			idle = evcon;
+	}
+
+	if (idle != NULL || host->nconnections >= pool->max_connections)
+		return (idle);
+
+	evcon = evhttp_connection_new(host->address, host->port);
+	if (evcon == NULL)
+		return (NULL);
+	if (pool->base != NULL)
+		evhttp_connection_set_base(evcon, pool->base);
+	evhttp_connection_set_timeout(evcon, pool->timeout);
+	evcon->idle_timeout = pool->idle_timeout;
+	evcon->pool_host = host;
+
+	TAILQ_INSERT_TAIL(&host->connections, evcon, next);
+	host->nconnections++;
+
+	return (evcon);
+}
+
+/* Sends a waiting request that already has its type and uri set */
+static void
+evhttp_pool_send(struct evhttp_connection *evcon, struct evhttp_request *req)
+{
+	char *uri = req->uri;
+
+	req->uri = NULL;
+	if (evhttp_make_request(evcon, req, req->type, uri) == -1) {
+		/* like a failed connection attempt */
+		if (req->evcon != NULL) {
+			TAILQ_REMOVE(&evcon->requests, req, next);
+			req->evcon = NULL;
+		}
+		(*req->cb)(req, req->cb_arg);
+		evhttp_request_free(req);
+	}
+	free(uri);
+}
+
+static void
+evhttp_pool_connection_idle(struct evhttp_connection *evcon)
+{
+	struct evhttp_pool_host *host = evcon->pool_host;
+	struct evhttp_request *req;
+
+	if (host == NULL || TAILQ_FIRST(&evcon->requests) != NULL)
+		return;
+
+	if ((req = TAILQ_FIRST(&host->requests)) == NULL)
+		return;
+	TAILQ_REMOVE(&host->requests, req, next);
+
+	evhttp_pool_send(evcon, req);
+}
+
+int
+evhttp_pool_make_request(struct evhttp_pool *pool,
+    const char *address, unsigned short port,
+    struct evhttp_request *req,
+    enum evhttp_cmd_type type, const char *uri)
+{
+	struct evhttp_pool_host *host;
+	struct evhttp_connection *evcon;
+
+	if ((host = evhttp_pool_get_host(pool, address, port)) == NULL)
+		return (-1);
+
+	if ((evcon = evhttp_pool_get_connection(host)) != NULL)
+		return (evhttp_make_request(evcon, req, type, uri));
+
+	/* all connections are busy; wait for one of them */
+	req->kind = EVHTTP_REQUEST;
+	req->type = type;
+	if (req->uri != NULL)
+		free(req->uri);
+	if ((req->uri = strdup(uri)) == NULL)
+		event_err(1, "%s: strdup", __func__);
+
+	TAILQ_INSERT_TAIL(&host->requests, req, next);
+
+	return (0);
+}
+
+/*
+ * Reads data from file descriptor into request structure
+ * Request structure needs to be set up correctly.
+ */
+
+void
+evhttp_start_read(struct evhttp_connection *evcon)
+{
+	/* Set up an event to read the headers */
+	evhttp_connection_wait(evcon, EV_READ, evhttp_read_header,
+	    HTTP_READ_TIMEOUT);
+}
+
+/*
+ * Response compression.  Bodies are compressed with gzip or deflate if
+ * the server enabled it and the client accepts it; whole replies only if
+ * they are large enough, streamed replies chunk by chunk.  The compressor
+ * states are kept by the server and reset for the next response, which
+ * is much cheaper than setting them up again.
+ */
+
+#define EVHTTP_CODING_GZIP	1
+#define EVHTTP_CODING_DEFLATE	2
+
+#ifdef EVHTTP_ZLIB
+struct evhttp_deflate {
+	struct evhttp_deflate *next;
+	z_stream z;
+	int gzip;
+	int level;			/* compression level of z */
+	struct evbuffer *out;		/* compressed data */
+};
+
+/*
+ * Returns the content coding to use for a response: gzip if the client
+ * accepts it, deflate otherwise if it accepts that, 0 for none.  A coding
+ * that is named explicitly overrides "*", also when it is refused.
+ */
+
+static int
+evhttp_accepted_coding(const char *value)
+{
+	int gzip = -1, deflate = -1, any = -1;
+
+	while (*value != '\0') {
+		const char *token, *end;
+		size_t len;
+		int accepted = 1;
+
+		value += strspn(value, " \t,");
+		token = value;
+		len = strcspn(token, " \t;,");
+		end = token + strcspn(token, ",");
+
+		/* a quality of 0 means not acceptable */
+		if ((value = strchr(token, ';')) != NULL && value < end) {
+			value += strspn(value + 1, " \t") + 1;
+			if ((*value == 'q' || *value == 'Q') && value[1] == '=')
+				accepted = strtod(value + 2, NULL) > 0;
+		}
+		value = end;
+
+		if (len == 4 && strncasecmp(token, "gzip", 4) == 0)
+			gzip = accepted;
+		else if (len == 7 && strncasecmp(token, "deflate", 7) == 0)
+			deflate = accepted;
+		else if (len == 1 && *token == '*')
+			any = accepted;
+	}
+
+	if (gzip == 1 || (gzip == -1 && any == 1))
+		return (EVHTTP_CODING_GZIP);
+	if (deflate == 1 || (deflate == -1 && any == 1))
+		return (EVHTTP_CODING_DEFLATE);
+	return (0);
+}
+
+/* Tells caches that the reply depends on Accept-Encoding */
+
+static void
+evhttp_add_vary(struct evhttp_request *req)
+{
+	const char *vary = evhttp_find_header(req->output_headers, "Vary");
+	const char *p;
+	char *value;
+	size_t len;
+
+	if (vary == NULL) {
+		evhttp_add_header(req->output_headers, "Vary",
+		    "Accept-Encoding");
+		return;
+	}
+
+	for (p = vary; *p != '\0'; p += len) {
+		p += strspn(p, " \t,");
+		len = strcspn(p, " \t,");
+		if ((len == 1 && *p == '*') || (len == 15 &&
+			strncasecmp(p, "Accept-Encoding", 15) == 0))
+			return;
+	}
+
+	len = strlen(vary) + sizeof(", Accept-Encoding");
+	if ((value = malloc(len)) == NULL) {
+		event_warn("%s: malloc", __func__);
+		return;
+	}
+	snprintf(value, len, "%s, Accept-Encoding", vary);
+	evhttp_remove_header(req->output_headers, "Vary");
+	evhttp_add_header(req->output_headers, "Vary", value);
+	free(value);
+}
+
+static int
+evhttp_response_coding(struct evhttp_request *req)
+{
+	struct evhttp *http = req->evcon->http_server;
+	const char *accept;
+
+	if (http == NULL || http->compress_level == 0 ||
+	    req->type == EVHTTP_REQ_HEAD ||
+	    req->response_code < 200 ||
+	    req->response_code == HTTP_NOCONTENT ||
+	    req->response_code == HTTP_NOTMODIFIED ||
+	    evhttp_find_header(req->output_headers,
+		"Content-Encoding") != NULL ||
+	    evhttp_find_header(req->output_headers,
+		"Content-Length") != NULL)
+		return (0);
+
+	/* the reply could have been compressed for another client */
+	evhttp_add_vary(req);
+
+	accept = evhttp_find_header(req->input_headers, "Accept-Encoding");
+	if (accept == NULL)
+		return (0);
+
+	return (evhttp_accepted_coding(accept));
+}
+
+static void
+evhttp_deflate_free(struct evhttp_deflate *d)
+{
+	deflateEnd(&d->z);
+	evbuffer_free(d->out);
+	free(d);
+}
+
+static struct evhttp_deflate *
+evhttp_deflate_get(struct evhttp *http, int coding)
+{
+	struct evhttp_deflate *d, **pd;
+	int gzip = coding == EVHTTP_CODING_GZIP;
+
+	for (pd = &http->free_deflate; (d = *pd) != NULL; pd = &d->next) {
+		if (d->gzip == gzip) {
+			*pd = d->next;
+			http->nfree_deflate--;
+			return (d);
+		}
+	}
+
+	if ((d = calloc(1, sizeof(struct evhttp_deflate))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	if ((d->out = evbuffer_new()) == NULL) {
+		event_warn("%s: evbuffer_new", __func__);
+		free(d);
+		return (NULL);
+	}
+
+	/* 16 added to the window bits asks for a gzip header and trailer */
+	d->gzip = gzip;
+	d->level = http->compress_level;
+	if (deflateInit2(&d->z, http->compress_level, Z_DEFLATED,
+		gzip ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		event_warnx("%s: deflateInit2 failed", __func__);
+		evbuffer_free(d->out);
+		free(d);
+		return (NULL);
+	}
+
+	return (d);
+}
+
+static void
+evhttp_deflate_put(struct evhttp *http, struct evhttp_deflate *d)
+{
+	if (http->nfree_deflate >= http->max_pooled ||
+	    d->level != http->compress_level ||
+	    deflateReset(&d->z) != Z_OK) {
+		evhttp_deflate_free(d);
+		return;
+	}
+
+	evbuffer_drain(d->out, EVBUFFER_LENGTH(d->out));
+	d->next = http->free_deflate;
+	http->free_deflate = d;
+	http->nfree_deflate++;
+}
+
+/* Compresses data into d->out; zlib writes into the buffer directly */
+
+static int
+evhttp_deflate_data(struct evhttp_deflate *d, const u_char *data, size_t len,
+    int flush)
+{
+	struct evbuffer *out = d->out;
+	size_t space;
+	int res;
+
+	d->z.next_in = (Bytef *)data;
+	d->z.avail_in = len;
+	do {
+		if (evbuffer_expand(out, deflateBound(&d->z, len)) == -1)
+			return (-1);
+		space = out->totallen - out->misalign - out->off;
+		d->z.next_out = out->buffer + out->off;
+		d->z.avail_out = space;
+
+		res = deflate(&d->z, flush);
+		out->off += space - d->z.avail_out;
+		if (res == Z_STREAM_ERROR)
+			return (-1);
+	} while (d->z.avail_out == 0 ||
+	    (flush == Z_FINISH && res != Z_STREAM_END));
+
+	return (0);
+}
+
+static void
+evhttp_add_coding_header(struct evhttp_request *req, int coding)
+{
+	evhttp_add_header(req->output_headers, "Content-Encoding",
+	    coding == EVHTTP_CODING_GZIP ? "gzip" : "deflate");
+}
+
+/* Compresses the output buffer of a complete reply if it is worth it */
+
+static void
+evhttp_compress_reply(struct evhttp_request *req)
+{
+	struct evhttp *http = req->evcon->http_server;
+	struct evhttp_deflate *d;
+	size_t len = EVBUFFER_LENGTH(req->output_buffer);
+	int coding;
+
+	if ((coding = evhttp_response_coding(req)) == 0 ||
+	    len < http->compress_min_size || len == 0)
+		return;
+
+	if ((d = evhttp_deflate_get(http, coding)) == NULL)
+		return;
+
+	if (evhttp_deflate_data(d, EVBUFFER_DATA(req->output_buffer), len,
+		Z_FINISH) == 0 && EVBUFFER_LENGTH(d->out) < len) {
+		evbuffer_drain(req->output_buffer, len);
+		evbuffer_add_buffer(req->output_buffer, d->out);
+		evhttp_add_coding_header(req, coding);
+	}
+
+	evhttp_deflate_put(http, d);
+}
+
+/* Sets up compression for a reply that is sent in chunks */
+
+static void
+evhttp_compress_start(struct evhttp_request *req)
+{
+	int coding;
+
+	if ((coding = evhttp_response_coding(req)) == 0)
+		return;
+
+	req->deflate = evhttp_deflate_get(req->evcon->http_server, coding);
+	if (req->deflate != NULL)
+		evhttp_add_coding_header(req, coding);
+}
+#endif
+
+int
+evhttp_set_compression(struct evhttp *http, int level, size_t min_size)
+{
+#ifdef EVHTTP_ZLIB
+	struct evhttp_deflate *d;
+
+	if (level < -1 || level > 9)
+		return (-1);
+
+	/* pooled states were set up for the old level */
+	if (level != http->compress_level) {
+		while ((d = http->free_deflate) != NULL) {
+			http->free_deflate = d->next;
+			http->nfree_deflate--;
+			evhttp_deflate_free(d);
+		}
+	}
+
+	http->compress_level = level;
+	http->compress_min_size = min_size;
+	return (0);
+#else
+	return (level == 0 ? 0 : -1);
+#endif
+}
+
+static void
+evhttp_send_done(struct evhttp_connection *evcon, void *arg)
+{
+	struct evhttp *http = evcon->http_server;
+	int need_close;
+	struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
+	TAILQ_REMOVE(&evcon->requests, req, next);
+
+	/* delete possible close detection events */
+	evhttp_connection_stop_detectclose(evcon);
+
+	req->timing.last_write = evcon->last_io;
+	if (http != NULL) {
+		evhttp_stats_request_done(http, req);
+		if (http->access_log != NULL)
+			evhttp_access_log_request(http, req);
+	}
+	
+	need_close =
+	    (req->minor == 0 &&
+		!evhttp_is_connection_keepalive(req->input_headers))||
+	    evhttp_is_connection_close(req->flags, req->input_headers) ||
+	    evhttp_is_connection_close(req->flags, req->output_headers);
+
+	/* a server at its connection limit does not keep them open */
+	if (http != NULL && http->accept_paused)
+		need_close = 1;
+
+	assert(req->flags & EVHTTP_REQ_OWN_CONNECTION);
+	evhttp_request_free(req);
+
+	if (need_close) {
+		evhttp_connection_free(evcon);
+		return;
+	} 
+
+	/* we have a persistent connection; try to accept another request. */
+	if (evhttp_associate_new_request_with_connection(evcon) == -1) {
+		evhttp_connection_free(evcon);
+		return;
+	}
+
+	/* it may be closed if the server needs room for new connections */
+	if (http != NULL && EVBUFFER_LENGTH(evcon->input_buffer) == 0) {
+		evcon->flags |= EVHTTP_CON_IDLE;
+		TAILQ_INSERT_TAIL(&http->idle_connections, evcon, idle_next);
+		if (http->max_connections != -1)
+			evhttp_limit_connections(http);
+	}
+}
+
+/*
+ * Returns an error page.
+ */
+
+void
+evhttp_send_error(struct evhttp_request *req, int error, const char *reason)
+{
+#define ERR_FORMAT "<HTML><HEAD>\n" \
+	    "<TITLE>%d %s</TITLE>\n" \
+	    "</HEAD><BODY>\n" \
+	    "<H1>Method Not Implemented</H1>\n" \
+	    "Invalid method in request<P>\n" \
+	    "</BODY></HTML>\n"
+
+	struct evbuffer *buf = evbuffer_new();
+
+	/* close the connection on error */
+	evhttp_add_header(req->output_headers, "Connection", "close");
+
+	evhttp_response_code(req, error, reason);
+
+	evbuffer_add_printf(buf, ERR_FORMAT, error, reason);
+
+	evhttp_send_page(req, buf);
+
+	evbuffer_free(buf);
+#undef ERR_FORMAT
+}
+
+/* Requires that headers and response code are already set up */
+
+static inline void
+evhttp_send(struct evhttp_request *req, struct evbuffer *databuf)
+{
+	struct evhttp_connection *evcon = req->evcon;
+
+	assert(TAILQ_FIRST(&evcon->requests) == req);
+
+	/* xxx: not sure if we really should expose the data buffer this way */
+	if (databuf != NULL)
+		evbuffer_add_buffer(req->output_buffer, databuf);
+
+	if (req->flags & EVHTTP_REQ_CACHEABLE)
+		evhttp_cache_store(evcon->http_server, req);
+
+#ifdef EVHTTP_ZLIB
+	if (req->kind == EVHTTP_RESPONSE)
+		evhttp_compress_reply(req);
+#endif
+	
+	/* Adds headers to the response */
+	evhttp_make_header(evcon, req);
+
+	evhttp_write_buffer(evcon, evhttp_send_done, NULL);
+}
+
+void
+evhttp_send_reply(struct evhttp_request *req, int code, const char *reason,
+    struct evbuffer *databuf)
+{
+	/* set up to watch for client close */
+	evhttp_connection_start_detectclose(req->evcon);
+	evhttp_response_code(req, code, reason);
+	
+	evhttp_send(req, databuf);
+}
+
+void
+evhttp_send_reply_start(struct evhttp_request *req, int code,
+    const char *reason)
+{
+	/* set up to watch for client close */
+	evhttp_connection_start_detectclose(req->evcon);
+	evhttp_response_code(req, code, reason);
+#ifdef EVHTTP_ZLIB
+	evhttp_compress_start(req);
+#endif
+	if (req->major == 1 && req->minor == 1) {
+		/* use chunked encoding for HTTP/1.1 */
+		evhttp_add_header(req->output_headers, "Transfer-Encoding",
+		    "chunked");
+		req->chunked = 1;
+	}
+	evhttp_make_header(req->evcon, req);
+	evhttp_write_buffer(req->evcon, NULL, NULL);
+}
+
+/*
+ * Writes the size line of a chunk of len bytes into buf, which has room for
+ * EVHTTP_CHUNK_HEADER_MAX bytes, and returns its length.
+ */
+static size_t
+evhttp_chunk_header(char *buf, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	char tmp[sizeof(size_t) * 2];
+	size_t n = 0, off = 0;
+
+	do {
+		tmp[n++] = hex[len & 0xf];
+		len >>= 4;
+	} while (len != 0);
+
+	while (n > 0)
+		buf[off++] = tmp[--n];
+	buf[off++] = '\r';
+	buf[off++] = '\n';
+
+	return (off);
+}
+
+void
+evhttp_send_reply_chunk(struct evhttp_request *req, struct evbuffer *databuf)
+{
+#ifdef EVHTTP_ZLIB
+	if (req->deflate != NULL) {
+		/* flushed, so that the client sees each chunk right away */
+		if (evhttp_deflate_data(req->deflate, EVBUFFER_DATA(databuf),
+			EVBUFFER_LENGTH(databuf), Z_SYNC_FLUSH) == -1)
+			event_warnx("%s: deflate failed", __func__);
+		evbuffer_drain(databuf, EVBUFFER_LENGTH(databuf));
+		databuf = req->deflate->out;
+	}
+#endif
+	if (req->chunked) {
+		char hdr[EVHTTP_CHUNK_HEADER_MAX];
+		size_t hdrlen = evhttp_chunk_header(hdr,
+		    EVBUFFER_LENGTH(databuf));
+		evhttp_connection_add(req->evcon, hdr, hdrlen);
+	}
+	evhttp_connection_add_buffer(req->evcon, databuf);
+	if (req->chunked) {
+		evhttp_connection_add(req->evcon, "\r\n", 2);
+	}
+	evhttp_write_buffer(req->evcon, NULL, NULL);
+}
+
+void
+evhttp_send_reply_end(struct evhttp_request *req)
+{
+	struct evhttp_connection *evcon = req->evcon;
+
+#ifdef EVHTTP_ZLIB
+	if (req->deflate != NULL) {
+		struct evhttp_deflate *d = req->deflate;
+
+		/* the end of the compressed stream is the last chunk */
+		req->deflate = NULL;
+		if (evhttp_deflate_data(d, NULL, 0, Z_FINISH) == -1)
+			event_warnx("%s: deflate failed", __func__);
+		evhttp_send_reply_chunk(req, d->out);
+		evhttp_deflate_put(evcon->http_server, d);
+	}
+#endif
+
+	/* the stream is over, so no more broadcasts go to it */
+	if (evcon->broadcast != NULL)
+		evhttp_broadcast_unlink(evcon);
+
+	if (req->chunked) {
+		evhttp_connection_add(evcon, "0\r\n\r\n", 5);
+		evhttp_write_buffer(req->evcon, evhttp_send_done, NULL);
+		req->chunked = 0;
+	} else if (!event_pending(&evcon->ev, EV_WRITE|EV_TIMEOUT, NULL)) {
+		/* let the connection know that we are done with the request */
+		evhttp_send_done(evcon, NULL);
+	} else {
+		/* make the callback execute after all data has been written */
+		evcon->cb = evhttp_send_done;
+		evcon->cb_arg = NULL;
+	}
+}
+
+/*
+ * Broadcasts.  A message is encoded once as a complete chunk and every
+ * subscriber queues a reference to it, so that sending costs the same no
+ * matter how many streams receive it.
+ */
+
+struct evhttp_broadcast *
+evhttp_broadcast_new(void)
+{
+	struct evhttp_broadcast *bc;
+
+	if ((bc = calloc(1, sizeof(struct evhttp_broadcast))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (NULL);
+	}
+
+	TAILQ_INIT(&bc->subscribers);
+	bc->max_backlog = HTTP_BROADCAST_BACKLOG;
+
+	return (bc);
+}
+
+void
+evhttp_broadcast_free(struct evhttp_broadcast *bc)
+{
+	struct evhttp_connection *evcon;
+
+	while ((evcon = TAILQ_FIRST(&bc->subscribers)) != NULL)
+		evhttp_broadcast_unlink(evcon);
+
+	free(bc);
+}
+
+void
+evhttp_broadcast_set_max_backlog(struct evhttp_broadcast *bc,
+    size_t max_backlog)
+{
+	bc->max_backlog = max_backlog;
+}
+
+int
+evhttp_broadcast_add(struct evhttp_broadcast *bc, struct evhttp_request *req)
+{
+	struct evhttp_connection *evcon = req->evcon;
+
+	if (evcon == NULL || evcon->fd == -1)
+		return (-1);
+
+	/* a stream listens to one broadcast at a time */
+	if (evcon->broadcast != NULL)
+		evhttp_broadcast_unlink(evcon);
+
+	evcon->broadcast = bc;
+	TAILQ_INSERT_TAIL(&bc->subscribers, evcon, broadcast_next);
+	bc->nsubscribers++;
+
+	return (0);
+}
+
+void
+evhttp_broadcast_remove(struct evhttp_broadcast *bc,
+    struct evhttp_request *req)
+{
+	struct evhttp_connection *evcon = req->evcon;
+
+	if (evcon != NULL && evcon->broadcast == bc)
+		evhttp_broadcast_unlink(evcon);
+}
+
+int
+evhttp_broadcast_get_subscribers(struct evhttp_broadcast *bc)
+{
+	return (bc->nsubscribers);
+}
+
+static void
+evhttp_broadcast_unlink(struct evhttp_connection *evcon)
+{
+	struct evhttp_broadcast *bc = evcon->broadcast;
+
+	TAILQ_REMOVE(&bc->subscribers, evcon, broadcast_next);
+	bc->nsubscribers--;
+	evcon->broadcast = NULL;
+}
+
+static void
+evhttp_broadcast_msg_release(void *arg)
+{
+	struct evhttp_broadcast_msg *msg = arg;
+
+	if (--msg->refcnt == 0)
+		free(msg);
+}
+
+int
+evhttp_broadcast_send(struct evhttp_broadcast *bc, struct evbuffer *databuf)
+{
+	struct evhttp_subscriberq dropped;
+	struct evhttp_broadcast_msg *msg;
+	struct evhttp_connection *evcon, *next;
+	char hdr[EVHTTP_CHUNK_HEADER_MAX];
+	size_t hdrlen, len = EVBUFFER_LENGTH(databuf);
+
+	/* an empty chunk would end every stream */
+	if (len == 0)
+		return (0);
+
+	hdrlen = evhttp_chunk_header(hdr, len);
+	msg = malloc(sizeof(struct evhttp_broadcast_msg) + hdrlen + len + 2);
+	if (msg == NULL) {
+		event_warn("%s: malloc", __func__);
+		return (-1);
+	}
+	msg->refcnt = 1;
+	msg->hdrlen = hdrlen;
+	msg->len = len;
+	memcpy(msg->data, hdr, hdrlen);
+	memcpy(msg->data + hdrlen, EVBUFFER_DATA(databuf), len);
+	memcpy(msg->data + hdrlen + len, "\r\n", 2);
+	evbuffer_drain(databuf, len);
+
+	TAILQ_INIT(&dropped);
+	for (evcon = TAILQ_FIRST(&bc->subscribers); evcon != NULL;
+	    evcon = next) {
+		struct evhttp_request *req = TAILQ_FIRST(&evcon->requests);
+		next = TAILQ_NEXT(evcon, broadcast_next);
+
+		if (bc->max_backlog != 0 &&
+		    EVBUFFER_LENGTH(evcon->output_buffer) +
+		    evcon->segments_len + hdrlen + len + 2 > bc->max_backlog) {
+			/* a consumer this slow is cut off */
+			evhttp_broadcast_unlink(evcon);
+			TAILQ_INSERT_TAIL(&dropped, evcon, broadcast_next);
+			continue;
+		}
+
+#ifdef EVHTTP_ZLIB
+		if (req != NULL && req->deflate != NULL) {
+			/* compressed streams need their own copy */
+			struct evbuffer *buf = evbuffer_new();
+			if (buf == NULL)
+				continue;
+			evbuffer_add(buf, msg->data + hdrlen, len);
+			evhttp_send_reply_chunk(req, buf);
+			evbuffer_free(buf);
+			continue;
+		}
+#endif
+
+		if (req != NULL && req->chunked) {
+			if (evhttp_connection_add_segment(evcon, msg->data,
+				hdrlen + len + 2, evhttp_broadcast_msg_release,
+				msg) == -1)
+				continue;
+		} else {
+			if (evhttp_connection_add_segment(evcon,
+				msg->data + hdrlen, len,
+				evhttp_broadcast_msg_release, msg) == -1)
+				continue;
+		}
+		msg->refcnt++;
+
+		evhttp_write_buffer(evcon, NULL, NULL);
+	}
+
+	/* the close callbacks may change the subscribers, so they run last */
+	while ((evcon = TAILQ_FIRST(&dropped)) != NULL) {
+		TAILQ_REMOVE(&dropped, evcon, broadcast_next);
+		evhttp_connection_fail(evcon, EVCON_HTTP_EOF);
+	}
+
+	evhttp_broadcast_msg_release(msg);
+
+	return (0);
+}
+
+/*
+ * Reverse proxy.  A request is sent upstream as soon as its headers are
+ * complete and its body follows as it arrives; the response is streamed
+ * back the same way.  When the side that is written to falls behind, the
+ * side that is read from is paused until the backlog was written.
+ */
+
+struct evhttp_proxy *
+evhttp_proxy_new(struct evhttp_pool *pool, const char *address,
+    unsigned short port)
+{
+	struct evhttp_proxy *proxy;
+
+	if ((proxy = calloc(1, sizeof(struct evhttp_proxy))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	if ((proxy->address = strdup(address)) == NULL) {
+		event_warn("%s: strdup", __func__);
+		free(proxy);
+		return (NULL);
+	}
+	proxy->pool = pool;
+	proxy->port = port;
+	proxy->max_backlog = HTTP_PROXY_BACKLOG;
+
+	return (proxy);
+}
+
+void
+evhttp_proxy_free(struct evhttp_proxy *proxy)
+{
+	free(proxy->address);
+	free(proxy);
+}
+
+void
+evhttp_proxy_set_max_backlog(struct evhttp_proxy *proxy, size_t size)
+{
+	proxy->max_backlog = size;
+}
+
+/* Headers that only concern a single connection are not passed on */
+static const char *evhttp_hop_headers[] = {
+	"Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authenticate",
+	"Proxy-Authorization", "TE", "Trailer", "Transfer-Encoding",
+	"Upgrade", NULL
+};
+
+/* Connection names more headers that only concern this connection */
+static int
+evhttp_proxy_connection_header(struct evkeyvalq *headers, const char *key)
+{
+	struct evkeyval *header;
+	const char *p;
+	size_t len;
+
+	TAILQ_FOREACH(header, headers, next) {
+		if (strcasecmp(header->key, "Connection") != 0)
+			continue;
+		for (p = header->value; *p != '\0'; p += len) {
+			p += strspn(p, " \t,");
+			if ((len = strcspn(p, " \t,")) == 0)
+				break;
+			if (strlen(key) == len && strncasecmp(key, p, len) == 0)
+				return (1);
+		}
+	}
+
+	return (0);
+}
+
+static void
+evhttp_proxy_copy_headers(struct evkeyvalq *from, struct evkeyvalq *to)
+{
+	struct evkeyval *header;
+	const char **hop;
+
+	TAILQ_FOREACH(header, from, next) {
+		for (hop = evhttp_hop_headers; *hop != NULL; hop++) {
+			if (strcasecmp(header->key, *hop) == 0)
+				break;
+		}
+		if (*hop == NULL &&
+		    !evhttp_proxy_connection_header(from, header->key))
+			evhttp_add_header(to, header->key, header->value);
+	}
+}
+
+static void evhttp_proxy_upstream_done(struct evhttp_request *, void *);
+static void evhttp_proxy_upstream_chunk(struct evhttp_request *, void *);
+
+static struct evhttp_proxy_request *
+evhttp_proxy_start(struct evhttp_request *req, struct evhttp_proxy *proxy)
+{
+	struct evhttp_proxy_request *preq;
+	struct evhttp_request *upstream;
+	const char *forwarded;
+
+	if ((preq = calloc(1, sizeof(struct evhttp_proxy_request))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	upstream = evhttp_request_new(evhttp_proxy_upstream_done, preq);
+	if (upstream == NULL) {
+		free(preq);
+		return (NULL);
+	}
+	preq->proxy = proxy;
+	preq->req = req;
+	preq->upstream = upstream;
+
+	evhttp_proxy_copy_headers(req->input_headers, upstream->output_headers);
+	forwarded = evhttp_find_header(req->input_headers, "X-Forwarded-For");
+	if (forwarded != NULL && req->remote_host != NULL) {
+		size_t len = strlen(forwarded) + strlen(req->remote_host) + 3;
+		char *value = malloc(len);
+		if (value != NULL) {
+			snprintf(value, len, "%s, %s",
+			    forwarded, req->remote_host);
+			evhttp_remove_header(upstream->output_headers,
+			    "X-Forwarded-For");
+			evhttp_add_header(upstream->output_headers,
+			    "X-Forwarded-For", value);
+			free(value);
+		}
+	} else if (req->remote_host != NULL) {
+		evhttp_add_header(upstream->output_headers,
+		    "X-Forwarded-For", req->remote_host);
+	}
+
+	if (req->type == EVHTTP_REQ_POST) {
+		/* the body is added while it arrives */
+		upstream->flags |= EVHTTP_REQ_BODY_PENDING;
+		if (evhttp_find_header(req->input_headers,
+			"Content-Length") == NULL) {
+			evhttp_add_header(upstream->output_headers,
+			    "Transfer-Encoding", "chunked");
+			preq->chunked = 1;
+		}
+	}
+	/* the response is passed on as it arrives, whatever its framing */
+	evhttp_request_set_chunked_cb(upstream, evhttp_proxy_upstream_chunk);
+	upstream->flags |= EVHTTP_REQ_STREAM_BODY;
+
+	if (evhttp_pool_make_request(proxy->pool, proxy->address, proxy->port,
+		upstream, req->type, req->uri) == -1) {
+		if (upstream->evcon != NULL)
+			TAILQ_REMOVE(&upstream->evcon->requests, upstream,
+			    next);
+		evhttp_request_free(upstream);
+		free(preq);
+		return (NULL);
+	}
+
+	req->evcon->proxy = preq;
+	return (preq);
+}
+
+/* Appends body data to the upstream request */
+static void
+evhttp_proxy_add_body(struct evhttp_proxy_request *preq,
+    const void *data, size_t len)
+{
+	struct evhttp_request *upstream = preq->upstream;
+	struct evhttp_connection *evcon = upstream->evcon;
+
+	if (evcon != NULL && upstream->kind == EVHTTP_RESPONSE) {
+		/* the headers have been sent */
+		evhttp_connection_add(evcon, data, len);
+	} else {
+		evbuffer_add(upstream->output_buffer, data, len);
+	}
+}
+
+/* Passes on the part of the request body that arrived */
+static void
+evhttp_proxy_request_body(struct evhttp_request *req, void *arg)
+{
+	struct evhttp_proxy_request *preq = req->evcon->proxy;
+	struct evhttp_request *upstream;
+	struct evhttp_connection *evcon;
+	size_t len = EVBUFFER_LENGTH(req->input_buffer), backlog;
+
+	if (preq == NULL || (upstream = preq->upstream) == NULL)
+		return;
+
+	if (preq->chunked) {
+		char hdr[EVHTTP_CHUNK_HEADER_MAX];
+		evhttp_proxy_add_body(preq, hdr, evhttp_chunk_header(hdr, len));
+	}
+	evhttp_proxy_add_body(preq, EVBUFFER_DATA(req->input_buffer), len);
+	if (preq->chunked)
+		evhttp_proxy_add_body(preq, "\r\n", 2);
+
+	if ((evcon = upstream->evcon) != NULL &&
+	    upstream->kind == EVHTTP_RESPONSE) {
+		backlog = EVBUFFER_LENGTH(evcon->output_buffer) +
+		    evcon->segments_len;
+		evhttp_write_buffer(evcon, evhttp_write_connectioncb, NULL);
+	} else {
+		backlog = EVBUFFER_LENGTH(upstream->output_buffer);
+	}
+
+	if (backlog > preq->proxy->max_backlog)
+		evhttp_connection_pause(req->evcon);
+}
+
+/* The body that was sent upstream has been written */
+static void
+evhttp_proxy_upstream_drained(struct evhttp_request *upstream)
+{
+	struct evhttp_proxy_request *preq = upstream->cb_arg;
+
+	if (preq->req != NULL)
+		evhttp_connection_resume(preq->req->evcon);
+}
+
+static void
+evhttp_proxy_request_done(struct evhttp_request *req, void *arg)
+{
+	struct evhttp_proxy_request *preq = req->evcon->proxy;
+	struct evhttp_request *upstream;
+	struct evhttp_connection *evcon;
+
+	if (req->uri == NULL) {
+		/* the request was bad */
+		evhttp_send_error(req, HTTP_BADREQUEST, "Bad Request");
+		return;
+	}
+
+	if (preq == NULL && (preq = evhttp_proxy_start(req, arg)) == NULL) {
+		evhttp_send_error(req, HTTP_SERVUNAVAIL, "Service Unavailable");
+		return;
+	}
+	preq->body_done = 1;
+
+	upstream = preq->upstream;
+	if (!(upstream->flags & EVHTTP_REQ_BODY_PENDING))
+		return;
+	upstream->flags &= ~EVHTTP_REQ_BODY_PENDING;
+	if (preq->chunked)
+		evhttp_proxy_add_body(preq, "0\r\n\r\n", 5);
+
+	/* once everything has been written, the response is read */
+	if ((evcon = upstream->evcon) != NULL &&
+	    upstream->kind == EVHTTP_RESPONSE) {
+		if (EVBUFFER_LENGTH(evcon->output_buffer) == 0 &&
+		    TAILQ_EMPTY(&evcon->segments))
+			evhttp_write_connectioncb(evcon, NULL);
+		else
+			evhttp_write_buffer(evcon, evhttp_write_connectioncb,
+			    NULL);
+	}
+}
+
+/* The client took the backlog of the response */
+static void
+evhttp_proxy_client_drained(struct evhttp_connection *evcon, void *arg)
+{
+	struct evhttp_proxy_request *preq = arg;
+
+	if (preq->upstream != NULL && preq->upstream->evcon != NULL)
+		evhttp_connection_resume(preq->upstream->evcon);
+}
+
+static void
+evhttp_proxy_reply_start(struct evhttp_proxy_request *preq,
+    struct evhttp_request *upstream)
+{
+	struct evhttp_request *req = preq->req;
+	struct evhttp_connection *evcon = req->evcon;
+	int code = upstream->response_code;
+
+	preq->replying = 1;
+	evhttp_proxy_copy_headers(upstream->input_headers,
+	    req->output_headers);
+	/* it told how the request body was sent */
+	req->chunked = 0;
+
+	if (evhttp_find_header(upstream->input_headers,
+		"Content-Length") == NULL && req->type != EVHTTP_REQ_HEAD &&
+	    code != HTTP_NOCONTENT && code != HTTP_NOTMODIFIED) {
+		/* the length is not known; without chunks, close tells */
+		if (req->major != 1 || req->minor != 1)
+			evhttp_add_header(req->output_headers,
+			    "Connection", "close");
+		evhttp_send_reply_start(req, code,
+		    upstream->response_code_line);
+		return;
+	}
+
+	/* the body is passed on as it is */
+	evhttp_connection_start_detectclose(evcon);
+	evhttp_response_code(req, code, upstream->response_code_line);
+	evhttp_make_header(evcon, req);
+	evhttp_write_buffer(evcon, NULL, NULL);
+}
+
+static void
+evhttp_proxy_upstream_chunk(struct evhttp_request *upstream, void *arg)
+{
+	struct evhttp_proxy_request *preq = arg;
+	struct evhttp_connection *evcon;
+
+	/* without a client, the response is just read to its end */
+	if (preq->req == NULL)
+		return;
+
+	if (!preq->replying)
+		evhttp_proxy_reply_start(preq, upstream);
+
+	evcon = preq->req->evcon;
+	evhttp_send_reply_chunk(preq->req, upstream->input_buffer);
+	if (EVBUFFER_LENGTH(evcon->output_buffer) + evcon->segments_len >
+	    preq->proxy->max_backlog) {
+		evhttp_connection_pause(upstream->evcon);
+		evhttp_write_buffer(evcon, evhttp_proxy_client_drained, preq);
+	}
+}
+
+static void
+evhttp_proxy_upstream_done(struct evhttp_request *upstream, void *arg)
+{
+	struct evhttp_proxy_request *preq = arg;
+	struct evhttp_request *req = preq->req;
+	struct evhttp_connection *evcon;
+
+	preq->upstream = NULL;
+	if (req == NULL) {
+		free(preq);
+		return;
+	}
+	evcon = req->evcon;
+	evcon->proxy = NULL;
+
+	if (upstream == NULL || upstream->response_code == 0) {
+		/* a reply can only be sent if the client is listening */
+		if (!preq->replying && preq->body_done)
+			evhttp_send_error(req, HTTP_BADGATEWAY, "Bad Gateway");
+		else
+			evhttp_connection_free(evcon);
+		free(preq);
+		return;
+	}
+
+	if (!preq->replying)
+		evhttp_proxy_reply_start(preq, upstream);
+	free(preq);
+	evhttp_send_reply_end(req);
+}
+
+/* The client is gone; so is the request that passes it on */
+static void
+evhttp_proxy_abort(struct evhttp_connection *evcon)
+{
+	struct evhttp_proxy_request *preq = evcon->proxy;
+	struct evhttp_request *upstream = preq->upstream;
+	struct evhttp_connection *upcon;
+	struct evhttp_pool_host *host;
+
+	evcon->proxy = NULL;
+	preq->req = NULL;
+
+	if ((upcon = upstream->evcon) == NULL) {
+		/* it still waits for a connection of the pool */
+		host = evhttp_pool_find_host(preq->proxy->pool,
+		    preq->proxy->address, preq->proxy->port);
+		if (host != NULL)
+			TAILQ_REMOVE(&host->requests, upstream, next);
+		evhttp_request_free(upstream);
+		free(preq);
+	} else if (TAILQ_FIRST(&upcon->requests) == upstream) {
+		/* the upstream connection is in an unknown state */
+		evhttp_connection_fail(upcon, EVCON_HTTP_EOF);
+	} else {
+		TAILQ_REMOVE(&upcon->requests, upstream, next);
+		upstream->evcon = NULL;
+		evhttp_request_free(upstream);
+		free(preq);
+	}
+}
+
+void
+evhttp_response_code(struct evhttp_request *req, int code, const char *reason)
+{
+	req->kind = EVHTTP_RESPONSE;
+	req->response_code = code;
+	if (req->response_code_line != NULL)
+		free(req->response_code_line);
+	req->response_code_line = strdup(reason);
+}
+
+void
+evhttp_send_page(struct evhttp_request *req, struct evbuffer *databuf)
+{
+	if (!req->major || !req->minor) {
+		req->major = 1;
+		req->minor = 1;
+	}
+	
+	if (req->kind != EVHTTP_RESPONSE)
+		evhttp_response_code(req, 200, "OK");
+
+	evhttp_clear_headers(req->output_headers);
+	evhttp_add_header(req->output_headers, "Content-Type", "text/html");
+	evhttp_add_header(req->output_headers, "Connection", "close");
+
+	evhttp_send(req, databuf);
+}
+
+static const char uri_chars[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
+	0, 1, 0, 0, 1, 0, 0, 1,   1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1,   1, 1, 1, 0, 0, 1, 0, 0,
+	/* 64 */
+	1, 1, 1, 1, 1, 1, 1, 1,   1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1,   1, 1, 1, 0, 0, 0, 0, 1,
+	0, 1, 1, 1, 1, 1, 1, 1,   1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1,   1, 1, 1, 0, 0, 0, 1, 0,
+	/* 128 */
+	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
+	/* 192 */
+	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static const char uri_hex[] = "0123456789ABCDEF";
+
+/* value of a hex digit, or -1 */
+static const signed char uri_hex_values[256] = {
+	-1, -1, -1, -1, -1, -1, -1, -1,   -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1,   -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1,   -1, -1, -1, -1, -1, -1, -1, -1,
+	 0,  1,  2,  3,  4,  5,  6,  7,    8,  9, -1, -1, -1, -1, -1, -1,
+	/* 64 */
+	-1, 10, 11, 12, 13, 14, 15, -1,   -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1,   -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, 10, 11, 12, 13, 14, 15, -1,   -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1,   -1, -1, -1, -1, -1, -1, -1, -1,
+	/* 128 */
+	-1, -1, -1, -1, -1, -1, -1, -1,   -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1,   -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1,   -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1,   -1, -1, -1, -1, -1, -1, -1, -1,
+	/* 192 */
+	-1, -1, -1, -1, -1, -1, -1, -1,   -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1,   -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1,   -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1,   -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+/* Length of uri[0..len) once it has been URI-encoded */
+static size_t
+evhttp_encode_uri_len(const u_char *uri, size_t len)
+{
+	const u_char *end = uri + len;
+	size_t need = len;
+
+	for (; uri < end; uri++)
+		need += uri_chars[*uri] ? 0 : 2;
+
+	return (need);
+}
+
+/* Encodes uri[0..len) into out, which must hold evhttp_encode_uri_len() */
+static void
+evhttp_encode_uri_into(char *out, const u_char *uri, size_t len)
+{
+	const u_char *end = uri + len;
+
+	for (; uri < end; uri++) {
+		if (uri_chars[*uri]) {
+			*out++ = *uri;
+		} else {
+			out[0] = '%';
+			out[1] = uri_hex[*uri >> 4];
+			out[2] = uri_hex[*uri & 0x0f];
+			out += 3;
+		}
+	}
+}
+
+/*
+ * Helper functions to encode/decode a URI.
+ * The returned string must be freed by the caller.
+ */
+char *
+evhttp_encode_uri(const char *uri)
+{
+	size_t len = strlen(uri);
+	size_t need = evhttp_encode_uri_len((const u_char *)uri, len);
+	char *ret;
+
+	if ((ret = malloc(need + 1)) == NULL)
+		event_err(1, "%s: malloc(%lu)", __func__,
+			  (unsigned long)(need + 1));
+
+	evhttp_encode_uri_into(ret, (const u_char *)uri, len);
+	ret[need] = '\0';
+
+	return (ret);
+}
+
+/* Appends the encoding directly to the free space of the buffer */
+int
+evhttp_encode_uri_buffer(struct evbuffer *buf, const char *uri, size_t len)
+{
+	size_t need = evhttp_encode_uri_len((const u_char *)uri, len);
+	size_t oldoff = buf->off;
+
+	if (evbuffer_expand(buf, need) == -1)
+		return (-1);
+
+	evhttp_encode_uri_into((char *)buf->buffer + buf->off,
+	    (const u_char *)uri, len);
+	buf->off += need;
+
+	if (need && buf->cb != NULL)
+		(*buf->cb)(buf, oldoff, buf->off, buf->cbarg);
+
+	return (0);
+}
+
+/*
+ * The output is never longer than the input, so out may be uri itself.
+ * '+' becomes a space after a '?' or everywhere if decode_plus is set.
+ */
+size_t
+evhttp_decode_uri_buffer(char *out, const char *uri, size_t len,
+    int decode_plus)
+{
+	const u_char *p = (const u_char *)uri, *end = p + len;
+	char *q = out;
+	int hi, lo;
+
+	for (; p < end; p++) {
+		u_char c = *p;
+		if (c == '%' && end - p > 2 &&
+		    (hi = uri_hex_values[p[1]]) >= 0 &&
+		    (lo = uri_hex_values[p[2]]) >= 0) {
+			c = (u_char)((hi << 4) | lo);
+			p += 2;
+		} else if (c == '?') {
+			decode_plus = 1;
+		} else if (c == '+' && decode_plus) {
+			c = ' ';
+		}
+		*q++ = c;
+	}
+	*q = '\0';
+
+	return (q - out);
+}
+
+char *
+evhttp_decode_uri(const char *uri)
+{
+	size_t len = strlen(uri);
+	char *ret;
+
+	if ((ret = malloc(len + 1)) == NULL)
+		event_err(1, "%s: malloc(%lu)", __func__,
+			  (unsigned long)(len + 1));
+
+	evhttp_decode_uri_buffer(ret, uri, len, 0);
+
+	return (ret);
+}
+
+/*
+ * Iterates over the arguments in the query of a URI.  Keys and values point
+ * into the URI and are not decoded.
+ */
+
+void
+evhttp_query_iter_init(struct evhttp_query_iter *iter, const char *uri)
+{
+	const char *query = strchr(uri, '?');
+
+	if (query == NULL) {
+		iter->next = iter->end = uri;
+		return;
+	}
+
+	iter->next = query + 1;
+	iter->end = iter->next + strlen(iter->next);
+}
+
+int
+evhttp_query_next(struct evhttp_query_iter *iter,
+    const char **key, size_t *keylen, const char **value, size_t *valuelen)
+{
+	const char *argument = iter->next, *amp, *eq;
+	size_t len;
+
+	if (argument >= iter->end)
+		return (0);
+
+	if ((amp = memchr(argument, '&', iter->end - argument)) == NULL) {
+		len = iter->end - argument;
+		iter->next = iter->end;
+	} else {
+		len = amp - argument;
+		iter->next = amp + 1;
+	}
+
+	*key = argument;
+	if ((eq = memchr(argument, '=', len)) == NULL) {
+		*keylen = len;
+		*value = NULL;
+		*valuelen = 0;
+	} else {
+		*keylen = eq - argument;
+		*value = eq + 1;
+		*valuelen = len - *keylen - 1;
+	}
+
+	return (1);
+}
+
+/* 
+ * Helper function to parse out arguments in a query.
+ * The arguments are separated by key and value.
+ * URI should already be decoded.
+ */
+
+void
+evhttp_parse_query(const char *uri, struct evkeyvalq *headers)
+{
+	struct evhttp_query_iter iter;
+	const char *key, *value;
+	size_t keylen, valuelen;
+	char *line;
+
+	TAILQ_INIT(headers);
+
+	evhttp_query_iter_init(&iter, uri);
+	if (iter.next == iter.end)
+		return;
+
+	/* a single copy of the query holds each key and its decoded value */
+	if ((line = malloc(iter.end - iter.next + 2)) == NULL)
+		event_err(1, "%s: malloc", __func__);
+
+	while (evhttp_query_next(&iter, &key, &keylen, &value, &valuelen)) {
+		char *decoded;
+
+		if (value == NULL)
+			break;
+
+		memcpy(line, key, keylen);
+		line[keylen] = '\0';
+		decoded = line + keylen + 1;
+		evhttp_decode_uri_buffer(decoded, value, valuelen, 0);
+
+		event_debug(("Query Param: %s -> %s\n", line, decoded));
+		evhttp_add_header(headers, line, decoded);
+	}
+
+	free(line);
+}
+
+/*
+ * URI routing.  Segments point into the URI itself, so that dispatching a
+ * request needs neither copies nor allocations.
+ */
+
+static int
+evhttp_route_cmp(const char *segment, size_t seglen,
+    const struct evhttp_route *route)
+{
+	size_t len = seglen < route->seglen ? seglen : route->seglen;
+	int res = memcmp(segment, route->segment, len);
+
+	if (res != 0)
+		return (res);
+	if (seglen != route->seglen)
+		return (seglen < route->seglen ? -1 : 1);
+	return (0);
+}
+
+/* Returns the index of the child or where it would have to be inserted */
+static int
+evhttp_route_find(struct evhttp_route *node,
+    const char *segment, size_t seglen, int *found)
+{
+	int lo = 0, hi = node->nchildren;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		int res = evhttp_route_cmp(segment, seglen,
+		    node->children[mid]);
+		if (res == 0) {
+			*found = 1;
+			return (mid);
+		}
+		if (res < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	*found = 0;
+	return (lo);
+}
+
+static struct evhttp_route *
+evhttp_route_child(struct evhttp_route *node,
+    const char *segment, size_t seglen)
+{
+	struct evhttp_route *child, **children;
+	int found, off = evhttp_route_find(node, segment, seglen, &found);
+
+	if (found)
+		return (node->children[off]);
+
+	if ((child = calloc(1, sizeof(struct evhttp_route))) == NULL)
+		return (NULL);
+	if ((child->segment = malloc(seglen + 1)) == NULL) {
+		free(child);
+		return (NULL);
+	}
+	memcpy(child->segment, segment, seglen);
+	child->segment[seglen] = '\0';
+	child->seglen = seglen;
+
+	children = realloc(node->children,
+	    (node->nchildren + 1) * sizeof(struct evhttp_route *));
+	if (children == NULL) {
+		free(child->segment);
+		free(child);
+		return (NULL);
+	}
+	memmove(&children[off + 1], &children[off],
+	    (node->nchildren - off) * sizeof(struct evhttp_route *));
+	children[off] = child;
+	node->children = children;
+	node->nchildren++;
+
+	return (child);
+}
+
+/*
+ * Walks the trie along the segments of a pattern, creating nodes if
+ * create is set.  Returns the list the pattern's callbacks are kept on.
+ */
+
+static struct evhttp_cb **
+evhttp_route_lookup(struct evhttp_route *node, const char *what, int create)
+{
+	const char *segment = what;
+
+	for (;;) {
+		const char *slash = strchr(segment, '/');
+		size_t seglen = slash != NULL ?
+		    (size_t)(slash - segment) : strlen(segment);
+		struct evhttp_route *next;
+
+		if (seglen == 1 && *segment == '*') {
+			if (slash == NULL)
+				return (&node->rest);
+			if (node->wildcard == NULL && create)
+				node->wildcard =
+				    calloc(1, sizeof(struct evhttp_route));
+			next = node->wildcard;
+		} else if (create) {
+			next = evhttp_route_child(node, segment, seglen);
+		} else {
+			int found, off = evhttp_route_find(node,
+			    segment, seglen, &found);
+			next = found ? node->children[off] : NULL;
+		}
+
+		if (next == NULL)
+			return (NULL);
+		node = next;
+
+		if (slash == NULL)
+			return (&node->exact);
+		segment = slash + 1;
+	}
+}
+
+static void
+evhttp_route_free(struct evhttp_route *node)
+{
+	int i;
+
+	for (i = 0; i < node->nchildren; i++) {
+		evhttp_route_free(node->children[i]);
+		free(node->children[i]);
+	}
+	if (node->children != NULL)
+		free(node->children);
+	if (node->wildcard != NULL) {
+		evhttp_route_free(node->wildcard);
+		free(node->wildcard);
+	}
+	if (node->segment != NULL)
+		free(node->segment);
+}
+
+/* Removes the nodes along a pattern that no longer lead to a callback */
+static void
+evhttp_route_prune(struct evhttp_route *node, const char *what)
+{
+	const char *slash = strchr(what, '/');
+	size_t seglen = slash != NULL ?
+	    (size_t)(slash - what) : strlen(what);
+	struct evhttp_route *child;
+	int found, off = 0;
+
+	if (seglen == 1 && *what == '*') {
+		if (slash == NULL)
+			return;
+		child = node->wildcard;
+	} else {
+		off = evhttp_route_find(node, what, seglen, &found);
+		child = found ? node->children[off] : NULL;
+	}
+	if (child == NULL)
+		return;
+
+	if (slash != NULL)
+		evhttp_route_prune(child, slash + 1);
+	if (child->exact != NULL || child->rest != NULL ||
+	    child->nchildren != 0 || child->wildcard != NULL)
+		return;
+
+	if (child == node->wildcard) {
+		node->wildcard = NULL;
+	} else {
+		memmove(&node->children[off], &node->children[off + 1],
+		    (node->nchildren - off - 1) *
+		    sizeof(struct evhttp_route *));
+		if (--node->nchildren == 0) {
+			free(node->children);
+			node->children = NULL;
+		}
+	}
+	evhttp_route_free(child);
+	free(child);
+}
+
+static struct evhttp_cb *
+evhttp_route_cb(struct evhttp_cb *cb, enum evhttp_cmd_type type)
+{
+	for (; cb != NULL; cb = cb->route_next) {
+		if (cb->methods & (1 << type))
+			return (cb);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Matches the path from segment to end against the trie; segment is NULL
+ * once all segments have been consumed.  Exact segments are tried before
+ * a "*" segment, which is tried before a trailing "*".
+ */
+
+static struct evhttp_cb *
+evhttp_route_match(struct evhttp_route *node,
+    const char *segment, const char *end, enum evhttp_cmd_type type)
+{
+	struct evhttp_cb *cb;
+	const char *slash, *next;
+	size_t seglen;
+	int found, off;
+
+	if (segment == NULL)
+		return (evhttp_route_cb(node->exact, type));
+
+	slash = memchr(segment, '/', end - segment);
+	seglen = (slash != NULL ? slash : end) - segment;
+	next = slash != NULL ? slash + 1 : NULL;
+
+	off = evhttp_route_find(node, segment, seglen, &found);
+	if (found && (cb = evhttp_route_match(node->children[off],
+		    next, end, type)) != NULL)
+		return (cb);
+
+	if (node->wildcard != NULL &&
+	    (cb = evhttp_route_match(node->wildcard, next, end, type)) != NULL)
+		return (cb);
+
+	return (evhttp_route_cb(node->rest, type));
+}
+
+static struct evhttp_cb *
+evhttp_dispatch_callback(struct evhttp *http, struct evhttp_request *req)
+{
+	/* Test for different URLs */
+	const char *end = strchr(req->uri, '?');
+	if (end == NULL)
+		end = req->uri + strlen(req->uri);
+
+	return (evhttp_route_match(&http->routes, req->uri, end, req->type));
+}
+
+/*
+ * Response cache.  Entries are found through a hash table of their keys,
+ * which are made of the method, the URI and the values of the key headers
+ * of a request, Host among them.  Their body is written straight from the entry unless the
+ * response needs to be compressed.
+ */
+
+static u_int
+evhttp_cache_hash(const char *key, size_t len)
+{
+	u_int hash = 2166136261U;
+
+	while (len--)
+		hash = (hash ^ (u_char)*key++) * 16777619U;
+
+	return (hash);
+}
+
+/* Builds the key of a request; returns -1 if it does not fit */
+static int
+evhttp_cache_key(struct evhttp_cache *cache, struct evhttp_request *req,
+    char *key, size_t *keylen)
+{
+	const char *method = evhttp_method(req->type);
+	size_t len;
+	int i;
+
+	len = snprintf(key, EVHTTP_CACHE_KEY_MAX, "%s %s", method, req->uri);
+	if (len >= EVHTTP_CACHE_KEY_MAX)
+		return (-1);
+
+	for (i = 0; i < cache->nkey_headers; i++) {
+		const char *value = evhttp_find_header(req->input_headers,
+		    cache->key_headers[i]);
+		size_t n = snprintf(key + len, EVHTTP_CACHE_KEY_MAX - len,
+		    "\n%s", value != NULL ? value : "");
+		if (n >= EVHTTP_CACHE_KEY_MAX - len)
+			return (-1);
+		len += n;
+	}
+
+	*keylen = len;
+	return (0);
+}
+
+static void
+evhttp_cache_entry_release(void *arg)
+{
+	struct evhttp_cache_entry *entry = arg;
+
+	if (--entry->refcnt == 0)
+		free(entry);
+}
+
+static void
+evhttp_cache_remove(struct evhttp_cache *cache,
+    struct evhttp_cache_entry *entry)
+{
+	struct evhttp_cache_entry **pentry;
+
+	pentry = &cache->buckets[entry->hash & (cache->nbuckets - 1)];
+	while (*pentry != entry)
+		pentry = &(*pentry)->hash_next;
+	*pentry = entry->hash_next;
+
+	TAILQ_REMOVE(&cache->entries, entry, next);
+	cache->size -= entry->size;
+	cache->nentries--;
+
+	/* a connection might still be writing the body */
+	evhttp_cache_entry_release(entry);
+}
+
+static struct evhttp_cache_entry *
+evhttp_cache_find(struct evhttp_cache *cache, const char *key, size_t keylen,
+    u_int hash)
+{
+	struct evhttp_cache_entry *entry;
+
+	entry = cache->buckets[hash & (cache->nbuckets - 1)];
+	for (; entry != NULL; entry = entry->hash_next) {
+		if (entry->hash == hash && entry->keylen == keylen &&
+		    memcmp(entry->key, key, keylen) == 0)
+			return (entry);
+	}
+
+	return (NULL);
+}
+
+/* Doubles the hash table once it holds more entries than buckets */
+static void
+evhttp_cache_grow(struct evhttp_cache *cache)
+{
+	struct evhttp_cache_entry **buckets, *entry;
+	u_int nbuckets = cache->nbuckets * 2;
+
+	if ((buckets = calloc(nbuckets, sizeof(*buckets))) == NULL)
+		return;
+
+	TAILQ_FOREACH(entry, &cache->entries, next) {
+		u_int i = entry->hash & (nbuckets - 1);
+		entry->hash_next = buckets[i];
+		buckets[i] = entry;
+	}
+
+	free(cache->buckets);
+	cache->buckets = buckets;
+	cache->nbuckets = nbuckets;
+}
+
+/*
+ * Returns how long a response may be cached according to its
+ * Cache-Control header, or -1 if it must not be.
+ */
+static int
+evhttp_cache_max_age(const char *value)
+{
+	int max_age = -1, s_maxage = -1;
+
+	if (value == NULL)
+		return (-1);
+
+	while (*value != '\0') {
+		size_t len;
+
+		value += strspn(value, " \t,");
+		len = strcspn(value, ",");
+		if (strncasecmp(value, "no-store", 8) == 0 ||
+		    strncasecmp(value, "no-cache", 8) == 0 ||
+		    strncasecmp(value, "private", 7) == 0)
+			return (-1);
+		if (strncasecmp(value, "max-age=", 8) == 0)
+			max_age = atoi(value + 8);
+		else if (strncasecmp(value, "s-maxage=", 9) == 0)
+			s_maxage = atoi(value + 9);
+		value += len;
+	}
+
+	/* the shared cache directive wins */
+	if (s_maxage != -1)
+		max_age = s_maxage;
+
+	return (max_age > 0 ? max_age : -1);
+}
+
+/* Request headers that bypass the cache */
+static int
+evhttp_cache_bypass(struct evhttp_request *req, int *store)
+{
+	const char *value;
+
+	*store = 1;
+	if (evhttp_find_header(req->input_headers, "Authorization") != NULL) {
+		*store = 0;
+		return (1);
+	}
+
+	if ((value = evhttp_find_header(req->input_headers,
+		 "Cache-Control")) != NULL) {
+		if (strstr(value, "no-store") != NULL) {
+			*store = 0;
+			return (1);
+		}
+		if (strstr(value, "no-cache") != NULL)
+			return (1);
+	}
+
+	if ((value = evhttp_find_header(req->input_headers,
+		 "Pragma")) != NULL && strstr(value, "no-cache") != NULL)
+		return (1);
+
+	return (0);
+}
+
+static void
+evhttp_cache_serve(struct evhttp *http, struct evhttp_request *req,
+    struct evhttp_cache_entry *entry, time_t now)
+{
+	struct evhttp_connection *evcon = req->evcon;
+	char age[24];
+	int i;
+
+	for (i = 0; i < entry->nheaders; i++)
+		evhttp_add_header(req->output_headers,
+		    entry->headers[i].key, entry->headers[i].value);
+	snprintf(age, sizeof(age), "%ld", (long)(now - entry->stored));
+	evhttp_add_header(req->output_headers, "Age", age);
+
+#ifdef EVHTTP_ZLIB
+	if (http->compress_level != 0 && entry->body_len != 0) {
+		/* the body might be compressed differently for this client */
+		evbuffer_add(req->output_buffer, entry->body,
+		    entry->body_len);
+		evhttp_send_reply(req, entry->code, entry->reason, NULL);
+		return;
+	}
+#endif
+
+	/* the headers are made in the output buffer, which goes first */
+	if (entry->body_len != 0) {
+		if (evhttp_connection_add_segment(evcon, entry->body,
+			entry->body_len, evhttp_cache_entry_release,
+			entry) == 0)
+			entry->refcnt++;
+		else
+			evbuffer_add(req->output_buffer, entry->body,
+			    entry->body_len);
+	}
+	evhttp_send_reply(req, entry->code, entry->reason, NULL);
+}
+
+/*
+ * Answers a request from the cache; returns -1 if the request needs to be
+ * passed on to the callbacks.
+ */
+static int
+evhttp_cache_lookup(struct evhttp *http, struct evhttp_request *req)
+{
+	struct evhttp_cache *cache = http->cache;
+	struct evhttp_cache_entry *entry;
+	char key[EVHTTP_CACHE_KEY_MAX];
+	size_t keylen;
+	time_t now;
+	int store;
+
+	if ((req->type != EVHTTP_REQ_GET && req->type != EVHTTP_REQ_HEAD) ||
+	    evhttp_cache_key(cache, req, key, &keylen) == -1)
+		return (-1);
+
+	if (evhttp_cache_bypass(req, &store)) {
+		if (store)
+			req->flags |= EVHTTP_REQ_CACHEABLE;
+		cache->misses++;
+		return (-1);
+	}
+
+	entry = evhttp_cache_find(cache, key, keylen,
+	    evhttp_cache_hash(key, keylen));
+	now = time(NULL);
+	if (entry != NULL && now >= entry->expires) {
+		evhttp_cache_remove(cache, entry);
+		entry = NULL;
+	}
+	if (entry == NULL) {
+		req->flags |= EVHTTP_REQ_CACHEABLE;
+		cache->misses++;
+		return (-1);
+	}
+
+	cache->hits++;
+	TAILQ_REMOVE(&cache->entries, entry, next);
+	TAILQ_INSERT_HEAD(&cache->entries, entry, next);
+
+	evhttp_cache_serve(http, req, entry, now);
+	return (0);
+}
+
+static int
+evhttp_cache_code(int code)
+{
+	switch (code) {
+	case HTTP_OK:
+	case 203:
+	case 300:
+	case HTTP_MOVEPERM:
+	case HTTP_NOTFOUND:
+	case 410:
+		return (1);
+	default:
+		return (0);
+	}
+}
+
+/* A reply that varies with a header outside the key cannot be shared */
+static int
+evhttp_cache_varies(struct evhttp_cache *cache, const char *vary)
+{
+	const char *p;
+	size_t len;
+	int i;
+
+	if (vary == NULL)
+		return (0);
+
+	for (p = vary; *p != '\0'; p += len) {
+		p += strspn(p, " \t,");
+		if ((len = strcspn(p, " \t,")) == 0)
+			break;
+		for (i = 0; i < cache->nkey_headers; i++) {
+			if (strlen(cache->key_headers[i]) == len &&
+			    strncasecmp(cache->key_headers[i], p, len) == 0)
+				break;
+		}
+		if (i == cache->nkey_headers)
+			return (1);
+	}
+
+	return (0);
+}
+
+/* Hop-by-hop headers and those that are made for each reply */
+static int
+evhttp_cache_header(const char *key)
+{
+	return (strcasecmp(key, "Connection") != 0 &&
+	    strcasecmp(key, "Proxy-Connection") != 0 &&
+	    strcasecmp(key, "Keep-Alive") != 0 &&
+	    strcasecmp(key, "Transfer-Encoding") != 0 &&
+	    strcasecmp(key, "Date") != 0 &&
+	    strcasecmp(key, "Age") != 0);
+}
+
+/* Stores a reply that is about to be sent as a whole */
+static void
+evhttp_cache_store(struct evhttp *http, struct evhttp_request *req)
+{
+	struct evhttp_cache *cache = http->cache;
+	struct evhttp_cache_entry *entry, *old;
+	struct evkeyval *header;
+	char key[EVHTTP_CACHE_KEY_MAX], length[24];
+	const char *reason = req->response_code_line;
+	size_t keylen, size, body_len = EVBUFFER_LENGTH(req->output_buffer);
+	int max_age, nheaders = 0, need_length, need_type;
+	u_int hash;
+	char *p;
+
+	req->flags &= ~EVHTTP_REQ_CACHEABLE;
+	if (cache == NULL || !evhttp_cache_code(req->response_code) ||
+	    evhttp_find_header(req->output_headers, "Set-Cookie") != NULL ||
+	    evhttp_cache_varies(cache,
+		evhttp_find_header(req->output_headers, "Vary")) ||
+	    (max_age = evhttp_cache_max_age(evhttp_find_header(
+		req->output_headers, "Cache-Control"))) == -1 ||
+	    evhttp_cache_key(cache, req, key, &keylen) == -1)
+		return;
+	if (reason == NULL)
+		reason = "";
+
+	/* the entry gets the headers that evhttp_make_header would add */
+	need_length = evhttp_find_header(req->output_headers,
+	    "Content-Length") == NULL;
+	need_type = body_len != 0 && evhttp_find_header(req->output_headers,
+	    "Content-Type") == NULL;
+	snprintf(length, sizeof(length), "%ld", (long)body_len);
+
+	size = sizeof(struct evhttp_cache_entry) + keylen + 1 +
+	    strlen(reason) + 1 + body_len;
+	TAILQ_FOREACH(header, req->output_headers, next) {
+		if (!evhttp_cache_header(header->key))
+			continue;
+		size += strlen(header->key) + strlen(header->value) + 2;
+		nheaders++;
+	}
+	nheaders += need_length + need_type;
+	size += nheaders * sizeof(*entry->headers);
+	if (need_length)
+		size += sizeof("Content-Length") + strlen(length) + 1;
+	if (need_type)
+		size += sizeof("Content-Type") +
+		    sizeof("text/html; charset=ISO-8859-1");
+
+	if (size > cache->max_size || (entry = malloc(size)) == NULL)
+		return;
+
+	/* the header pointers come first to keep them aligned */
+	entry->headers = (void *)(entry + 1);
+	p = (char *)(entry->headers + nheaders);
+	entry->nheaders = 0;
+
+#define EVHTTP_CACHE_COPY(dst, src) do {				\
+	size_t n = strlen(src) + 1;					\
+	memcpy(p, src, n);						\
+	(dst) = p;							\
+	p += n;								\
+} while (0)
+
+	TAILQ_FOREACH(header, req->output_headers, next) {
+		if (!evhttp_cache_header(header->key))
+			continue;
+		EVHTTP_CACHE_COPY(entry->headers[entry->nheaders].key,
+		    header->key);
+		EVHTTP_CACHE_COPY(entry->headers[entry->nheaders].value,
+		    header->value);
+		entry->nheaders++;
+	}
+	if (need_length) {
+		EVHTTP_CACHE_COPY(entry->headers[entry->nheaders].key,
+		    "Content-Length");
+		EVHTTP_CACHE_COPY(entry->headers[entry->nheaders].value,
+		    length);
+		entry->nheaders++;
+	}
+	if (need_type) {
+		EVHTTP_CACHE_COPY(entry->headers[entry->nheaders].key,
+		    "Content-Type");
+		EVHTTP_CACHE_COPY(entry->headers[entry->nheaders].value,
+		    "text/html; charset=ISO-8859-1");
+		entry->nheaders++;
+	}
+	EVHTTP_CACHE_COPY(entry->reason, reason);
+#undef EVHTTP_CACHE_COPY
+
+	memcpy(p, key, keylen);
+	p[keylen] = '\0';
+	entry->key = p;
+	entry->keylen = keylen;
+	p += keylen + 1;
+
+	memcpy(p, EVBUFFER_DATA(req->output_buffer), body_len);
+	entry->body = (u_char *)p;
+	entry->body_len = body_len;
+
+	hash = evhttp_cache_hash(key, keylen);
+	entry->hash = hash;
+	entry->refcnt = 1;
+	entry->size = size;
+	entry->code = req->response_code;
+	entry->stored = time(NULL);
+	entry->expires = entry->stored + max_age;
+
+	if ((old = evhttp_cache_find(cache, key, keylen, hash)) != NULL)
+		evhttp_cache_remove(cache, old);
+
+	/* make room by dropping the least recently used responses */
+	while (cache->size + size > cache->max_size) {
+		evhttp_cache_remove(cache,
+		    TAILQ_LAST(&cache->entries, evhttp_cacheq));
+		cache->evictions++;
+	}
 
-	if (need_close) {
-		evhttp_connection_free(evcon);
-		return;
-	} 
+	if (cache->nentries >= cache->nbuckets)
+		evhttp_cache_grow(cache);
 
-	/* we have a persistent connection; try to accept another request. */
-	if (evhttp_associate_new_request_with_connection(evcon) == -1)
-		evhttp_connection_free(evcon);
+	entry->hash_next = cache->buckets[hash & (cache->nbuckets - 1)];
+	cache->buckets[hash & (cache->nbuckets - 1)] = entry;
+	TAILQ_INSERT_HEAD(&cache->entries, entry, next);
+	cache->size += size;
+	cache->nentries++;
 }
 
-/*
- * Returns an error page.
- */
-
 void
-evhttp_send_error(struct evhttp_request *req, int error, const char *reason)
+evhttp_cache_flush(struct evhttp *http)
 {
-#define ERR_FORMAT "<HTML><HEAD>\n" \
-	    "<TITLE>%d %s</TITLE>\n" \
-	    "</HEAD><BODY>\n" \
-	    "<H1>Method Not Implemented</H1>\n" \
-	    "Invalid method in request<P>\n" \
-	    "</BODY></HTML>\n"
+	struct evhttp_cache *cache = http->cache;
+	struct evhttp_cache_entry *entry;
 
-	struct evbuffer *buf = evbuffer_new();
+	if (cache == NULL)
+		return;
 
-	/* close the connection on error */
-	evhttp_add_header(req->output_headers, "Connection", "close");
+	while ((entry = TAILQ_FIRST(&cache->entries)) != NULL)
+		evhttp_cache_remove(cache, entry);
+}
 
-	evhttp_response_code(req, error, reason);
+int
+evhttp_set_cache(struct evhttp *http, size_t max_size)
+{
+	struct evhttp_cache *cache = http->cache;
+	int i;
 
-	evbuffer_add_printf(buf, ERR_FORMAT, error, reason);
+	if (max_size == 0) {
+		if (cache == NULL)
+			return (0);
+		evhttp_cache_flush(http);
+		for (i = 0; i < cache->nkey_headers; i++)
+			free(cache->key_headers[i]);
+		free(cache->buckets);
+		free(cache);
+		http->cache = NULL;
+		return (0);
+	}
 
-	evhttp_send_page(req, buf);
+	if (cache == NULL) {
+		if ((cache = calloc(1, sizeof(struct evhttp_cache))) == NULL) {
+			event_warn("%s: calloc", __func__);
+			return (-1);
+		}
+		cache->nbuckets = EVHTTP_CACHE_MIN_BUCKETS;
+		if ((cache->buckets = calloc(cache->nbuckets,
+			 sizeof(*cache->buckets))) == NULL) {
+			event_warn("%s: calloc", __func__);
+			free(cache);
+			return (-1);
+		}
+		/* name based virtual hosts do not share responses */
+		if ((cache->key_headers[0] = strdup("Host")) == NULL) {
+			event_warn("%s: strdup", __func__);
+			free(cache->buckets);
+			free(cache);
+			return (-1);
+		}
+		cache->nkey_headers = 1;
+		TAILQ_INIT(&cache->entries);
+		http->cache = cache;
+	}
 
-	evbuffer_free(buf);
-#undef ERR_FORMAT
-}
+	cache->max_size = max_size;
+	while (cache->size > max_size) {
+		evhttp_cache_remove(cache,
+		    TAILQ_LAST(&cache->entries, evhttp_cacheq));
+		cache->evictions++;
+	}
 
-/* Requires that headers and response code are already set up */
+	return (0);
+}
 
-static inline void
-evhttp_send(struct evhttp_request *req, struct evbuffer *databuf)
+int
+evhttp_cache_add_key_header(struct evhttp *http, const char *header)
 {
-	struct evhttp_connection *evcon = req->evcon;
+	struct evhttp_cache *cache = http->cache;
 
-	assert(TAILQ_FIRST(&evcon->requests) == req);
+	if (cache == NULL || cache->nkey_headers == EVHTTP_CACHE_KEY_HEADERS)
+		return (-1);
 
-	/* xxx: not sure if we really should expose the data buffer this way */
-	if (databuf != NULL)
-		evbuffer_add_buffer(req->output_buffer, databuf);
-	
-	/* Adds headers to the response */
-	evhttp_make_header(evcon, req);
+	if ((cache->key_headers[cache->nkey_headers] =
+		strdup(header)) == NULL) {
+		event_warn("%s: strdup", __func__);
+		return (-1);
+	}
+	cache->nkey_headers++;
 
-	evhttp_write_buffer(evcon, evhttp_send_done, NULL);
-}
+	/* responses stored under the old keys can no longer be found */
+	evhttp_cache_flush(http);
 
-void
-evhttp_send_reply(struct evhttp_request *req, int code, const char *reason,
-    struct evbuffer *databuf)
-{
-	/* set up to watch for client close */
-	evhttp_connection_start_detectclose(req->evcon);
-	evhttp_response_code(req, code, reason);
-	
-	evhttp_send(req, databuf);
+	return (0);
 }
 
 void
-evhttp_send_reply_start(struct evhttp_request *req, int code,
-    const char *reason)
+evhttp_cache_get_stats(struct evhttp *http, struct evhttp_cache_stats *stats)
 {
-	/* set up to watch for client close */
-	evhttp_connection_start_detectclose(req->evcon);
-	evhttp_response_code(req, code, reason);
-	if (req->major == 1 && req->minor == 1) {
-		/* use chunked encoding for HTTP/1.1 */
-		evhttp_add_header(req->output_headers, "Transfer-Encoding",
-		    "chunked");
-		req->chunked = 1;
+	if (http->cache == NULL) {
+		memset(stats, 0, sizeof(*stats));
+		return;
 	}
-	evhttp_make_header(req->evcon, req);
-	evhttp_write_buffer(req->evcon, NULL, NULL);
-}
 
-void
-evhttp_send_reply_chunk(struct evhttp_request *req, struct evbuffer *databuf)
-{
-	if (req->chunked) {
-		evbuffer_add_printf(req->evcon->output_buffer, "%x\r\n",
-				    (unsigned)EVBUFFER_LENGTH(databuf));
-	}
-	evbuffer_add_buffer(req->evcon->output_buffer, databuf);
-	if (req->chunked) {
-		evbuffer_add(req->evcon->output_buffer, "\r\n", 2);
-	}
-	evhttp_write_buffer(req->evcon, NULL, NULL);
+	stats->hits = http->cache->hits;
+	stats->misses = http->cache->misses;
+	stats->evictions = http->cache->evictions;
+	stats->size = http->cache->size;
+	stats->entries = http->cache->nentries;
 }
 
-void
-evhttp_send_reply_end(struct evhttp_request *req)
+/*
+ * Server statistics.  The timestamps of a request are mostly taken from
+ * the last I/O time of its connection, which is known anyway, so that
+ * keeping them costs no more than a few additions per request.
+ */
+
+static void
+evhttp_histogram_add(struct evhttp_histogram *h,
+    const struct timeval *from, const struct timeval *to)
 {
-	struct evhttp_connection *evcon = req->evcon;
+	struct timeval tv;
+	ev_uint64_t usec;
+	int i;
 
-	if (req->chunked) {
-		evbuffer_add(req->evcon->output_buffer, "0\r\n\r\n", 5);
-		evhttp_write_buffer(req->evcon, evhttp_send_done, NULL);
-		req->chunked = 0;
-	} else if (!event_pending(&evcon->ev, EV_WRITE|EV_TIMEOUT, NULL)) {
-		/* let the connection know that we are done with the request */
-		evhttp_send_done(evcon, NULL);
-	} else {
-		/* make the callback execute after all data has been written */
-		evcon->cb = evhttp_send_done;
-		evcon->cb_arg = NULL;
+	if (!timerisset(from) || !timerisset(to))
+		return;
+
+	timersub(to, from, &tv);
+	usec = tv.tv_sec < 0 ? 0 :
+	    (ev_uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+	for (i = 0; i < EVHTTP_STATS_BUCKETS - 1; i++) {
+		if (usec < ((ev_uint64_t)1 << i))
+			break;
 	}
+	h->buckets[i]++;
+	h->count++;
+	h->total_usec += usec;
+	if (usec > h->max_usec)
+		h->max_usec = usec;
 }
 
-void
-evhttp_response_code(struct evhttp_request *req, int code, const char *reason)
+static void
+evhttp_stats_request_done(struct evhttp *http, struct evhttp_request *req)
 {
-	req->kind = EVHTTP_RESPONSE;
-	req->response_code = code;
-	if (req->response_code_line != NULL)
-		free(req->response_code_line);
-	req->response_code_line = strdup(reason);
+	struct evhttp_stats *stats = http->stats;
+	struct evhttp_request_timing *t = &req->timing;
+
+	/* a reply written from within the callback ends it */
+	if (http->dispatching == req && !timerisset(&t->cb_end))
+		t->cb_end = t->last_write;
+
+	stats->requests++;
+	evhttp_histogram_add(&stats->phases[EVHTTP_PHASE_HEADERS],
+	    &t->first_read, &t->headers_done);
+	evhttp_histogram_add(&stats->phases[EVHTTP_PHASE_BODY],
+	    &t->headers_done, &t->body_done);
+	evhttp_histogram_add(&stats->phases[EVHTTP_PHASE_CALLBACK],
+	    &t->cb_start, &t->cb_end);
+	evhttp_histogram_add(&stats->phases[EVHTTP_PHASE_REPLY],
+	    &t->body_done, &t->first_write);
+	evhttp_histogram_add(&stats->phases[EVHTTP_PHASE_WRITE],
+	    &t->first_write, &t->last_write);
+	evhttp_histogram_add(&stats->phases[EVHTTP_PHASE_TOTAL],
+	    &t->first_read, &t->last_write);
 }
 
 void
-evhttp_send_page(struct evhttp_request *req, struct evbuffer *databuf)
+evhttp_get_stats(struct evhttp *http, struct evhttp_stats *stats)
 {
-	if (!req->major || !req->minor) {
-		req->major = 1;
-		req->minor = 1;
-	}
-	
-	if (req->kind != EVHTTP_RESPONSE)
-		evhttp_response_code(req, 200, "OK");
+	struct timeval now, tv;
+	double secs;
 
-	evhttp_clear_headers(req->output_headers);
-	evhttp_add_header(req->output_headers, "Content-Type", "text/html");
-	evhttp_add_header(req->output_headers, "Connection", "close");
+	*stats = *http->stats;
 
-	evhttp_send(req, databuf);
+	gettimeofday(&now, NULL);
+	timersub(&now, &stats->since, &tv);
+	secs = tv.tv_sec + tv.tv_usec / 1000000.0;
+	stats->requests_per_sec = secs > 0 ? stats->requests / secs : 0;
 }
 
-static const char uri_chars[256] = {
-	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
-	0, 1, 0, 0, 1, 0, 0, 1,   1, 1, 1, 1, 1, 1, 1, 1,
-	1, 1, 1, 1, 1, 1, 1, 1,   1, 1, 1, 0, 0, 1, 0, 0,
-	/* 64 */
-	1, 1, 1, 1, 1, 1, 1, 1,   1, 1, 1, 1, 1, 1, 1, 1,
-	1, 1, 1, 1, 1, 1, 1, 1,   1, 1, 1, 0, 0, 0, 0, 1,
-	0, 1, 1, 1, 1, 1, 1, 1,   1, 1, 1, 1, 1, 1, 1, 1,
-	1, 1, 1, 1, 1, 1, 1, 1,   1, 1, 1, 0, 0, 0, 1, 0,
-	/* 128 */
-	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
-	/* 192 */
-	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
-};
+void
+evhttp_reset_stats(struct evhttp *http)
+{
+	int active = http->stats->active_connections;
+
+	memset(http->stats, 0, sizeof(struct evhttp_stats));
+	http->stats->active_connections = active;
+	gettimeofday(&http->stats->since, NULL);
+}
 
 /*
- * Helper functions to encode/decode a URI.
- * The returned string must be freed by the caller.
+ * Access log.  A finished request only formats its line into the ring
+ * buffer of the log; a timer writes out what was collected, sooner if
+ * the ring fills up.  The file is non-blocking, so whatever it does not
+ * take stays in the ring for the next time.
  */
-char *
-evhttp_encode_uri(const char *uri)
-{
-	struct evbuffer *buf = evbuffer_new();
-	char *p;
 
-	for (p = (char *)uri; *p != '\0'; p++) {
-		if (uri_chars[(u_char)(*p)]) {
-			evbuffer_add(buf, p, 1);
-		} else {
-			evbuffer_add_printf(buf, "%%%02X", (u_char)(*p));
-		}
+static void
+evhttp_access_log_write(struct evhttp_access_log *log)
+{
+	struct timeval tv;
+	size_t n;
+	int res;
+
+	while (log->len > 0) {
+		n = log->size - log->head;
+		if (n > log->len)
+			n = log->len;
+		if ((res = write(log->fd, log->ring + log->head, n)) <= 0)
+			break;
+		log->head = (log->head + res) % log->size;
+		log->len -= res;
 	}
-	evbuffer_add(buf, "", 1);
-	p = strdup((char *)EVBUFFER_DATA(buf));
-	evbuffer_free(buf);
-	
-	return (p);
+	if (log->len == 0) {
+		log->head = 0;
+		return;
+	}
+
+	/* try again later */
+	timerclear(&tv);
+	tv.tv_usec = HTTP_LOG_FLUSH_MSEC * 1000;
+	evtimer_add(&log->flush_ev, &tv);
 }
 
-char *
-evhttp_decode_uri(const char *uri)
+static void
+evhttp_access_log_flushcb(int fd, short what, void *arg)
 {
-	char c, *ret;
-	int i, j, in_query = 0;
-	
-	ret = malloc(strlen(uri) + 1);
-	if (ret == NULL)
-		event_err(1, "%s: malloc(%lu)", __func__,
-			  (unsigned long)(strlen(uri) + 1));
-	
-	for (i = j = 0; uri[i] != '\0'; i++) {
-		c = uri[i];
-		if (c == '?') {
-			in_query = 1;
-		} else if (c == '+' && in_query) {
-			c = ' ';
-		} else if (c == '%' && isxdigit((unsigned char)uri[i+1]) &&
-		    isxdigit((unsigned char)uri[i+2])) {
-			char tmp[] = { uri[i+1], uri[i+2], '\0' };
-			c = (char)strtol(tmp, NULL, 16);
-			i += 2;
-		}
-		ret[j++] = c;
-	}
-	ret[j] = '\0';
-	
-	return (ret);
+	evhttp_access_log_write(arg);
 }
 
-/* 
- * Helper function to parse out arguments in a query.
- * The arguments are separated by key and value.
- * URI should already be decoded.
- */
+static void
+evhttp_log_add(char *line, size_t *off, const char *data, size_t len)
+{
+	/* room for the newline is always left */
+	if (len > HTTP_LOG_LINE_MAX - 1 - *off)
+		len = HTTP_LOG_LINE_MAX - 1 - *off;
+	memcpy(line + *off, data, len);
+	*off += len;
+}
 
-void
-evhttp_parse_query(const char *uri, struct evkeyvalq *headers)
+static void
+evhttp_log_add_string(char *line, size_t *off, const char *data)
 {
-	char *line;
-	char *argument;
-	char *p;
+	if (data == NULL || *data == '\0')
+		data = "-";
+	evhttp_log_add(line, off, data, strlen(data));
+}
 
-	TAILQ_INIT(headers);
+static size_t
+evhttp_access_log_format(struct evhttp_access_log *log,
+    struct evhttp_request *req, char *line)
+{
+	struct evhttp_request_timing *t = &req->timing;
+	const char *p, *end;
+	char tmp[64];
+	size_t off = 0;
+	time_t now;
+
+	for (p = log->format; *p != '\0'; p++) {
+		if (*p != '%' || p[1] == '\0') {
+			evhttp_log_add(line, &off, p, 1);
+			continue;
+		}
 
-	/* No arguments - we are done */
-	if (strchr(uri, '?') == NULL)
-		return;
+		switch (*++p) {
+		case 'h':
+			evhttp_log_add_string(line, &off, req->remote_host);
+			break;
+		case 't':
+			now = time(NULL);
+			if (log->date_sec != now) {
+				struct tm *tm = gmtime(&now);
+				if (tm == NULL || strftime(log->date,
+					sizeof(log->date),
+					"[%d/%b/%Y:%H:%M:%S +0000]", tm) == 0)
+					strlcpy(log->date, "-",
+					    sizeof(log->date));
+				log->date_sec = now;
+			}
+			evhttp_log_add_string(line, &off, log->date);
+			break;
+		case 'r':
+			if (req->uri == NULL) {
+				evhttp_log_add_string(line, &off, NULL);
+				break;
+			}
+			evhttp_log_add_string(line, &off,
+			    evhttp_method(req->type));
+			evhttp_log_add(line, &off, " ", 1);
+			evhttp_log_add_string(line, &off, req->uri);
+			snprintf(tmp, sizeof(tmp), " HTTP/%d.%d",
+			    req->major, req->minor);
+			evhttp_log_add_string(line, &off, tmp);
+			break;
+		case 'm':
+			evhttp_log_add_string(line, &off,
+			    req->uri != NULL ? evhttp_method(req->type) : NULL);
+			break;
+		case 'U':
+			evhttp_log_add_string(line, &off, req->uri);
+			break;
+		case 's':
+			snprintf(tmp, sizeof(tmp), "%d", req->response_code);
+			evhttp_log_add_string(line, &off, tmp);
+			break;
+		case 'b':
+			snprintf(tmp, sizeof(tmp), "%lld",
+			    (long long)req->bytes_written);
+			evhttp_log_add_string(line, &off, tmp);
+			break;
+		case 'D':
+			if (timerisset(&t->first_read)) {
+				struct timeval tv;
+				timersub(&t->last_write, &t->first_read, &tv);
+				snprintf(tmp, sizeof(tmp), "%lld",
+				    (long long)tv.tv_sec * 1000000 +
+				    tv.tv_usec);
+			} else {
+				strlcpy(tmp, "-", sizeof(tmp));
+			}
+			evhttp_log_add_string(line, &off, tmp);
+			break;
+		case '{':
+			/* %{Name}i */
+			if ((end = strchr(p, '}')) == NULL || end[1] != 'i' ||
+			    (size_t)(end - p) >= sizeof(tmp)) {
+				evhttp_log_add(line, &off, p - 1, 2);
+				break;
+			}
+			memcpy(tmp, p + 1, end - p - 1);
+			tmp[end - p - 1] = '\0';
+			evhttp_log_add_string(line, &off,
+			    evhttp_find_header(req->input_headers, tmp));
+			p = end + 1;
+			break;
+		case '%':
+			evhttp_log_add(line, &off, "%", 1);
+			break;
+		default:
+			evhttp_log_add(line, &off, p - 1, 2);
+			break;
+		}
+	}
+	line[off++] = '\n';
 
-	if ((line = strdup(uri)) == NULL)
-		event_err(1, "%s: strdup", __func__);
+	return (off);
+}
 
+static void
+evhttp_access_log_request(struct evhttp *http, struct evhttp_request *req)
+{
+	struct evhttp_access_log *log = http->access_log;
+	char line[HTTP_LOG_LINE_MAX];
+	size_t len, tail, n;
+	struct timeval tv;
+
+	len = evhttp_access_log_format(log, req, line);
+	if (len > log->size - log->len) {
+		http->stats->log_dropped++;
+		return;
+	}
 
-	argument = line;
+	/* the line may wrap around the end of the ring */
+	tail = (log->head + log->len) % log->size;
+	n = log->size - tail;
+	if (n > len)
+		n = len;
+	memcpy(log->ring + tail, line, n);
+	memcpy(log->ring, line + n, len - n);
+	log->len += len;
+
+	timerclear(&tv);
+	if (log->len >= log->size / 2) {
+		/* write it out right after this request */
+		evtimer_add(&log->flush_ev, &tv);
+	} else if (!evtimer_pending(&log->flush_ev, NULL)) {
+		tv.tv_usec = HTTP_LOG_FLUSH_MSEC * 1000;
+		evtimer_add(&log->flush_ev, &tv);
+	}
+}
 
-	/* We already know that there has to be a ? */
-	strsep(&argument, "?");
+int
+evhttp_set_access_log(struct evhttp *http, int fd, const char *format,
+    size_t size)
+{
+	struct evhttp_access_log *log = http->access_log;
+
+	if (log != NULL) {
+		/* writes what the file takes right away */
+		event_del(&log->flush_ev);
+		evhttp_access_log_write(log);
+		event_del(&log->flush_ev);
+		free(log->format);
+		free(log->ring);
+		free(log);
+		http->access_log = NULL;
+	}
 
-	p = argument;
-	while (p != NULL && *p != '\0') {
-		char *key, *value;
-		argument = strsep(&p, "&");
+	if (fd == -1)
+		return (0);
 
-		value = argument;
-		key = strsep(&value, "=");
-		if (value == NULL)
-			goto error;
+	if (format == NULL)
+		format = "%h - - %t \"%r\" %s %b";
+	if (size == 0)
+		size = HTTP_LOG_SIZE;
 
-		value = evhttp_decode_uri(value);
-		event_debug(("Query Param: %s -> %s\n", key, value));
-		evhttp_add_header(headers, key, value);
-		free(value);
+	if ((log = calloc(1, sizeof(struct evhttp_access_log))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (-1);
+	}
+	if ((log->format = strdup(format)) == NULL ||
+	    (log->ring = malloc(size)) == NULL) {
+		event_warn("%s: malloc", __func__);
+		if (log->format != NULL)
+			free(log->format);
+		free(log);
+		return (-1);
 	}
+	log->fd = fd;
+	log->size = size;
+	evtimer_set(&log->flush_ev, evhttp_access_log_flushcb, log);
+	EVHTTP_BASE_SET(http, &log->flush_ev);
 
- error:
-	free(line);
+	http->access_log = log;
+
+	return (0);
 }
 
-static struct evhttp_cb *
-evhttp_dispatch_callback(struct httpcbq *callbacks, struct evhttp_request *req)
+/*
+ * Calls a user callback and times it.  A reply that is written before
+ * the callback returns frees the request; the callback ends there.
+ */
+static void
+evhttp_run_callback(struct evhttp *http, struct evhttp_request *req,
+    void (*cb)(struct evhttp_request *, void *), void *arg)
 {
-	struct evhttp_cb *cb;
-	size_t offset = 0;
+	http->dispatching = req;
+	evhttp_gettime(&req->timing.cb_start);
 
-	/* Test for different URLs */
-	char *p = strchr(req->uri, '?');
-	if (p != NULL)
-		offset = (size_t)(p - req->uri);
-
-	TAILQ_FOREACH(cb, callbacks, next) {
-		int res = 0;
-		if (p == NULL) {
-			res = strcmp(cb->what, req->uri) == 0;
-		} else {
-			res = ((strncmp(cb->what, req->uri, offset) == 0) &&
-					(cb->what[offset] == '\0'));
-		}
+	(*cb)(req, arg);
 
-		if (res)
-			return (cb);
+	/* a reply that is still pending ends the callback at the last I/O */
+	if (http->dispatching == req) {
+		req->timing.cb_end = req->evcon->last_io;
+		http->dispatching = NULL;
 	}
-
-	return (NULL);
 }
 
 static void
@@ -1944,14 +6061,17 @@ evhttp_handle_request(struct evhttp_request *req, void *arg)
 		return;
 	}
 
-	if ((cb = evhttp_dispatch_callback(&http->callbacks, req)) != NULL) {
-		(*cb->cb)(req, cb->cbarg);
+	if (http->cache != NULL && evhttp_cache_lookup(http, req) == 0)
+		return;
+
+	if ((cb = req->route) != NULL) {
+		evhttp_run_callback(http, req, cb->cb, cb->cbarg);
 		return;
 	}
 
 	/* Generic call back */
 	if (http->gencb) {
-		(*http->gencb)(req, http->gencbarg);
+		evhttp_run_callback(http, req, http->gencb, http->gencbarg);
 		return;
 	} else {
 		/* We need to send a 404 here */
@@ -1996,27 +6116,76 @@ accept_socket(int fd, short what, void *arg)
 	evhttp_get_request(http, nfd, (struct sockaddr *)&ss, addrlen);
 }
 
+static struct evhttp_bound_socket *
+evhttp_accept_socket_internal(struct evhttp *http, int fd)
+{
+	struct evhttp_bound_socket *bound;
+	struct event *ev;
+
+	if (listen(fd, 10) == -1) {
+		event_warn("%s: listen", __func__);
+		return (NULL);
+	}
+	if (evutil_make_socket_nonblocking(fd) < 0)
+		return (NULL);
+
+	if ((bound = calloc(1, sizeof(struct evhttp_bound_socket))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (NULL);
+	}
+
+	/* Schedule the socket for accepting */
+	ev = &bound->bind_ev;
+	event_set(ev, fd, EV_READ | EV_PERSIST, accept_socket, http);
+	EVHTTP_BASE_SET(http, ev);
+	if (!http->accept_paused)
+		event_add(ev, NULL);
+
+	TAILQ_INSERT_TAIL(&http->sockets, bound, next);
+
+	return (bound);
+}
+
+int
+evhttp_accept_socket(struct evhttp *http, int fd)
+{
+	return (evhttp_accept_socket_internal(http, fd) != NULL ? 0 : -1);
+}
+
 int
 evhttp_bind_socket(struct evhttp *http, const char *address, u_short port)
 {
-	struct event *ev = &http->bind_ev;
+	struct evhttp_bound_socket *bound;
 	int fd;
+#ifndef WIN32
+	struct sockaddr_un su;
+	socklen_t sulen;
+	int res;
 
-	if ((fd = bind_socket(address, port)) == -1)
+	if ((res = unix_address(address, &su, &sulen)) == -1)
+		return (-1);
+	if (res == 1)
+		fd = bind_socket_unix(&su, sulen);
+	else
+#endif
+		fd = bind_socket(address, port);
+	if (fd == -1)
 		return (-1);
 
-	if (listen(fd, 10) == -1) {
-		event_warn("%s: listen", __func__);
+	if ((bound = evhttp_accept_socket_internal(http, fd)) == NULL) {
 		EVUTIL_CLOSESOCKET(fd);
 		return (-1);
 	}
 
-	/* Schedule the socket for accepting */
-	event_set(ev, fd, EV_READ | EV_PERSIST, accept_socket, http);
-	EVHTTP_BASE_SET(http, ev);
-	event_add(ev, NULL);
+#ifndef WIN32
+	/* the socket file goes away with the server */
+	if (res == 1 && su.sun_path[0] != '\0' &&
+	    (bound->path = strdup(su.sun_path)) == NULL)
+		event_warn("%s: strdup", __func__);
+#endif
 
-	event_debug(("Bound to port %d - Awaiting connections ... ", port));
+	event_debug(("Bound to %s port %d - Awaiting connections ... ",
+		address, port));
 
 	return (0);
 }
@@ -2026,15 +6195,30 @@ evhttp_new_object(void)
 {
 	struct evhttp *http = NULL;
 
-	if ((http = calloc(1, sizeof(struct evhttp))) == NULL) {
+	if ((http = calloc(1, sizeof(struct evhttp))) == NULL ||
+	    (http->stats = calloc(1, sizeof(struct evhttp_stats))) == NULL) {
 		event_warn("%s: calloc", __func__);
+		if (http != NULL)
+			free(http);
 		return (NULL);
 	}
+	gettimeofday(&http->stats->since, NULL);
 
 	http->timeout = -1;
+	http->max_headers_size = -1;
+	http->max_body_size = -1;
 
+	TAILQ_INIT(&http->sockets);
 	TAILQ_INIT(&http->callbacks);
 	TAILQ_INIT(&http->connections);
+	TAILQ_INIT(&http->free_requests);
+	TAILQ_INIT(&http->free_connections);
+	http->max_pooled = EVHTTP_POOL_MAX;
+
+	http->max_connections = -1;
+	http->max_requests = -1;
+	http->max_queued = -1;
+	TAILQ_INIT(&http->idle_connections);
 
 	return (http);
 }
@@ -2059,7 +6243,7 @@ evhttp_start(const char *address, u_short port)
 	struct evhttp *http = evhttp_new_object();
 
 	if (evhttp_bind_socket(http, address, port) == -1) {
-		free(http);
+		evhttp_free(http);
 		return (NULL);
 	}
 
@@ -2071,23 +6255,41 @@ evhttp_free(struct evhttp* http)
 {
 	struct evhttp_cb *http_cb;
 	struct evhttp_connection *evcon;
-	int fd = http->bind_ev.ev_fd;
+	struct evhttp_bound_socket *bound;
 
 	/* Remove the accepting part */
-	event_del(&http->bind_ev);
-	EVUTIL_CLOSESOCKET(fd);
+	while ((bound = TAILQ_FIRST(&http->sockets)) != NULL) {
+		TAILQ_REMOVE(&http->sockets, bound, next);
+		event_del(&bound->bind_ev);
+		EVUTIL_CLOSESOCKET(bound->bind_ev.ev_fd);
+		if (bound->path != NULL) {
+			unlink(bound->path);
+			free(bound->path);
+		}
+		free(bound);
+	}
 
 	while ((evcon = TAILQ_FIRST(&http->connections)) != NULL) {
 		/* evhttp_connection_free removes the connection */
 		evhttp_connection_free(evcon);
 	}
 
+	http->max_pooled = 0;
+	evhttp_trim_pools(http);
+
+	evhttp_set_cache(http, 0);
+	evhttp_set_access_log(http, -1, NULL, 0);
+	if (event_initialized(&http->date_ev))
+		event_del(&http->date_ev);
+
 	while ((http_cb = TAILQ_FIRST(&http->callbacks)) != NULL) {
 		TAILQ_REMOVE(&http->callbacks, http_cb, next);
 		free(http_cb->what);
 		free(http_cb);
 	}
-	
+	evhttp_route_free(&http->routes);
+
+	free(http->stats);
 	free(http);
 }
 
@@ -2098,25 +6300,226 @@ evhttp_set_timeout(struct evhttp* http, int timeout_in_secs)
 }
 
 void
-evhttp_set_cb(struct evhttp *http, const char *uri,
+evhttp_set_max_headers_size(struct evhttp *http, ev_int64_t max_size)
+{
+	http->max_headers_size = max_size < 0 ? -1 : max_size;
+}
+
+void
+evhttp_set_max_body_size(struct evhttp *http, ev_int64_t max_size)
+{
+	http->max_body_size = max_size < 0 ? -1 : max_size;
+}
+
+/*
+ * Overload protection.  A server at its connection limit keeps accepting
+ * while it has idle persistent connections and closes one of them for
+ * each connection it takes past the limit; without any, it stops accepting;
+ * requests beyond the other limits get a 503 before any work is done
+ * for them, which is cheaper than letting everyone wait.
+ */
+
+static void
+evhttp_pause_accept(struct evhttp *http)
+{
+	struct evhttp_bound_socket *bound;
+
+	TAILQ_FOREACH(bound, &http->sockets, next)
+		event_del(&bound->bind_ev);
+	http->accept_paused = 1;
+}
+
+static void
+evhttp_resume_accept(struct evhttp *http)
+{
+	struct evhttp_bound_socket *bound;
+
+	TAILQ_FOREACH(bound, &http->sockets, next)
+		event_add(&bound->bind_ev, NULL);
+	http->accept_paused = 0;
+}
+
+static void
+evhttp_limit_connections(struct evhttp *http)
+{
+	struct evhttp_connection *evcon;
+
+	/* a connection accepted past the limit takes the place of an idle one */
+	while (http->stats->active_connections > http->max_connections &&
+	    (evcon = TAILQ_FIRST(&http->idle_connections)) != NULL) {
+		http->stats->shed++;
+		evhttp_connection_free(evcon);
+	}
+
+	/* without an idle connection to close, the next one has to wait */
+	if (http->stats->active_connections >= http->max_connections &&
+	    TAILQ_EMPTY(&http->idle_connections)) {
+		if (!http->accept_paused)
+			evhttp_pause_accept(http);
+	} else if (http->accept_paused) {
+		evhttp_resume_accept(http);
+	}
+}
+
+static int
+evhttp_admit_request(struct evhttp *http, struct evhttp_request *req)
+{
+	if ((http->max_requests != -1 &&
+		http->nrequests >= http->max_requests) ||
+	    (http->max_queued != -1 &&
+		(ev_int64_t)http->queued > http->max_queued)) {
+		http->stats->rejected++;
+		return (-1);
+	}
+
+	req->flags |= EVHTTP_REQ_IN_FLIGHT;
+	http->nrequests++;
+	return (0);
+}
+
+void
+evhttp_set_max_connections(struct evhttp *http, int max)
+{
+	http->max_connections = max < 0 ? -1 : max;
+
+	if (http->max_connections != -1)
+		evhttp_limit_connections(http);
+	else if (http->accept_paused)
+		evhttp_resume_accept(http);
+}
+
+void
+evhttp_set_max_requests(struct evhttp *http, int max)
+{
+	http->max_requests = max < 0 ? -1 : max;
+}
+
+void
+evhttp_set_max_queued(struct evhttp *http, ev_int64_t max_size)
+{
+	http->max_queued = max_size < 0 ? -1 : max_size;
+}
+
+static void
+evhttp_trim_pools(struct evhttp *http)
+{
+	struct evhttp_request *req;
+	struct evhttp_connection *evcon;
+
+	/* pooled objects are not linked to a server; free them for real */
+	while (http->nfree_requests > http->max_pooled) {
+		req = TAILQ_FIRST(&http->free_requests);
+		TAILQ_REMOVE(&http->free_requests, req, next);
+		http->nfree_requests--;
+		evhttp_request_free(req);
+	}
+
+	while (http->nfree_connections > http->max_pooled) {
+		evcon = TAILQ_FIRST(&http->free_connections);
+		TAILQ_REMOVE(&http->free_connections, evcon, next);
+		http->nfree_connections--;
+		evhttp_connection_free(evcon);
+	}
+
+#ifdef EVHTTP_ZLIB
+	while (http->nfree_deflate > http->max_pooled) {
+		struct evhttp_deflate *d = http->free_deflate;
+		http->free_deflate = d->next;
+		http->nfree_deflate--;
+		evhttp_deflate_free(d);
+	}
+#endif
+}
+
+void
+evhttp_set_max_pooled(struct evhttp *http, int max)
+{
+	http->max_pooled = max;
+	evhttp_trim_pools(http);
+}
+
+static struct evhttp_cb *
+evhttp_set_cb_internal(struct evhttp *http, int methods, const char *uri,
     void (*cb)(struct evhttp_request *, void *), void *cbarg)
 {
-	struct evhttp_cb *http_cb;
+	struct evhttp_cb *http_cb, **pcb;
 
 	if ((http_cb = calloc(1, sizeof(struct evhttp_cb))) == NULL)
 		event_err(1, "%s: calloc", __func__);
 
 	http_cb->what = strdup(uri);
+	http_cb->methods = methods;
 	http_cb->cb = cb;
 	http_cb->cbarg = cbarg;
 
+	if ((pcb = evhttp_route_lookup(&http->routes, uri, 1)) == NULL)
+		event_err(1, "%s: calloc", __func__);
+	while (*pcb != NULL)
+		pcb = &(*pcb)->route_next;
+	*pcb = http_cb;
+
 	TAILQ_INSERT_TAIL(&http->callbacks, http_cb, next);
+
+	return (http_cb);
+}
+
+void
+evhttp_set_cb(struct evhttp *http, const char *uri,
+    void (*cb)(struct evhttp_request *, void *), void *cbarg)
+{
+	evhttp_set_cb_internal(http, EVHTTP_METHOD_ANY, uri, cb, cbarg);
+}
+
+void
+evhttp_set_method_cb(struct evhttp *http, enum evhttp_cmd_type type,
+    const char *uri, void (*cb)(struct evhttp_request *, void *), void *cbarg)
+{
+	evhttp_set_cb_internal(http, 1 << type, uri, cb, cbarg);
+}
+
+void
+evhttp_set_chunked_cb(struct evhttp *http, const char *uri,
+    void (*chunk_cb)(struct evhttp_request *, void *),
+    void (*cb)(struct evhttp_request *, void *), void *cbarg)
+{
+	struct evhttp_cb *http_cb;
+
+	http_cb = evhttp_set_cb_internal(http, EVHTTP_METHOD_ANY, uri,
+	    cb, cbarg);
+	http_cb->chunk_cb = chunk_cb;
+}
+
+void
+evhttp_set_chunked_view_cb(struct evhttp *http, const char *uri,
+    void (*chunk_cb)(struct evhttp_request *, void *),
+    void (*cb)(struct evhttp_request *, void *), void *cbarg)
+{
+	struct evhttp_cb *http_cb;
+
+	http_cb = evhttp_set_cb_internal(http, EVHTTP_METHOD_ANY, uri,
+	    cb, cbarg);
+	http_cb->chunk_cb = chunk_cb;
+	http_cb->chunk_view = 1;
+}
+
+void
+evhttp_set_proxy(struct evhttp *http, const char *uri,
+    struct evhttp_proxy *proxy)
+{
+	struct evhttp_cb *http_cb;
+
+	http_cb = evhttp_set_cb_internal(http, EVHTTP_METHOD_ANY, uri,
+	    evhttp_proxy_request_done, proxy);
+	http_cb->chunk_cb = evhttp_proxy_request_body;
+	http_cb->proxy = proxy;
 }
 
 int
 evhttp_del_cb(struct evhttp *http, const char *uri)
 {
-	struct evhttp_cb *http_cb;
+	struct evhttp_cb *http_cb, **pcb;
+	struct evhttp_connection *evcon;
+	struct evhttp_request *req;
 
 	TAILQ_FOREACH(http_cb, &http->callbacks, next) {
 		if (strcmp(http_cb->what, uri) == 0)
@@ -2125,6 +6528,21 @@ evhttp_del_cb(struct evhttp *http, const char *uri)
 	if (http_cb == NULL)
 		return (-1);
 
+	pcb = evhttp_route_lookup(&http->routes, uri, 0);
+	assert(pcb != NULL);
+	while (*pcb != http_cb)
+		pcb = &(*pcb)->route_next;
+	*pcb = http_cb->route_next;
+	evhttp_route_prune(&http->routes, uri);
+
+	/* requests that are still being read fall back to the generic one */
+	TAILQ_FOREACH(evcon, &http->connections, next) {
+		TAILQ_FOREACH(req, &evcon->requests, next) {
+			if (req->route == http_cb)
+				req->route = NULL;
+		}
+	}
+
 	TAILQ_REMOVE(&http->callbacks, http_cb, next);
 	free(http_cb->what);
 	free(http_cb);
@@ -2182,6 +6600,7 @@ evhttp_request_new(void (*cb)(struct evhttp_request *, void *), void *arg)
 
 	req->cb = cb;
 	req->cb_arg = arg;
+	req->chunk_cb_arg = arg;
 
 	return (req);
 
@@ -2194,19 +6613,45 @@ evhttp_request_new(void (*cb)(struct evhttp_request *, void *), void *arg)
 void
 evhttp_request_free(struct evhttp_request *req)
 {
-	if (req->remote_host != NULL)
-		free(req->remote_host);
+	struct evhttp *http = NULL;
+
+	if ((req->flags & EVHTTP_REQ_OWN_CONNECTION) && req->evcon != NULL)
+		http = req->evcon->http_server;
+	if (http != NULL && http->dispatching == req)
+		http->dispatching = NULL;
+	if (http != NULL && (req->flags & EVHTTP_REQ_IN_FLIGHT))
+		http->nrequests--;
+
+#ifdef EVHTTP_ZLIB
+	/* a streamed reply that was not finished */
+	if (req->deflate != NULL) {
+		evhttp_deflate_free(req->deflate);
+		req->deflate = NULL;
+	}
+#endif
+
 	if (req->uri != NULL)
 		free(req->uri);
 	if (req->response_code_line != NULL)
 		free(req->response_code_line);
 
 	evhttp_clear_headers(req->input_headers);
-	free(req->input_headers);
-
 	evhttp_clear_headers(req->output_headers);
+
+	/* requests of a server go back to its pool */
+	if (http != NULL && evhttp_request_pool(http, req) == 0)
+		return;
+
+	if (req->remote_host != NULL)
+		free(req->remote_host);
+
+	free(req->input_headers);
 	free(req->output_headers);
 
+	/* releases all parsed headers at once */
+	if (req->header_arena != NULL)
+		evhttp_header_arena_free(req->header_arena);
+
 	if (req->input_buffer != NULL)
 		evbuffer_free(req->input_buffer);
 
@@ -2252,7 +6697,8 @@ evhttp_get_request_connection(
 			__func__, hostname, portname, fd));
 
 	/* we need a connection object to put the http request on */
-	if ((evcon = evhttp_connection_new(hostname, atoi(portname))) == NULL)
+	evcon = evhttp_connection_new_pooled(http, hostname, atoi(portname));
+	if (evcon == NULL)
 		return (NULL);
 
 	/* associate the base if we have one*/
@@ -2271,7 +6717,8 @@ evhttp_associate_new_request_with_connection(struct evhttp_connection *evcon)
 {
 	struct evhttp *http = evcon->http_server;
 	struct evhttp_request *req;
-	if ((req = evhttp_request_new(evhttp_handle_request, http)) == NULL)
+	req = evhttp_request_new_pooled(http, evhttp_handle_request, http);
+	if (req == NULL)
 		return (-1);
 
 	req->evcon = evcon;	/* the request ends up owning the connection */
@@ -2281,9 +6728,16 @@ evhttp_associate_new_request_with_connection(struct evhttp_connection *evcon)
 	
 	req->kind = EVHTTP_REQUEST;
 	
-	if ((req->remote_host = strdup(evcon->address)) == NULL)
+	if (req->remote_host != NULL &&
+	    strcmp(req->remote_host, evcon->address) != 0) {
+		free(req->remote_host);
+		req->remote_host = NULL;
+	}
+	if (req->remote_host == NULL &&
+	    (req->remote_host = strdup(evcon->address)) == NULL)
 		event_err(1, "%s: strdup", __func__);
 	req->remote_port = evcon->port;
+	req->timing.accepted = evcon->accepted;
 
 	evhttp_start_read(evcon);
 	
@@ -2303,6 +6757,8 @@ evhttp_get_request(struct evhttp *http, int fd,
 	/* the timeout can be used by the server to close idle connections */
 	if (http->timeout != -1)
 		evhttp_connection_set_timeout(evcon, http->timeout);
+	evcon->max_headers_size = http->max_headers_size;
+	evcon->max_body_size = http->max_body_size;
 
 	/* 
 	 * if we want to accept more than one request on a connection,
@@ -2310,9 +6766,17 @@ evhttp_get_request(struct evhttp *http, int fd,
 	 */
 	evcon->http_server = http;
 	TAILQ_INSERT_TAIL(&http->connections, evcon, next);
+	evhttp_gettime(&evcon->accepted);
+	http->stats->connections++;
+	http->stats->active_connections++;
 	
-	if (evhttp_associate_new_request_with_connection(evcon) == -1)
+	if (evhttp_associate_new_request_with_connection(evcon) == -1) {
 		evhttp_connection_free(evcon);
+		return;
+	}
+
+	if (http->max_connections != -1)
+		evhttp_limit_connections(http);
 }
 
 
@@ -2357,6 +6821,29 @@ name_from_addr(struct sockaddr *sa, socklen_t salen,
 	static char strport[NI_MAXSERV];
 	int ni_result;
 
+#ifndef WIN32
+	if (sa->sa_family == AF_UNIX) {
+		/* the peers of Unix sockets are usually unnamed */
+		struct sockaddr_un *su = (struct sockaddr_un *)sa;
+		const char *end;
+		size_t len = 0;
+
+		/* abstract names are not printable */
+		if (salen > offsetof(struct sockaddr_un, sun_path) &&
+		    su->sun_path[0] != '\0') {
+			len = salen - offsetof(struct sockaddr_un, sun_path);
+			if ((end = memchr(su->sun_path, '\0', len)) != NULL)
+				len = end - su->sun_path;
+		}
+		snprintf(ntop, sizeof(ntop), "%s%.*s", EVHTTP_UNIX_PREFIX,
+		    (int)len, su->sun_path);
+		strlcpy(strport, "0", sizeof(strport));
+		*phost = ntop;
+		*pport = strport;
+		return;
+	}
+#endif
+
 	if ((ni_result = getnameinfo(sa, salen,
 		ntop, sizeof(ntop), strport, sizeof(strport),
 		NI_NUMERICHOST|NI_NUMERICSERV)) != 0) {
@@ -2382,7 +6869,7 @@ bind_socket_ai(struct addrinfo *ai)
 	int serrno;
 
         /* Create listen socket */
-        fd = socket(AF_INET, SOCK_STREAM, 0);
+        fd = socket(ai->ai_family, SOCK_STREAM, 0);
         if (fd == -1) {
                 event_warn("socket");
                 return (-1);
@@ -2414,6 +6901,95 @@ bind_socket_ai(struct addrinfo *ai)
 	return (-1);
 }
 
+#ifndef WIN32
+/*
+ * Fills in the address of a Unix socket for "unix:/path", or for
+ * "unix:@name" in the abstract namespace.  Returns 0 if the address is
+ * not one of a Unix socket, -1 if it is too long.
+ */
+static int
+unix_address(const char *address, struct sockaddr_un *su, socklen_t *plen)
+{
+	size_t prefixlen = strlen(EVHTTP_UNIX_PREFIX), len;
+
+	if (address == NULL ||
+	    strncmp(address, EVHTTP_UNIX_PREFIX, prefixlen) != 0)
+		return (0);
+	address += prefixlen;
+
+	if ((len = strlen(address)) == 0 || len >= sizeof(su->sun_path)) {
+		event_warnx("%s: bad unix socket path \"%s\"",
+		    __func__, address);
+		return (-1);
+	}
+
+	memset(su, 0, sizeof(struct sockaddr_un));
+	su->sun_family = AF_UNIX;
+	memcpy(su->sun_path, address, len);
+	*plen = offsetof(struct sockaddr_un, sun_path) + len;
+	if (address[0] == '@') {
+		/* the name is all bytes of the path; no NUL at the end */
+		su->sun_path[0] = '\0';
+	} else {
+		*plen += 1;
+	}
+
+	return (1);
+}
+
+static int
+bind_socket_unix(struct sockaddr_un *su, socklen_t sulen)
+{
+	struct stat st;
+	int fd, serrno;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		event_warn("socket");
+		return (-1);
+	}
+
+	if (evutil_make_socket_nonblocking(fd) < 0)
+		goto out;
+	if (fcntl(fd, F_SETFD, 1) == -1) {
+		event_warn("fcntl(F_SETFD)");
+		goto out;
+	}
+
+	/*
+	 * a socket that is left over from an earlier server is replaced,
+	 * but not one that a running server still accepts connections on
+	 */
+	if (su->sun_path[0] != '\0' && lstat(su->sun_path, &st) == 0 &&
+	    S_ISSOCK(st.st_mode)) {
+		int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+		int res = -1;
+
+		if (probe == -1)
+			goto out;
+		if (evutil_make_socket_nonblocking(probe) == 0 &&
+		    connect(probe, (struct sockaddr *)su, sulen) == -1)
+			res = errno;
+		EVUTIL_CLOSESOCKET(probe);
+		if (res != ECONNREFUSED) {
+			errno = EADDRINUSE;
+			goto out;
+		}
+		unlink(su->sun_path);
+	}
+
+	if (bind(fd, (struct sockaddr *)su, sulen) == -1)
+		goto out;
+
+	return (fd);
+
+ out:
+	serrno = EVUTIL_SOCKET_ERROR();
+	EVUTIL_CLOSESOCKET(fd);
+	EVUTIL_SET_SOCKET_ERROR(serrno);
+	return (-1);
+}
+#endif
+
 static struct addrinfo *
 make_addrinfo(const char *address, u_short port)
 {
@@ -2473,40 +7049,22 @@ bind_socket(const char *address, u_short port)
 }
 
 static int
-socket_connect(int fd, const char *address, unsigned short port)
+socket_connect_sa(int fd, struct sockaddr *sa, socklen_t salen)
 {
-	struct addrinfo *ai = make_addrinfo(address, port);
-	int res = -1;
-
-	if (ai == NULL) {
-		event_debug(("%s: make_addrinfo: \"%s:%d\"",
-			__func__, address, port));
-		return (-1);
-	}
-
-	if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+	if (connect(fd, sa, salen) == -1) {
 #ifdef WIN32
 		int tmp_error = WSAGetLastError();
 		if (tmp_error != WSAEWOULDBLOCK && tmp_error != WSAEINVAL &&
 		    tmp_error != WSAEINPROGRESS) {
-			goto out;
+			return (-1);
 		}
 #else
 		if (errno != EINPROGRESS) {
-			goto out;
+			return (-1);
 		}
 #endif
 	}
 
 	/* everything is fine */
-	res = 0;
-
-out:
-#ifdef HAVE_GETADDRINFO
-	freeaddrinfo(ai);
-#else
-	fake_freeaddrinfo(ai);
-#endif
-
-	return (res);
+	return (0);
 }
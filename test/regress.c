@@ -46,6 +46,7 @@
 #include <sys/signal.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <netinet/in.h>
 #endif
 #include <fcntl.h>
 #include <signal.h>
@@ -905,6 +906,47 @@ test_evbuffer_find(void)
 	evbuffer_free(buf);
 }
 
+static void
+test_evbuffer_readsize(void)
+{
+	struct evbuffer *evb = evbuffer_new();
+	char buffer[20000];
+	size_t grown;
+	ev_uint64_t nshort;
+
+	setup_test("Testing evbuffer_read sizing: ");
+
+	memset(buffer, 'a', sizeof(buffer));
+	if (write(pair[0], buffer, sizeof(buffer)) != sizeof(buffer))
+		goto out;
+
+	/* full reads make the next read larger */
+	while (evbuffer_read(evb, pair[1], -1) > 0)
+		;
+	if (EVBUFFER_LENGTH(evb) != sizeof(buffer) ||
+	    evb->nread_bytes != sizeof(buffer) || evb->nread_full == 0)
+		goto out;
+	grown = evb->readsize;
+	nshort = evb->nread_short;
+	if (grown <= 4096)
+		goto out;
+
+	/* and short reads make it smaller again */
+	if (write(pair[0], buffer, 10) != 10)
+		goto out;
+	if (evbuffer_read(evb, pair[1], -1) != 10)
+		goto out;
+	if (evb->readsize >= grown || evb->nread_short != nshort + 1)
+		goto out;
+
+	test_ok = 1;
+
+ out:
+	evbuffer_free(evb);
+
+	cleanup_test();
+}
+
 static void
 readcb(struct bufferevent *bev, void *arg)
 {
@@ -958,6 +1000,224 @@ test_bufferevent(void)
 	cleanup_test();
 }
 
+#ifndef WIN32
+static void
+connect_errorcb(struct bufferevent *bev, short what, void *arg)
+{
+	if (what == EVBUFFER_CONNECTED)
+		test_ok++;
+	else
+		test_ok = -2;
+}
+
+static void
+test_bufferevent_connect(void)
+{
+	struct bufferevent *bev;
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+	char buf[16];
+	int fd, accepted;
+
+	setup_test("Bufferevent connect: ");
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1 || bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1 ||
+	    listen(fd, 5) == -1 ||
+	    getsockname(fd, (struct sockaddr *)&sin, &slen) == -1) {
+		fprintf(stdout, "FAILED (setup)\n");
+		exit(1);
+	}
+
+	bev = bufferevent_new(-1, NULL, writecb, connect_errorcb, NULL);
+	if (bufferevent_socket_connect(bev,
+		(struct sockaddr *)&sin, sizeof(sin), 10) == -1) {
+		fprintf(stdout, "FAILED (connect)\n");
+		exit(1);
+	}
+
+	/* written once the connection has been established */
+	bufferevent_write(bev, "hello", 5);
+
+	event_dispatch();
+
+	accepted = accept(fd, NULL, NULL);
+	if (accepted == -1 || read(accepted, buf, sizeof(buf)) != 5 ||
+	    memcmp(buf, "hello", 5) != 0)
+		test_ok = 0;
+
+	close(accepted);
+	close(EVENT_FD(&bev->ev_read));
+	bufferevent_free(bev);
+	close(fd);
+
+	if (test_ok != 2)
+		test_ok = 0;
+
+	cleanup_test();
+}
+#endif
+
+static char deferred_buffer[8333];
+static int deferred_writes;
+
+static void
+deferred_writecb(struct bufferevent *bev, void *arg)
+{
+	deferred_writes++;
+	if (EVBUFFER_LENGTH(bev->output) == 0)
+		test_ok++;
+}
+
+static void
+deferred_timercb(int fd, short what, void *arg)
+{
+	struct bufferevent *bev = arg;
+	int i;
+
+	/* many small writes that should go out together */
+	for (i = 0; i < sizeof(deferred_buffer); i += 100) {
+		int len = sizeof(deferred_buffer) - i < 100 ?
+		    sizeof(deferred_buffer) - i : 100;
+		bufferevent_write(bev, deferred_buffer + i, len);
+	}
+
+	/* nothing is written before the callback returns */
+	if (EVBUFFER_LENGTH(bev->output) != sizeof(deferred_buffer))
+		test_ok = -2;
+}
+
+static void
+test_bufferevent_deferred(void)
+{
+	struct bufferevent *bev1, *bev2;
+	struct event ev;
+	struct timeval tv;
+	int i;
+
+	setup_test("Bufferevent deferred: ");
+
+	bev1 = bufferevent_new(pair[0], readcb, deferred_writecb, errorcb,
+	    NULL);
+	bev2 = bufferevent_new(pair[1], readcb, writecb, errorcb, NULL);
+
+	bufferevent_setdeferred(bev1, 1);
+	bufferevent_disable(bev1, EV_READ);
+	bufferevent_enable(bev2, EV_READ);
+
+	for (i = 0; i < sizeof(deferred_buffer); i++)
+		deferred_buffer[i] = i;
+
+	deferred_writes = 0;
+	evtimer_set(&ev, deferred_timercb, bev1);
+	evutil_timerclear(&tv);
+	evtimer_add(&ev, &tv);
+
+	/* written from the loop right after the callback, without a poll */
+	event_loop(EVLOOP_ONCE);
+	if (deferred_writes != 1)
+		test_ok = -2;
+
+	event_dispatch();
+
+	bufferevent_free(bev1);
+	bufferevent_free(bev2);
+
+	/* all of the writes were flushed at once */
+	if (test_ok != 2 || deferred_writes != 1)
+		test_ok = 0;
+
+	cleanup_test();
+}
+
+static void
+drain_readcb(struct bufferevent *bev, void *arg)
+{
+	size_t *last = arg;
+	size_t len = EVBUFFER_LENGTH(bev->input);
+
+	/* never more than the drain limit for a single wakeup */
+	if (len - *last > 1000)
+		test_ok = -2;
+	*last = len;
+
+	if (len == 8333) {
+		bufferevent_disable(bev, EV_READ);
+		test_ok++;
+	}
+}
+
+static void
+test_bufferevent_drain(void)
+{
+	struct bufferevent *bev1, *bev2;
+	char buffer[8333];
+	size_t last = 0;
+	int i;
+
+	setup_test("Bufferevent drain: ");
+
+	bev1 = bufferevent_new(pair[0], NULL, writecb, errorcb, NULL);
+	bev2 = bufferevent_new(pair[1], drain_readcb, NULL, errorcb, &last);
+
+	bufferevent_setdrain(bev1, EV_WRITE, 0, 0);
+	bufferevent_setdrain(bev2, EV_READ, 0, 1000);
+	bufferevent_enable(bev2, EV_READ);
+
+	for (i = 0; i < sizeof(buffer); i++)
+		buffer[i] = i;
+
+	bufferevent_write(bev1, buffer, sizeof(buffer));
+
+	event_dispatch();
+
+	bufferevent_free(bev1);
+	bufferevent_free(bev2);
+
+	if (test_ok != 2)
+		test_ok = 0;
+
+	cleanup_test();
+}
+
+static void
+test_bufferevent_pair(void)
+{
+	struct bufferevent *pair[2];
+	char buffer[8333];
+	int i;
+
+	setup_test("Bufferevent pair: ");
+
+	if (bufferevent_pair_new(NULL, pair) == -1) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+	for (i = 0; i < 2; i++)
+		bufferevent_setcb(pair[i], readcb, writecb, errorcb, NULL);
+
+	bufferevent_disable(pair[0], EV_READ);
+	bufferevent_enable(pair[1], EV_READ);
+
+	for (i = 0; i < sizeof(buffer); i++)
+		buffer[i] = i;
+
+	bufferevent_write(pair[0], buffer, sizeof(buffer));
+
+	event_dispatch();
+
+	bufferevent_free(pair[0]);
+	bufferevent_free(pair[1]);
+
+	if (test_ok != 2)
+		test_ok = 0;
+
+	cleanup_test();
+}
+
 struct test_pri_event {
 	struct event ev;
 	int count;
@@ -1389,8 +1649,15 @@ main (int argc, char **argv)
 
 	test_evbuffer();
 	test_evbuffer_find();
+	test_evbuffer_readsize();
 	
 	test_bufferevent();
+	test_bufferevent_drain();
+	test_bufferevent_deferred();
+#ifndef WIN32
+	test_bufferevent_connect();
+#endif
+	test_bufferevent_pair();
 
 	test_free_active_base();
 
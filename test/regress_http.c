@@ -42,6 +42,7 @@
 #include <sys/queue.h>
 #ifndef WIN32
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/signal.h>
 #include <unistd.h>
 #include <netdb.h>
@@ -51,9 +52,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#if defined(HAVE_LIBZ) && defined(HAVE_ZLIB_H)
+#include <zlib.h>
+#endif
 
 #include "event.h"
 #include "evhttp.h"
+#include "evdns.h"
 #include "log.h"
 #include "http-internal.h"
 
@@ -905,17 +910,2744 @@ http_base_test(void)
 	fprintf(stdout, "OK\n");
 }
 
-void
-http_suite(void)
+static void
+http_parse_lines_test(void)
 {
-	http_base_test();
-	http_bad_header_test();
-	http_basic_test();
-	http_connection_test(0 /* not-persistent */);
-	http_connection_test(1 /* persistent */);
-	http_close_detection();
-	http_post_test();
-	http_failure_test();
-	http_highport_test();
-	http_dispatcher_test();
+	const char *pieces[] = {
+		"HTTP/1.1 200 Every",
+		"thing is fine\r\nContent-Ty",
+		"pe: text/plain\nX-Split:",
+		" yes\r\n\r",
+		"\nbody",
+		NULL
+	};
+	struct evhttp_request *req;
+	struct evbuffer *buf;
+	int i, res = 0;
+
+	fprintf(stdout, "Testing HTTP Incremental Header Parsing: ");
+
+	req = evhttp_request_new(NULL, NULL);
+	req->kind = EVHTTP_RESPONSE;
+	buf = evbuffer_new();
+
+	for (i = 0; pieces[i] != NULL; i++) {
+		evbuffer_add(buf, pieces[i], strlen(pieces[i]));
+		res = evhttp_parse_lines(req, buf);
+		if (res != (pieces[i + 1] == NULL)) {
+			fprintf(stdout, "FAILED\n");
+			exit(1);
+		}
+	}
+
+	if (req->response_code != HTTP_OK ||
+	    strcmp(req->response_code_line, "Everything is fine") ||
+	    evhttp_find_header(req->input_headers, "Content-Type") == NULL ||
+	    strcmp(evhttp_find_header(req->input_headers, "Content-Type"),
+		"text/plain") ||
+	    strcmp(evhttp_find_header(req->input_headers, "X-Split"),
+		"yes")) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	/* the body must be left in the buffer untouched */
+	if (EVBUFFER_LENGTH(buf) != 4 ||
+	    memcmp(EVBUFFER_DATA(buf), "body", 4)) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	evbuffer_free(buf);
+	evhttp_request_free(req);
+
+	fprintf(stdout, "OK\n");
+}
+
+static void
+http_header_index_test(void)
+{
+	const char *response =
+	    "HTTP/1.1 200 OK\r\n"
+	    "Content-Length: 4\r\n"
+	    "x-custom: one\r\n"
+	    "X-Custom: two\r\n"
+	    "Connection: keep-alive\r\n"
+	    "\r\n";
+	struct evhttp_request *req;
+	struct evbuffer *buf;
+	struct evkeyval *header;
+	const char *value;
+	int n = 0;
+
+	fprintf(stdout, "Testing HTTP Header Index: ");
+
+	req = evhttp_request_new(NULL, NULL);
+	req->kind = EVHTTP_RESPONSE;
+	buf = evbuffer_new();
+	evbuffer_add(buf, response, strlen(response));
+
+	if (evhttp_parse_lines(req, buf) != 1)
+		goto fail;
+
+	/* iteration still sees every header in order */
+	TAILQ_FOREACH(header, req->input_headers, next)
+		n++;
+	if (n != 4)
+		goto fail;
+
+	if ((value = evhttp_find_header(req->input_headers,
+		 "content-length")) == NULL || strcmp(value, "4"))
+		goto fail;
+	if ((value = evhttp_find_header(req->input_headers,
+		 "X-CUSTOM")) == NULL || strcmp(value, "one"))
+		goto fail;
+	if (evhttp_find_header(req->input_headers, "Date") != NULL)
+		goto fail;
+
+	/* a removed duplicate uncovers the next one */
+	if (evhttp_remove_header(req->input_headers, "X-Custom") == -1)
+		goto fail;
+	if ((value = evhttp_find_header(req->input_headers,
+		 "x-custom")) == NULL || strcmp(value, "two"))
+		goto fail;
+
+	/* headers added later must be found as well */
+	if (evhttp_add_header(req->input_headers, "Date", "today") == -1)
+		goto fail;
+	if ((value = evhttp_find_header(req->input_headers,
+		 "date")) == NULL || strcmp(value, "today"))
+		goto fail;
+
+	evhttp_clear_headers(req->input_headers);
+	if (evhttp_find_header(req->input_headers, "Connection") != NULL)
+		goto fail;
+
+	evbuffer_free(buf);
+	evhttp_request_free(req);
+
+	fprintf(stdout, "OK\n");
+	return;
+
+ fail:
+	fprintf(stdout, "FAILED\n");
+	exit(1);
+}
+
+/*
+ * URI routing
+ */
+
+static char http_route_result[64];
+
+static void
+http_route_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *evb = evbuffer_new();
+
+	evbuffer_add_printf(evb, "%s", (const char *)arg);
+	evhttp_send_reply(req, HTTP_OK, "Everything is fine", evb);
+	evbuffer_free(evb);
+}
+
+static void
+http_route_done(struct evhttp_request *req, void *arg)
+{
+	if (req->response_code != HTTP_OK) {
+		snprintf(http_route_result, sizeof(http_route_result),
+		    "%d", req->response_code);
+	} else {
+		size_t len = EVBUFFER_LENGTH(req->input_buffer);
+		if (len >= sizeof(http_route_result))
+			len = sizeof(http_route_result) - 1;
+		memcpy(http_route_result, EVBUFFER_DATA(req->input_buffer), len);
+		http_route_result[len] = '\0';
+	}
+	event_loopexit(NULL);
+}
+
+static void
+http_route_expect(struct evhttp_connection *evcon,
+    enum evhttp_cmd_type type, const char *uri, const char *expect)
+{
+	struct evhttp_request *req;
+
+	http_route_result[0] = '\0';
+	req = evhttp_request_new(http_route_done, NULL);
+	evhttp_add_header(req->output_headers, "Host", "somehost");
+	if (evhttp_make_request(evcon, req, type, uri) == -1) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	event_dispatch();
+
+	if (strcmp(http_route_result, expect) != 0) {
+		fprintf(stdout, "FAILED (%s: %s vs %s)\n",
+		    uri, http_route_result, expect);
+		exit(1);
+	}
+}
+
+static void
+http_route_test(void)
+{
+	short port = -1;
+	struct evhttp_connection *evcon = NULL;
+	int nchildren;
+
+	fprintf(stdout, "Testing HTTP URI Routing: ");
+
+	http = http_setup(&port, NULL);
+
+	evhttp_set_cb(http, "/r/a/b", http_route_cb, "exact");
+	evhttp_set_cb(http, "/r/*/b", http_route_cb, "wild");
+	evhttp_set_cb(http, "/r/static/*", http_route_cb, "rest");
+	evhttp_set_method_cb(http, EVHTTP_REQ_POST, "/r/post",
+	    http_route_cb, "post");
+	evhttp_set_cb(http, "/r/post", http_route_cb, "any");
+	evhttp_set_cb(http, "/r/dup", http_route_cb, "first");
+	evhttp_set_cb(http, "/r/dup", http_route_cb, "second");
+
+	evcon = evhttp_connection_new("127.0.0.1", port);
+	if (evcon == NULL) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	http_route_expect(evcon, EVHTTP_REQ_GET, "/r/a/b?q=1", "exact");
+	http_route_expect(evcon, EVHTTP_REQ_GET, "/r/c/b", "wild");
+	http_route_expect(evcon, EVHTTP_REQ_GET, "/r/static/css/a.css", "rest");
+	http_route_expect(evcon, EVHTTP_REQ_GET, "/r/static/", "rest");
+	http_route_expect(evcon, EVHTTP_REQ_GET, "/r/static", "404");
+	http_route_expect(evcon, EVHTTP_REQ_GET, "/r/a/b/c", "404");
+	http_route_expect(evcon, EVHTTP_REQ_GET, "/r/post", "any");
+	http_route_expect(evcon, EVHTTP_REQ_POST, "/r/post", "post");
+	http_route_expect(evcon, EVHTTP_REQ_GET, "/r/dup", "first");
+
+	if (evhttp_del_cb(http, "/r/dup") == -1 ||
+	    evhttp_del_cb(http, "/r/*/b") == -1 ||
+	    evhttp_del_cb(http, "/r/none") != -1) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	http_route_expect(evcon, EVHTTP_REQ_GET, "/r/dup", "second");
+	http_route_expect(evcon, EVHTTP_REQ_GET, "/r/c/b", "404");
+
+	/* nodes that lead nowhere are removed with their last callback */
+	nchildren = http->routes.children[0]->nchildren;
+	evhttp_set_cb(http, "/gone/a/b", http_route_cb, "gone");
+	if (http->routes.children[0]->nchildren != nchildren + 1 ||
+	    evhttp_del_cb(http, "/gone/a/b") == -1 ||
+	    http->routes.children[0]->nchildren != nchildren) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	evhttp_connection_free(evcon);
+	evhttp_free(http);
+
+	fprintf(stdout, "OK\n");
+}
+
+/*
+ * Request pooling
+ */
+
+static struct evhttp_request *http_pool_last_req;
+static int http_pool_reused;
+
+static void
+http_pool_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *evb = evbuffer_new();
+	int first = evhttp_find_header(req->input_headers, "X-First") != NULL;
+
+	/* the second request must not see anything of the first one */
+	if (http_pool_last_req != NULL)
+		http_pool_reused = req == http_pool_last_req && !first &&
+		    EVBUFFER_LENGTH(req->input_buffer) == 0;
+	http_pool_last_req = req;
+
+	evbuffer_add_printf(evb, "This is funny");
+	evhttp_send_reply(req, HTTP_OK, "Everything is fine", evb);
+	evbuffer_free(evb);
+}
+
+static void
+http_pool_test(void)
+{
+	short port = -1;
+	struct evhttp_connection *evcon = NULL;
+	struct evhttp_request *req = NULL;
+	int i;
+
+	test_ok = 0;
+	http_pool_last_req = NULL;
+	http_pool_reused = 0;
+	fprintf(stdout, "Testing HTTP Request Pooling: ");
+
+	http = http_setup(&port, NULL);
+	evhttp_set_cb(http, "/pool", http_pool_cb, NULL);
+
+	evcon = evhttp_connection_new("127.0.0.1", port);
+	if (evcon == NULL) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	for (i = 0; i < 2; i++) {
+		req = evhttp_request_new(http_request_done, NULL);
+		evhttp_add_header(req->output_headers, "Host", "somehost");
+		if (i == 0)
+			evhttp_add_header(req->output_headers, "X-First", "1");
+		if (evhttp_make_request(evcon, req,
+			EVHTTP_REQ_GET, "/pool") == -1) {
+			fprintf(stdout, "FAILED\n");
+			exit(1);
+		}
+
+		event_dispatch();
+
+		if (test_ok != 1) {
+			fprintf(stdout, "FAILED\n");
+			exit(1);
+		}
+		test_ok = 0;
+	}
+
+	evhttp_set_max_pooled(http, 0);
+
+	evhttp_connection_free(evcon);
+	evhttp_free(http);
+
+	if (!http_pool_reused) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	fprintf(stdout, "OK\n");
+}
+
+/*
+ * Keep-alive connection pool for outgoing requests
+ */
+
+static u_short http_client_pool_port;
+static int http_client_pool_ports;
+
+static void
+http_client_pool_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *evb = evbuffer_new();
+
+	/* every request has to arrive on the same connection */
+	if (http_client_pool_port != req->remote_port)
+		http_client_pool_ports++;
+	http_client_pool_port = req->remote_port;
+
+	evbuffer_add_printf(evb, "pooled");
+	evhttp_send_reply(req, HTTP_OK, "Everything is fine", evb);
+	evbuffer_free(evb);
+}
+
+static void
+http_client_pool_done(struct evhttp_request *req, void *arg)
+{
+	int *pending = arg;
+
+	if (req->response_code == HTTP_OK &&
+	    EVBUFFER_LENGTH(req->input_buffer) == strlen("pooled"))
+		test_ok++;
+
+	if (--*pending == 0)
+		event_loopexit(NULL);
+}
+
+static void
+http_client_pool_test(void)
+{
+	short port = -1;
+	struct evhttp_pool *pool;
+	struct evhttp_request *req = NULL;
+	struct timeval tv;
+	int i, pending;
+
+	test_ok = 0;
+	http_client_pool_port = 0;
+	http_client_pool_ports = 0;
+	fprintf(stdout, "Testing HTTP Client Connection Pool: ");
+
+	http = http_setup(&port, NULL);
+	evhttp_set_cb(http, "/pool", http_client_pool_cb, NULL);
+
+	pool = evhttp_pool_new(NULL);
+	evhttp_pool_set_max_connections(pool, 1);
+	evhttp_pool_set_idle_timeout(pool, 1);
+
+	/* three requests share a single connection */
+	pending = 3;
+	for (i = 0; i < 3; i++) {
+		req = evhttp_request_new(http_client_pool_done, &pending);
+		evhttp_add_header(req->output_headers, "Host", "somehost");
+		if (evhttp_pool_make_request(pool, "127.0.0.1", port, req,
+			EVHTTP_REQ_GET, "/pool") == -1) {
+			fprintf(stdout, "FAILED\n");
+			exit(1);
+		}
+	}
+
+	event_dispatch();
+
+	if (test_ok != 3 || http_client_pool_ports != 1) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	/* the idle connection gets closed */
+	evutil_timerclear(&tv);
+	tv.tv_sec = 2;
+	event_loopexit(&tv);
+	event_dispatch();
+
+	if (TAILQ_FIRST(&http->connections) != NULL) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	/* and is reestablished for the next request */
+	pending = 1;
+	req = evhttp_request_new(http_client_pool_done, &pending);
+	evhttp_add_header(req->output_headers, "Host", "somehost");
+	if (evhttp_pool_make_request(pool, "127.0.0.1", port, req,
+		EVHTTP_REQ_GET, "/pool") == -1) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	event_dispatch();
+
+	if (test_ok != 4 || http_client_pool_ports != 2) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	evhttp_pool_free(pool);
+	evhttp_free(http);
+
+	fprintf(stdout, "OK\n");
+}
+
+/*
+ * Streaming request bodies and size limits
+ */
+
+#define HTTP_STREAM_SIZE	(1024 * 1024)
+
+static int http_stream_chunks;
+static size_t http_stream_bytes;
+static int http_stream_response;
+
+static void
+http_stream_chunk_cb(struct evhttp_request *req, void *arg)
+{
+	http_stream_chunks++;
+	http_stream_bytes += EVBUFFER_LENGTH(req->input_buffer);
+}
+
+static void
+http_stream_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *evb = evbuffer_new();
+
+	/* everything has been delivered to the chunk callback */
+	if (arg == &http_stream_chunks &&
+	    EVBUFFER_LENGTH(req->input_buffer) == 0 &&
+	    http_stream_bytes == HTTP_STREAM_SIZE && http_stream_chunks > 1)
+		test_ok = 1;
+
+	evbuffer_add_printf(evb, "streamed");
+	evhttp_send_reply(req, HTTP_OK, "Everything is fine", evb);
+	evbuffer_free(evb);
+}
+
+static void
+http_stream_done(struct evhttp_request *req, void *arg)
+{
+	http_stream_response = req != NULL ? req->response_code : -1;
+	event_loopexit(NULL);
+}
+
+static void
+http_stream_request(short port, const char *header, size_t header_size,
+    size_t body_size)
+{
+	struct evhttp_connection *evcon;
+	struct evhttp_request *req;
+	char *data;
+
+	evcon = evhttp_connection_new("127.0.0.1", port);
+	if (evcon == NULL) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	req = evhttp_request_new(http_stream_done, NULL);
+	evhttp_add_header(req->output_headers, "Host", "somehost");
+	if (header_size) {
+		data = malloc(header_size + 1);
+		memset(data, 'a', header_size);
+		data[header_size] = '\0';
+		evhttp_add_header(req->output_headers, header, data);
+		free(data);
+	}
+	if (body_size) {
+		data = calloc(1, body_size);
+		evbuffer_add(req->output_buffer, data, body_size);
+		free(data);
+	}
+
+	http_stream_response = 0;
+	if (evhttp_make_request(evcon, req, EVHTTP_REQ_POST, "/stream") == -1) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	event_dispatch();
+
+	evhttp_connection_free(evcon);
+}
+
+static void
+http_stream_test(void)
+{
+	short port = -1;
+
+	test_ok = 0;
+	http_stream_chunks = 0;
+	http_stream_bytes = 0;
+	fprintf(stdout, "Testing HTTP Request Body Streaming: ");
+
+	http = http_setup(&port, NULL);
+	evhttp_set_chunked_cb(http, "/stream", http_stream_chunk_cb,
+	    http_stream_cb, &http_stream_chunks);
+
+	http_stream_request(port, NULL, 0, HTTP_STREAM_SIZE);
+	if (http_stream_response != HTTP_OK || test_ok != 1) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	/* requests above the limits are rejected */
+	evhttp_set_max_headers_size(http, 512);
+	evhttp_set_max_body_size(http, 1024);
+
+	http_stream_request(port, "X-Long", 1024, 0);
+	if (http_stream_response != HTTP_BADREQUEST) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	http_stream_chunks = 0;
+	http_stream_request(port, NULL, 0, 2048);
+	if (http_stream_response != HTTP_ENTITYTOOLARGE ||
+	    http_stream_chunks != 0) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	/* while smaller ones are still fine */
+	http_stream_request(port, "X-Short", 128, 1024);
+	if (http_stream_response != HTTP_OK) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	evhttp_free(http);
+
+	fprintf(stdout, "OK\n");
+}
+
+/*
+ * Bodies handed over in place
+ */
+
+#define HTTP_VIEW_CHUNK		(256 * 1024)
+
+static int http_view_chunks;
+static size_t http_view_bytes;
+static int http_view_corrupt;
+
+static void
+http_view_reply_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *evb = evbuffer_new();
+	char *data = malloc(HTTP_VIEW_CHUNK);
+	int i;
+
+	evhttp_send_reply_start(req, HTTP_OK, "Everything is fine");
+	for (i = 0; i < 3; i++) {
+		memset(data, 'a' + i, HTTP_VIEW_CHUNK);
+		evbuffer_add(evb, data, HTTP_VIEW_CHUNK);
+		evhttp_send_reply_chunk(req, evb);
+	}
+	evhttp_send_reply_end(req);
+	evbuffer_free(evb);
+	free(data);
+}
+
+static void
+http_view_chunk_cb(struct evhttp_request *req, void *arg)
+{
+	size_t i;
+
+	http_view_chunks++;
+	if (EVBUFFER_LENGTH(req->input_buffer) != 0)
+		http_view_corrupt = 1;
+
+	/* a view never spans two chunks of the reply */
+	for (i = 0; i < req->chunk_len; i++) {
+		if (req->chunk_data[i] !=
+		    'a' + (http_view_bytes + i) / HTTP_VIEW_CHUNK)
+			http_view_corrupt = 1;
+	}
+	http_view_bytes += req->chunk_len;
+}
+
+static void
+http_view_done(struct evhttp_request *req, void *arg)
+{
+	if (req != NULL && req->response_code == HTTP_OK &&
+	    EVBUFFER_LENGTH(req->input_buffer) == 0)
+		test_ok = 1;
+	event_loopexit(NULL);
+}
+
+static void
+http_whole_chunk_cb(struct evhttp_request *req, void *arg)
+{
+	/* without a view, a client only sees complete chunks */
+	http_view_chunks++;
+	if (EVBUFFER_LENGTH(req->input_buffer) != HTTP_VIEW_CHUNK)
+		http_view_corrupt = 1;
+	http_view_bytes += EVBUFFER_LENGTH(req->input_buffer);
+}
+
+static void
+http_stream_view_cb(struct evhttp_request *req, void *arg)
+{
+	http_stream_chunks++;
+	if (EVBUFFER_LENGTH(req->input_buffer) != 0)
+		http_view_corrupt = 1;
+	http_stream_bytes += req->chunk_len;
+}
+
+static void
+http_chunk_view_test(void)
+{
+	struct evhttp_connection *evcon;
+	struct evhttp_request *req;
+	short port = -1;
+
+	test_ok = 0;
+	http_view_chunks = 0;
+	http_view_bytes = 0;
+	http_view_corrupt = 0;
+	fprintf(stdout, "Testing HTTP Chunk Views: ");
+
+	http = http_setup(&port, NULL);
+	evhttp_set_cb(http, "/chunks", http_view_reply_cb, NULL);
+
+	evcon = evhttp_connection_new("127.0.0.1", port);
+	if (evcon == NULL) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	/* the client gets partial chunks of the reply as they arrive */
+	req = evhttp_request_new(http_view_done, NULL);
+	evhttp_request_set_chunked_cb(req, http_view_chunk_cb);
+	req->flags |= EVHTTP_REQ_CHUNK_VIEW;
+	evhttp_add_header(req->output_headers, "Host", "somehost");
+	if (evhttp_make_request(evcon, req, EVHTTP_REQ_GET, "/chunks") == -1) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	event_dispatch();
+
+	if (test_ok != 1 || http_view_corrupt ||
+	    http_view_bytes != 3 * HTTP_VIEW_CHUNK || http_view_chunks <= 3) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	/* a plain chunk callback gets one call per chunk */
+	test_ok = 0;
+	http_view_chunks = 0;
+	http_view_bytes = 0;
+	req = evhttp_request_new(http_view_done, NULL);
+	evhttp_request_set_chunked_cb(req, http_whole_chunk_cb);
+	evhttp_add_header(req->output_headers, "Host", "somehost");
+	if (evhttp_make_request(evcon, req, EVHTTP_REQ_GET, "/chunks") == -1) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	event_dispatch();
+
+	if (test_ok != 1 || http_view_corrupt ||
+	    http_view_bytes != 3 * HTTP_VIEW_CHUNK || http_view_chunks != 3) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	/* and a body that is not chunked goes to the final callback */
+	test_ok = 0;
+	http_view_chunks = 0;
+	req = evhttp_request_new(http_request_done, NULL);
+	evhttp_request_set_chunked_cb(req, http_whole_chunk_cb);
+	evhttp_add_header(req->output_headers, "Host", "somehost");
+	if (evhttp_make_request(evcon, req, EVHTTP_REQ_GET, "/test") == -1) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	event_dispatch();
+
+	if (test_ok != 1 || http_view_chunks != 0) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	evhttp_connection_free(evcon);
+
+	/* and so does the server with a request body */
+	test_ok = 0;
+	http_stream_chunks = 0;
+	http_stream_bytes = 0;
+	evhttp_set_chunked_view_cb(http, "/stream", http_stream_view_cb,
+	    http_stream_cb, &http_stream_chunks);
+
+	http_stream_request(port, NULL, 0, HTTP_STREAM_SIZE);
+	if (http_stream_response != HTTP_OK || test_ok != 1 ||
+	    http_view_corrupt) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	evhttp_free(http);
+
+	fprintf(stdout, "OK\n");
+}
+
+#if defined(HAVE_LIBZ) && defined(HAVE_ZLIB_H)
+/*
+ * Compressed responses
+ */
+
+static char http_gzip_body[8192];
+
+static void
+http_gzip_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *evb = evbuffer_new();
+	size_t len = arg != NULL ? 100 : sizeof(http_gzip_body);
+
+	evbuffer_add(evb, http_gzip_body, len);
+	evhttp_send_reply(req, HTTP_OK, "Everything is fine", evb);
+	evbuffer_free(evb);
+}
+
+static void
+http_gzip_stream_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *evb = evbuffer_new();
+	size_t off;
+
+	evhttp_send_reply_start(req, HTTP_OK, "Everything is fine");
+	for (off = 0; off < sizeof(http_gzip_body); off += 2048) {
+		evbuffer_add(evb, http_gzip_body + off, 2048);
+		evhttp_send_reply_chunk(req, evb);
+	}
+	evhttp_send_reply_end(req);
+	evbuffer_free(evb);
+}
+
+static const char *http_gzip_coding;
+static size_t http_gzip_length;
+static int http_gzip_vary;
+
+static void
+http_gzip_readcb(struct bufferevent *bev, void *arg)
+{
+	/* the reply is complete once the server closed the connection */
+}
+
+/* Records the coding of the reply and the length of the decoded body */
+
+static void
+http_gzip_eofcb(struct bufferevent *bev, short what, void *arg)
+{
+	static u_char data[sizeof(http_gzip_body) + 1];
+	struct evhttp_request *req;
+	struct evbuffer *body = bev->input;
+	const char *coding;
+	z_stream z;
+
+	event_loopexit(NULL);
+
+	req = evhttp_request_new(NULL, NULL);
+	req->kind = EVHTTP_RESPONSE;
+	if (!(what & EVBUFFER_EOF) || evhttp_parse_lines(req, body) != 1 ||
+	    req->response_code != HTTP_OK)
+		goto done;
+
+	coding = evhttp_find_header(req->input_headers, "Vary");
+	http_gzip_vary = coding != NULL &&
+	    strcmp(coding, "Accept-Encoding") == 0;
+
+	coding = evhttp_find_header(req->input_headers, "Content-Encoding");
+	if (coding == NULL) {
+		http_gzip_coding = "identity";
+		if (memcmp(EVBUFFER_DATA(body), http_gzip_body,
+			EVBUFFER_LENGTH(body)) == 0)
+			http_gzip_length = EVBUFFER_LENGTH(body);
+		goto done;
+	}
+	http_gzip_coding = strcmp(coding, "gzip") == 0 ? "gzip" :
+	    strcmp(coding, "deflate") == 0 ? "deflate" : "unknown";
+
+	/* the compressed body has to be smaller */
+	if (EVBUFFER_LENGTH(body) >= sizeof(http_gzip_body))
+		goto done;
+
+	memset(&z, 0, sizeof(z));
+	if (inflateInit2(&z, strcmp(coding, "gzip") == 0 ? 31 : 15) != Z_OK)
+		goto done;
+	z.next_in = EVBUFFER_DATA(body);
+	z.avail_in = EVBUFFER_LENGTH(body);
+	z.next_out = data;
+	z.avail_out = sizeof(data);
+	if (inflate(&z, Z_FINISH) == Z_STREAM_END &&
+	    memcmp(data, http_gzip_body, z.total_out) == 0)
+		http_gzip_length = z.total_out;
+	inflateEnd(&z);
+
+ done:
+	evhttp_request_free(req);
+}
+
+/*
+ * The client side of evhttp does not ask for compressed replies, so the
+ * requests are sent by hand; HTTP/1.0 replies end with the connection.
+ */
+
+static void
+http_gzip_request(short port, const char *uri, const char *accept)
+{
+	struct bufferevent *bev;
+	int fd;
+
+	http_gzip_coding = NULL;
+	http_gzip_length = 0;
+	http_gzip_vary = 0;
+
+	fd = http_connect("127.0.0.1", port);
+	bev = bufferevent_new(fd, http_gzip_readcb, NULL,
+	    http_gzip_eofcb, NULL);
+
+	evbuffer_add_printf(bev->output, "GET %s HTTP/1.0\r\n", uri);
+	if (accept != NULL)
+		evbuffer_add_printf(bev->output,
+		    "Accept-Encoding: %s\r\n", accept);
+	bufferevent_write(bev, "\r\n", 2);
+	bufferevent_enable(bev, EV_READ);
+
+	event_dispatch();
+
+	bufferevent_free(bev);
+	close(fd);
+}
+
+static void
+http_gzip_test(void)
+{
+	short port = -1;
+	size_t i;
+
+	fprintf(stdout, "Testing HTTP Response Compression: ");
+
+	for (i = 0; i < sizeof(http_gzip_body); i++)
+		http_gzip_body[i] = "abcdefgh\n"[i % 9] + (i / 512) % 16;
+
+	http = http_setup(&port, NULL);
+	evhttp_set_cb(http, "/gzip", http_gzip_cb, NULL);
+	evhttp_set_cb(http, "/small", http_gzip_cb, http);
+	evhttp_set_cb(http, "/stream", http_gzip_stream_cb, NULL);
+
+	/* compression is off by default */
+	http_gzip_request(port, "/gzip", "gzip");
+	if (http_gzip_coding == NULL ||
+	    strcmp(http_gzip_coding, "identity") != 0 ||
+	    http_gzip_length != sizeof(http_gzip_body) || http_gzip_vary) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	if (evhttp_set_compression(http, -1, 256) == -1) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	/* twice, so that the second reply uses a recycled compressor */
+	for (i = 0; i < 2; i++) {
+		http_gzip_request(port, "/gzip", "deflate, gzip");
+		if (http_gzip_coding == NULL ||
+		    strcmp(http_gzip_coding, "gzip") != 0 ||
+		    http_gzip_length != sizeof(http_gzip_body)) {
+			fprintf(stdout, "FAILED\n");
+			exit(1);
+		}
+	}
+
+	http_gzip_request(port, "/gzip", "gzip;q=0, deflate");
+	if (http_gzip_coding == NULL ||
+	    strcmp(http_gzip_coding, "deflate") != 0 ||
+	    http_gzip_length != sizeof(http_gzip_body)) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	/* a coding that is refused by name is not taken for "*" */
+	http_gzip_request(port, "/gzip", "gzip;q=0, *");
+	if (http_gzip_coding == NULL ||
+	    strcmp(http_gzip_coding, "deflate") != 0 ||
+	    http_gzip_length != sizeof(http_gzip_body)) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	http_gzip_request(port, "/gzip", "*, deflate;q=0, gzip;q=0");
+	if (http_gzip_coding == NULL ||
+	    strcmp(http_gzip_coding, "identity") != 0 ||
+	    http_gzip_length != sizeof(http_gzip_body) || !http_gzip_vary) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	http_gzip_request(port, "/stream", "gzip");
+	if (http_gzip_coding == NULL ||
+	    strcmp(http_gzip_coding, "gzip") != 0 ||
+	    http_gzip_length != sizeof(http_gzip_body)) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	/* small bodies and clients that do not ask are left alone */
+	http_gzip_request(port, "/small", "gzip");
+	if (http_gzip_coding == NULL ||
+	    strcmp(http_gzip_coding, "identity") != 0 ||
+	    http_gzip_length != 100 || !http_gzip_vary) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	http_gzip_request(port, "/gzip", NULL);
+	if (http_gzip_coding == NULL ||
+	    strcmp(http_gzip_coding, "identity") != 0 ||
+	    http_gzip_length != sizeof(http_gzip_body) || !http_gzip_vary) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	/* compressors set up for the old level are not reused */
+	if (http->nfree_deflate == 0 ||
+	    evhttp_set_compression(http, 1, 256) == -1 ||
+	    http->nfree_deflate != 0) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+	http_gzip_request(port, "/gzip", "gzip");
+	if (http_gzip_coding == NULL ||
+	    strcmp(http_gzip_coding, "gzip") != 0 ||
+	    http_gzip_length != sizeof(http_gzip_body) || !http_gzip_vary) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	evhttp_free(http);
+
+	fprintf(stdout, "OK\n");
+}
+#endif
+
+#ifndef WIN32
+/*
+ * Client side pipelining against a server that only answers once all
+ * requests of a batch have arrived
+ */
+
+static int http_pipeline_batch;		/* requests to wait for */
+static int http_pipeline_close;		/* close instead of answering */
+static int http_pipeline_failed;
+static struct event http_pipeline_listen_ev;
+
+struct http_pipeline_conn {
+	struct event ev;
+	struct evbuffer *input;
+	int nrequests;
+};
+
+static const char *http_pipeline_replies =
+    "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\none"
+    "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+    "3\r\ntwo\r\n0\r\nX-Trailer: yes\r\n\r\n"
+    "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nthree";
+
+static void
+http_pipeline_readcb(int fd, short what, void *arg)
+{
+	struct http_pipeline_conn *conn = arg;
+	const char *reply = http_pipeline_replies;
+	u_char *p;
+
+	if (evbuffer_read(conn->input, fd, -1) <= 0)
+		goto close;
+
+	while ((p = evbuffer_find(conn->input, (u_char *)"\r\n\r\n", 4))) {
+		evbuffer_drain(conn->input, p + 4 - EVBUFFER_DATA(conn->input));
+		conn->nrequests++;
+	}
+
+	if (conn->nrequests < http_pipeline_batch)
+		return;
+
+	if (http_pipeline_close) {
+		/* the server goes away without answering */
+		http_pipeline_close = 0;
+		http_pipeline_batch = 1;
+		goto close;
+	}
+
+	/* all replies of a batch go out in one write */
+	if (conn->nrequests == 1)
+		reply = strstr(reply, "three") - strlen(
+		    "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\n");
+	write(fd, reply, strlen(reply));
+	conn->nrequests = 0;
+	return;
+
+ close:
+	event_del(&conn->ev);
+	evbuffer_free(conn->input);
+	close(fd);
+	free(conn);
+}
+
+static void
+http_pipeline_acceptcb(int fd, short what, void *arg)
+{
+	struct http_pipeline_conn *conn;
+	int nfd;
+
+	if ((nfd = accept(fd, NULL, NULL)) == -1)
+		return;
+
+	conn = calloc(1, sizeof(struct http_pipeline_conn));
+	conn->input = evbuffer_new();
+	event_set(&conn->ev, nfd, EV_READ|EV_PERSIST,
+	    http_pipeline_readcb, conn);
+	event_add(&conn->ev, NULL);
+}
+
+static void
+http_pipeline_done(struct evhttp_request *req, void *arg)
+{
+	const char *what = arg;
+
+	if (req == NULL) {
+		http_pipeline_failed++;
+	} else if (req->response_code == HTTP_OK &&
+	    EVBUFFER_LENGTH(req->input_buffer) == strlen(what) &&
+	    memcmp(EVBUFFER_DATA(req->input_buffer), what,
+		strlen(what)) == 0) {
+		test_ok++;
+	}
+
+	if (test_ok + http_pipeline_failed == 3)
+		event_loopexit(NULL);
+}
+
+static void
+http_pipeline_send(struct evhttp_connection *evcon, const char *what)
+{
+	struct evhttp_request *req;
+
+	req = evhttp_request_new(http_pipeline_done, (void *)what);
+	evhttp_add_header(req->output_headers, "Host", "somehost");
+	if (evhttp_make_request(evcon, req, EVHTTP_REQ_GET, "/") == -1) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+}
+
+static void
+http_pipeline_test(void)
+{
+	struct evhttp_connection *evcon;
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof(sin);
+	struct timeval tv;
+	int sock;
+
+	test_ok = 0;
+	http_pipeline_failed = 0;
+	http_pipeline_batch = 3;
+	http_pipeline_close = 0;
+	fprintf(stdout, "Testing HTTP Client Pipelining: ");
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001UL);
+	if (sock == -1 || bind(sock, (struct sockaddr *)&sin, sizeof(sin)) ||
+	    listen(sock, 5) ||
+	    getsockname(sock, (struct sockaddr *)&sin, &slen)) {
+		fprintf(stdout, "FAILED (socket)\n");
+		exit(1);
+	}
+	event_set(&http_pipeline_listen_ev, sock, EV_READ|EV_PERSIST,
+	    http_pipeline_acceptcb, NULL);
+	event_add(&http_pipeline_listen_ev, NULL);
+
+	evcon = evhttp_connection_new("127.0.0.1", ntohs(sin.sin_port));
+	if (evcon == NULL) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	/* the server only answers after it got all three */
+	evhttp_connection_set_pipeline(evcon, 3);
+	http_pipeline_send(evcon, "one");
+	http_pipeline_send(evcon, "two");
+	http_pipeline_send(evcon, "three");
+
+	event_dispatch();
+
+	if (test_ok != 3 || http_pipeline_failed) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	/* requests made while waiting for a response go out from the loop */
+	test_ok = 0;
+	http_pipeline_send(evcon, "one");
+	timerclear(&tv);
+	tv.tv_usec = 100000;
+	event_loopexit(&tv);
+	event_dispatch();
+	http_pipeline_send(evcon, "two");
+	if (EVBUFFER_LENGTH(evcon->output_buffer) == 0) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+	http_pipeline_send(evcon, "three");
+
+	event_dispatch();
+
+	if (test_ok != 3 || http_pipeline_failed) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	/*
+	 * the server closes after it got two requests; both of them fail
+	 * and the third, unsent one is retried on a new connection.
+	 */
+	test_ok = 0;
+	http_pipeline_batch = 2;
+	http_pipeline_close = 1;
+	evhttp_connection_set_pipeline(evcon, 2);
+	http_pipeline_send(evcon, "one");
+	http_pipeline_send(evcon, "two");
+	http_pipeline_send(evcon, "three");
+
+	event_dispatch();
+
+	if (test_ok != 1 || http_pipeline_failed != 2) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	evhttp_connection_free(evcon);
+	event_del(&http_pipeline_listen_ev);
+	close(sock);
+
+	fprintf(stdout, "OK\n");
+}
+#endif
+
+/*
+ * Response cache
+ */
+
+static int http_cache_calls;
+static char http_cache_body[64];
+static const char *http_cache_host = "somehost";
+
+static void
+http_cache_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *evb = evbuffer_new();
+	const char *cache_control = arg;
+
+	http_cache_calls++;
+	evbuffer_add_printf(evb, "response %d", http_cache_calls);
+	if (cache_control != NULL)
+		evhttp_add_header(req->output_headers, "Cache-Control",
+		    cache_control);
+	evhttp_send_reply(req, HTTP_OK, "Everything is fine", evb);
+	evbuffer_free(evb);
+}
+
+static void
+http_cache_vary_cb(struct evhttp_request *req, void *arg)
+{
+	evhttp_add_header(req->output_headers, "Vary", arg);
+	http_cache_cb(req, "max-age=60");
+}
+
+static void
+http_cache_done(struct evhttp_request *req, void *arg)
+{
+	size_t len;
+
+	http_cache_body[0] = '\0';
+	if (req != NULL && req->response_code == HTTP_OK) {
+		len = EVBUFFER_LENGTH(req->input_buffer);
+		if (len >= sizeof(http_cache_body))
+			len = sizeof(http_cache_body) - 1;
+		memcpy(http_cache_body, EVBUFFER_DATA(req->input_buffer), len);
+		http_cache_body[len] = '\0';
+		if (arg != NULL && evhttp_find_header(req->input_headers,
+			"Age") == NULL)
+			http_cache_body[0] = '\0';
+	}
+	event_loopexit(NULL);
+}
+
+/* Returns the number of callbacks the request caused */
+static int
+http_cache_request(struct evhttp_connection *evcon, const char *uri,
+    const char *language, int hit)
+{
+	struct evhttp_request *req;
+	int calls = http_cache_calls;
+
+	req = evhttp_request_new(http_cache_done, hit ? evcon : NULL);
+	evhttp_add_header(req->output_headers, "Host", http_cache_host);
+	if (language != NULL)
+		evhttp_add_header(req->output_headers, "Accept-Language",
+		    language);
+	if (evhttp_make_request(evcon, req, EVHTTP_REQ_GET, uri) == -1) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	event_dispatch();
+
+	return (http_cache_calls - calls);
+}
+
+static void
+http_cache_test(void)
+{
+	struct evhttp_cache_stats stats;
+	struct evhttp_connection *evcon;
+	short port = -1;
+
+	http_cache_calls = 0;
+	fprintf(stdout, "Testing HTTP Response Cache: ");
+
+	http = http_setup(&port, NULL);
+	evhttp_set_cb(http, "/cached", http_cache_cb, "public, max-age=60");
+	evhttp_set_cb(http, "/private", http_cache_cb, "private, max-age=60");
+	evhttp_set_cb(http, "/big", http_cache_cb, "max-age=60");
+	evhttp_set_cb(http, "/vary", http_cache_vary_cb, "Accept-Language");
+	if (evhttp_set_cache(http, 64 * 1024) == -1)
+		goto fail;
+
+	evcon = evhttp_connection_new("127.0.0.1", port);
+	if (evcon == NULL)
+		goto fail;
+
+	/* the second request does not reach the callback */
+	if (http_cache_request(evcon, "/cached", NULL, 0) != 1 ||
+	    strcmp(http_cache_body, "response 1"))
+		goto fail;
+	if (http_cache_request(evcon, "/cached", NULL, 1) != 0 ||
+	    strcmp(http_cache_body, "response 1"))
+		goto fail;
+	if (http_cache_request(evcon, "/cached?other", NULL, 0) != 1)
+		goto fail;
+
+	/* private responses are never stored */
+	if (http_cache_request(evcon, "/private", NULL, 0) != 1 ||
+	    http_cache_request(evcon, "/private", NULL, 0) != 1)
+		goto fail;
+
+	evhttp_cache_get_stats(http, &stats);
+	if (stats.hits != 1 || stats.misses != 4 || stats.entries != 2)
+		goto fail;
+
+	/* nor are those that vary with a header outside the key */
+	if (http_cache_request(evcon, "/vary", "en", 0) != 1 ||
+	    http_cache_request(evcon, "/vary", "en", 0) != 1)
+		goto fail;
+
+	/* responses that depend on a header */
+	if (evhttp_cache_add_key_header(http, "Accept-Language") == -1)
+		goto fail;
+	if (http_cache_request(evcon, "/cached", "en", 0) != 1 ||
+	    http_cache_request(evcon, "/cached", "de", 0) != 1 ||
+	    http_cache_request(evcon, "/cached", "en", 1) != 0 ||
+	    http_cache_request(evcon, "/vary", "en", 0) != 1 ||
+	    http_cache_request(evcon, "/vary", "en", 1) != 0)
+		goto fail;
+
+	/* every virtual host has its own responses */
+	http_cache_host = "otherhost";
+	if (http_cache_request(evcon, "/cached", "en", 0) != 1 ||
+	    http_cache_request(evcon, "/cached", "en", 1) != 0)
+		goto fail;
+	http_cache_host = "somehost";
+
+	/* the least recently used response makes room */
+	evhttp_set_cache(http, stats.size);
+	if (http_cache_request(evcon, "/big?1", NULL, 0) != 1 ||
+	    http_cache_request(evcon, "/big?2", NULL, 0) != 1 ||
+	    http_cache_request(evcon, "/big?2", NULL, 1) != 0 ||
+	    http_cache_request(evcon, "/cached", "en", 0) != 1)
+		goto fail;
+
+	evhttp_cache_get_stats(http, &stats);
+	if (stats.evictions == 0 || stats.hits != 5)
+		goto fail;
+
+	evhttp_connection_free(evcon);
+	evhttp_free(http);
+
+	fprintf(stdout, "OK\n");
+	return;
+
+ fail:
+	fprintf(stdout, "FAILED\n");
+	exit(1);
+}
+
+/*
+ * Connections only time out when they are idle
+ */
+
+static struct bufferevent *http_idle_bev;
+static struct event http_idle_ev;
+static const char *http_idle_next;
+static int http_idle_eof;
+
+static void
+http_idle_writecb(int fd, short what, void *arg)
+{
+	struct timeval tv;
+	size_t len = strlen(http_idle_next);
+
+	if (len > 4)
+		len = 4;
+
+	/* a few bytes at a time, slower than the timeout in total */
+	bufferevent_write(http_idle_bev, http_idle_next, len);
+	http_idle_next += len;
+	if (*http_idle_next == '\0')
+		return;
+
+	evutil_timerclear(&tv);
+	tv.tv_usec = 250000;
+	evtimer_add(&http_idle_ev, &tv);
+}
+
+static void
+http_idle_expired(int fd, short what, void *arg)
+{
+	event_loopexit(NULL);
+}
+
+static void
+http_idle_readcb(struct bufferevent *bev, void *arg)
+{
+	/* the reply is checked once the server closed the connection */
+}
+
+static void
+http_idle_errorcb(struct bufferevent *bev, short what, void *arg)
+{
+	struct evhttp_request *req;
+
+	if (what & EVBUFFER_EOF) {
+		req = evhttp_request_new(NULL, NULL);
+		req->kind = EVHTTP_RESPONSE;
+		if (evhttp_parse_lines(req, bev->input) == 1 &&
+		    req->response_code == HTTP_OK)
+			test_ok = 1;
+		else
+			http_idle_eof = 1;
+		evhttp_request_free(req);
+	}
+	event_loopexit(NULL);
+}
+
+static void
+http_idle_test(void)
+{
+	static char request[256];
+	struct timeval tv;
+	short port = -1;
+	int fd;
+
+	test_ok = 0;
+	http_idle_eof = 0;
+	fprintf(stdout, "Testing HTTP Idle Timeout: ");
+
+	http = http_setup(&port, NULL);
+	evhttp_set_timeout(http, 1);
+
+	/* the data keeps coming, so the connection does not time out */
+	snprintf(request, sizeof(request),
+	    "POST /postit HTTP/1.0\r\n"
+	    "Host: somehost\r\n"
+	    "Content-Length: %d\r\n"
+	    "\r\n"
+	    "%s", (int)strlen(POST_DATA), POST_DATA);
+
+	fd = http_connect("127.0.0.1", port);
+	http_idle_bev = bufferevent_new(fd, http_idle_readcb, NULL,
+	    http_idle_errorcb, NULL);
+	bufferevent_enable(http_idle_bev, EV_READ);
+	http_idle_next = request;
+	evtimer_set(&http_idle_ev, http_idle_writecb, NULL);
+	http_idle_writecb(-1, EV_TIMEOUT, NULL);
+
+	event_dispatch();
+
+	bufferevent_free(http_idle_bev);
+	EVUTIL_CLOSESOCKET(fd);
+
+	if (test_ok != 1) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	/* but it does once the client stops sending */
+	fd = http_connect("127.0.0.1", port);
+	http_idle_bev = bufferevent_new(fd, http_idle_readcb, NULL,
+	    http_idle_errorcb, NULL);
+	bufferevent_enable(http_idle_bev, EV_READ);
+	bufferevent_write(http_idle_bev, request, 40);
+
+	/* in case the server never closes the connection */
+	evtimer_set(&http_idle_ev, http_idle_expired, NULL);
+	evutil_timerclear(&tv);
+	tv.tv_sec = 5;
+	evtimer_add(&http_idle_ev, &tv);
+
+	event_dispatch();
+
+	event_del(&http_idle_ev);
+	bufferevent_free(http_idle_bev);
+	EVUTIL_CLOSESOCKET(fd);
+
+	if (http_idle_eof != 1) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	evhttp_free(http);
+
+	fprintf(stdout, "OK\n");
+}
+
+/*
+ * Broadcasting the same chunks to many streams
+ */
+
+#define HTTP_BROADCAST_STREAMS	3
+
+static struct evhttp_broadcast *http_broadcast;
+static struct evhttp_request *http_broadcast_reqs[HTTP_BROADCAST_STREAMS];
+static int http_broadcast_nreqs;
+static int http_broadcast_done;
+static int http_broadcast_closed;
+
+static void
+http_broadcast_closecb(struct evhttp_connection *evcon, void *arg)
+{
+	http_broadcast_closed++;
+}
+
+static void
+http_broadcast_sendcb(int fd, short what, void *arg)
+{
+	struct evbuffer *evb = evbuffer_new();
+	int i;
+
+	evbuffer_add_printf(evb, "hello");
+	evhttp_broadcast_send(http_broadcast, evb);
+	evbuffer_add_printf(evb, "world");
+	evhttp_broadcast_send(http_broadcast, evb);
+	if (EVBUFFER_LENGTH(evb) != 0 ||
+	    evhttp_broadcast_get_subscribers(http_broadcast) !=
+	    HTTP_BROADCAST_STREAMS)
+		test_ok = -1;
+
+	for (i = 0; i < http_broadcast_nreqs; i++)
+		evhttp_send_reply_end(http_broadcast_reqs[i]);
+	if (evhttp_broadcast_get_subscribers(http_broadcast) != 0)
+		test_ok = -1;
+
+	evbuffer_free(evb);
+}
+
+static void
+http_broadcast_floodcb(int fd, short what, void *arg)
+{
+	struct evbuffer *evb = evbuffer_new();
+	struct evhttp_stats before, after;
+	char data[600];
+
+	/* the second message does not fit behind the first one */
+	memset(data, 'x', sizeof(data));
+	evbuffer_add(evb, data, sizeof(data));
+	evhttp_broadcast_send(http_broadcast, evb);
+	if (http_broadcast_closed != 0)
+		test_ok = -1;
+	evhttp_get_stats(http, &before);
+	evbuffer_add(evb, data, sizeof(data));
+	evhttp_broadcast_send(http_broadcast, evb);
+	if (http_broadcast_closed != 1 ||
+	    evhttp_broadcast_get_subscribers(http_broadcast) != 0)
+		test_ok = -1;
+
+	/* the connection of the stream is gone, not just closed */
+	evhttp_get_stats(http, &after);
+	if (after.active_connections != before.active_connections - 1 ||
+	    http->queued != 0)
+		test_ok = -1;
+
+	evbuffer_free(evb);
+}
+
+static void
+http_broadcast_cb(struct evhttp_request *req, void *arg)
+{
+	struct timeval tv;
+
+	evhttp_send_reply_start(req, HTTP_OK, "Everything is fine");
+	if (arg == (void *)1)
+		evhttp_connection_set_closecb(req->evcon,
+		    http_broadcast_closecb, NULL);
+	if (evhttp_broadcast_add(http_broadcast, req) == -1) {
+		test_ok = -1;
+		return;
+	}
+	http_broadcast_reqs[http_broadcast_nreqs++] = req;
+
+	/* everybody listens before anything is sent */
+	if (http_broadcast_nreqs != (int)(size_t)arg)
+		return;
+	evutil_timerclear(&tv);
+	event_once(-1, EV_TIMEOUT, arg == (void *)1 ?
+	    http_broadcast_floodcb : http_broadcast_sendcb, NULL, &tv);
+}
+
+static void
+http_broadcast_donecb(struct evhttp_request *req, void *arg)
+{
+	if (arg != NULL) {
+		/* the stream was cut off */
+		event_loopexit(NULL);
+		return;
+	}
+
+	if (req == NULL || req->response_code != HTTP_OK ||
+	    EVBUFFER_LENGTH(req->input_buffer) != 10 ||
+	    memcmp(EVBUFFER_DATA(req->input_buffer), "helloworld", 10))
+		test_ok = -1;
+
+	if (++http_broadcast_done == HTTP_BROADCAST_STREAMS)
+		event_loopexit(NULL);
+}
+
+static void
+http_broadcast_test(void)
+{
+	struct evhttp_connection *evcon[HTTP_BROADCAST_STREAMS];
+	struct evhttp_request *req;
+	short port = -1;
+	int i;
+
+	test_ok = 0;
+	http_broadcast_nreqs = 0;
+	http_broadcast_done = 0;
+	http_broadcast_closed = 0;
+	fprintf(stdout, "Testing HTTP Broadcast: ");
+
+	http = http_setup(&port, NULL);
+	evhttp_set_cb(http, "/events", http_broadcast_cb,
+	    (void *)HTTP_BROADCAST_STREAMS);
+	evhttp_set_cb(http, "/flood", http_broadcast_cb, (void *)1);
+	http_broadcast = evhttp_broadcast_new();
+
+	/* every stream sees every chunk */
+	for (i = 0; i < HTTP_BROADCAST_STREAMS; i++) {
+		evcon[i] = evhttp_connection_new("127.0.0.1", port);
+		if (evcon[i] == NULL)
+			goto fail;
+		req = evhttp_request_new(http_broadcast_donecb, NULL);
+		evhttp_add_header(req->output_headers, "Host", "somehost");
+		if (evhttp_make_request(evcon[i], req, EVHTTP_REQ_GET,
+			"/events") == -1)
+			goto fail;
+	}
+
+	event_dispatch();
+
+	for (i = 0; i < HTTP_BROADCAST_STREAMS; i++)
+		evhttp_connection_free(evcon[i]);
+
+	if (test_ok != 0 || http_broadcast_done != HTTP_BROADCAST_STREAMS)
+		goto fail;
+
+	/* a stream that falls behind is disconnected */
+	http_broadcast_nreqs = 0;
+	evhttp_broadcast_set_max_backlog(http_broadcast, 1024);
+
+	evcon[0] = evhttp_connection_new("127.0.0.1", port);
+	if (evcon[0] == NULL)
+		goto fail;
+	req = evhttp_request_new(http_broadcast_donecb, &http_broadcast_done);
+	evhttp_add_header(req->output_headers, "Host", "somehost");
+	if (evhttp_make_request(evcon[0], req, EVHTTP_REQ_GET,
+		"/flood") == -1)
+		goto fail;
+
+	event_dispatch();
+
+	evhttp_connection_free(evcon[0]);
+
+	if (test_ok != 0 || http_broadcast_closed != 1)
+		goto fail;
+
+	evhttp_broadcast_free(http_broadcast);
+	evhttp_free(http);
+
+	fprintf(stdout, "OK\n");
+	return;
+
+ fail:
+	fprintf(stdout, "FAILED\n");
+	exit(1);
+}
+
+/*
+ * Reverse proxy
+ */
+
+#define HTTP_PROXY_SIZE	(512 * 1024)
+
+static int http_proxy_code;
+static size_t http_proxy_len;
+static int http_proxy_good;
+
+static void
+http_proxy_big_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *evb = evbuffer_new();
+	char *data = malloc(HTTP_PROXY_SIZE);
+	int i;
+
+	for (i = 0; i < HTTP_PROXY_SIZE; i++)
+		data[i] = 'a' + i % 26;
+	evbuffer_add(evb, data, HTTP_PROXY_SIZE);
+	evhttp_send_reply(req, HTTP_OK, "Everything is fine", evb);
+	evbuffer_free(evb);
+	free(data);
+}
+
+static void
+http_proxy_echo_cb(struct evhttp_request *req, void *arg)
+{
+	const char *forwarded;
+
+	/* hop-by-hop headers stay behind */
+	forwarded = evhttp_find_header(req->input_headers, "X-Forwarded-For");
+	if (forwarded == NULL || strcmp(forwarded, "127.0.0.1") ||
+	    evhttp_find_header(req->input_headers, "Keep-Alive") != NULL ||
+	    evhttp_find_header(req->input_headers, "X-Private") != NULL ||
+	    evhttp_find_header(req->input_headers, "X-Custom") == NULL) {
+		evhttp_send_error(req, 500, "Bad Headers");
+		return;
+	}
+
+	evhttp_add_header(req->output_headers, "X-Echo", "yes");
+	evhttp_send_reply(req, HTTP_OK, "Everything is fine",
+	    req->input_buffer);
+}
+
+static void
+http_proxy_done(struct evhttp_request *req, void *arg)
+{
+	const u_char *data;
+	size_t i;
+
+	http_proxy_code = req != NULL ? req->response_code : -1;
+	http_proxy_len = req != NULL ? EVBUFFER_LENGTH(req->input_buffer) : 0;
+	http_proxy_good = req != NULL;
+	if (req != NULL && arg != NULL) {
+		/* the body has to arrive unchanged */
+		data = EVBUFFER_DATA(req->input_buffer);
+		for (i = 0; i < http_proxy_len; i++) {
+			if (data[i] != 'a' + i % 26)
+				http_proxy_good = 0;
+		}
+		if (evhttp_find_header(req->input_headers, "X-Echo") == NULL &&
+		    arg == (void *)2)
+			http_proxy_good = 0;
+	}
+	event_loopexit(NULL);
+}
+
+static void
+http_proxy_readcb(struct bufferevent *bev, void *arg)
+{
+	/* the reply is checked once the connection was closed */
+}
+
+static void
+http_proxy_errorcb(struct bufferevent *bev, short what, void *arg)
+{
+	event_loopexit(NULL);
+}
+
+static void
+http_proxy_request(struct evhttp_connection *evcon,
+    enum evhttp_cmd_type type, const char *uri, size_t body_size)
+{
+	struct evhttp_request *req;
+	char *data;
+	size_t i;
+
+	req = evhttp_request_new(http_proxy_done,
+	    body_size ? (void *)2 : (void *)1);
+	evhttp_add_header(req->output_headers, "Host", "somehost");
+	evhttp_add_header(req->output_headers, "X-Custom", "passed on");
+	evhttp_add_header(req->output_headers, "Keep-Alive", "300");
+	if (body_size) {
+		data = malloc(body_size);
+		for (i = 0; i < body_size; i++)
+			data[i] = 'a' + i % 26;
+		evbuffer_add(req->output_buffer, data, body_size);
+		free(data);
+	}
+
+	http_proxy_code = 0;
+	if (evhttp_make_request(evcon, req, type, uri) == -1) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	event_dispatch();
+}
+
+static void
+http_proxy_test(void)
+{
+	struct evhttp *upstream, *down;
+	struct evhttp_pool *pool;
+	struct evhttp_proxy *proxy, *dead;
+	struct evhttp_connection *evcon;
+	struct bufferevent *bev;
+	short port = -1, upport = -1, downport = -1;
+	const char *chunked =
+	    "POST /up/echo HTTP/1.1\r\n"
+	    "Host: somehost\r\n"
+	    "X-Custom: passed on\r\n"
+	    "X-Private: only for the proxy\r\n"
+	    "Transfer-Encoding: chunked\r\n"
+	    "Connection: close, X-Private\r\n"
+	    "\r\n"
+	    "5\r\nabcde\r\n3\r\nfgh\r\n0\r\n\r\n";
+	char *reply;
+	int fd;
+
+	fprintf(stdout, "Testing HTTP Reverse Proxy: ");
+
+	upstream = http_setup(&upport, NULL);
+	evhttp_set_cb(upstream, "/up/big", http_proxy_big_cb, NULL);
+	evhttp_set_cb(upstream, "/up/echo", http_proxy_echo_cb, NULL);
+
+	pool = evhttp_pool_new(NULL);
+	proxy = evhttp_proxy_new(pool, "127.0.0.1", upport);
+	/* small enough that both sides have to wait for each other */
+	evhttp_proxy_set_max_backlog(proxy, 4096);
+
+	http = http_setup(&port, NULL);
+	evhttp_set_proxy(http, "/up/*", proxy);
+
+	/* a port that nobody listens on */
+	down = http_setup(&downport, NULL);
+	evhttp_free(down);
+	dead = evhttp_proxy_new(pool, "127.0.0.1", downport);
+	evhttp_set_proxy(http, "/down/*", dead);
+
+	evcon = evhttp_connection_new("127.0.0.1", port);
+	if (evcon == NULL)
+		goto fail;
+
+	/* a response that is larger than the backlog */
+	http_proxy_request(evcon, EVHTTP_REQ_GET, "/up/big", 0);
+	if (http_proxy_code != HTTP_OK || !http_proxy_good ||
+	    http_proxy_len != HTTP_PROXY_SIZE)
+		goto fail;
+
+	/* and a request, on the same connections */
+	http_proxy_request(evcon, EVHTTP_REQ_POST, "/up/echo",
+	    HTTP_PROXY_SIZE);
+	if (http_proxy_code != HTTP_OK || !http_proxy_good ||
+	    http_proxy_len != HTTP_PROXY_SIZE)
+		goto fail;
+
+	/* the upstream server is not there */
+	http_proxy_request(evcon, EVHTTP_REQ_GET, "/down/big", 0);
+	if (http_proxy_code != HTTP_BADGATEWAY)
+		goto fail;
+
+	evhttp_connection_free(evcon);
+
+	/* a chunked request body is passed on in chunks */
+	fd = http_connect("127.0.0.1", port);
+	bev = bufferevent_new(fd, http_proxy_readcb, NULL, http_proxy_errorcb,
+	    NULL);
+	bufferevent_enable(bev, EV_READ);
+	bufferevent_write(bev, chunked, strlen(chunked));
+
+	event_dispatch();
+
+	reply = malloc(EVBUFFER_LENGTH(bev->input) + 1);
+	memcpy(reply, EVBUFFER_DATA(bev->input), EVBUFFER_LENGTH(bev->input));
+	reply[EVBUFFER_LENGTH(bev->input)] = '\0';
+	bufferevent_free(bev);
+	EVUTIL_CLOSESOCKET(fd);
+	if (strncmp(reply, "HTTP/1.1 200", 12) != 0 ||
+	    strstr(reply, "\r\n\r\nabcdefgh") == NULL) {
+		free(reply);
+		goto fail;
+	}
+	free(reply);
+
+	evhttp_free(http);
+	evhttp_pool_free(pool);
+	evhttp_proxy_free(proxy);
+	evhttp_proxy_free(dead);
+	evhttp_free(upstream);
+
+	fprintf(stdout, "OK\n");
+	return;
+
+ fail:
+	fprintf(stdout, "FAILED\n");
+	exit(1);
+}
+
+static void
+http_unix_request(const char *address)
+{
+	struct evhttp_connection *evcon;
+	struct evhttp_request *req;
+
+	evcon = evhttp_connection_new(address, 0);
+	if (evcon == NULL) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	test_ok = 0;
+	req = evhttp_request_new(http_request_done, NULL);
+	evhttp_add_header(req->output_headers, "Host", "somehost");
+	if (evhttp_make_request(evcon, req, EVHTTP_REQ_GET, "/test") == -1) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	event_dispatch();
+
+	evhttp_connection_free(evcon);
+	if (test_ok != 1) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+}
+
+static void
+http_unix_test(void)
+{
+	struct evhttp *server, *other;
+	struct sockaddr_un su;
+	struct stat st;
+	char path[64], address[80];
+	int fd;
+
+	fprintf(stdout, "Testing HTTP Unix Sockets: ");
+
+	snprintf(path, sizeof(path), "/tmp/regress-http-%d.sock",
+	    (int)getpid());
+	snprintf(address, sizeof(address), "unix:%s", path);
+
+	/* the socket file goes away with the server */
+	server = evhttp_new(NULL);
+	evhttp_set_cb(server, "/test", http_basic_cb, NULL);
+	if (evhttp_bind_socket(server, address, 0) == -1)
+		goto fail;
+	evhttp_free(server);
+	if (lstat(path, &st) == 0)
+		goto fail;
+
+	/* a stale socket file is replaced on bind */
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&su, 0, sizeof(su));
+	su.sun_family = AF_UNIX;
+	snprintf(su.sun_path, sizeof(su.sun_path), "%s", path);
+	if (fd == -1 || bind(fd, (struct sockaddr *)&su, sizeof(su)) == -1)
+		goto fail;
+	close(fd);
+
+	server = evhttp_new(NULL);
+	evhttp_set_cb(server, "/test", http_basic_cb, NULL);
+	if (evhttp_bind_socket(server, address, 0) == -1)
+		goto fail;
+	http_unix_request(address);
+
+	/* the socket of a running server is left alone */
+	other = evhttp_new(NULL);
+	if (evhttp_bind_socket(other, address, 0) != -1)
+		goto fail;
+	evhttp_free(other);
+	http_unix_request(address);
+
+	/* a second listener on the same server */
+#ifdef __linux__
+	snprintf(address, sizeof(address), "unix:@regress-http-%d",
+	    (int)getpid());
+	if (evhttp_bind_socket(server, address, 0) == -1)
+		goto fail;
+	http_unix_request(address);
+#endif
+
+	evhttp_free(server);
+	if (lstat(path, &st) == 0)
+		goto fail;
+
+	/* a socket created by the caller */
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1 || bind(fd, (struct sockaddr *)&su, sizeof(su)) == -1)
+		goto fail;
+
+	server = evhttp_new(NULL);
+	evhttp_set_cb(server, "/test", http_basic_cb, NULL);
+	if (evhttp_accept_socket(server, fd) == -1)
+		goto fail;
+	snprintf(address, sizeof(address), "unix:%s", path);
+	http_unix_request(address);
+	evhttp_free(server);
+	unlink(path);
+
+	fprintf(stdout, "OK\n");
+	return;
+
+ fail:
+	unlink(path);
+	fprintf(stdout, "FAILED\n");
+	exit(1);
+}
+
+static int http_stats_timed;
+
+static void
+http_stats_cb(struct evhttp_request *req, void *arg)
+{
+	struct evhttp_request_timing *t = &req->timing;
+	struct evbuffer *evb = evbuffer_new();
+
+	/* everything up to the callback happened */
+	http_stats_timed = timerisset(&t->accepted) &&
+	    timerisset(&t->first_read) && timerisset(&t->headers_done) &&
+	    timerisset(&t->body_done) && timerisset(&t->cb_start) &&
+	    !timerisset(&t->cb_end) && !timerisset(&t->first_write) &&
+	    !timercmp(&t->first_read, &t->accepted, <) &&
+	    !timercmp(&t->headers_done, &t->first_read, <);
+
+	evbuffer_add_printf(evb, "This is funny");
+	evhttp_send_reply(req, HTTP_OK, "Everything is fine", evb);
+	evbuffer_free(evb);
+}
+
+static void
+http_stats_done(struct evhttp_request *req, void *arg)
+{
+	struct evhttp_request_timing *t = &req->timing;
+
+	/* a client request is timed as well */
+	test_ok = req->response_code == HTTP_OK && http_stats_timed &&
+	    timerisset(&t->first_write) && timerisset(&t->first_read) &&
+	    timerisset(&t->body_done);
+	event_loopexit(NULL);
+}
+
+static void
+http_stats_test(void)
+{
+	struct evhttp_connection *evcon;
+	struct evhttp_request *req;
+	struct evhttp_stats stats;
+	struct bufferevent *bev;
+	short port = -1;
+	int fd, i;
+
+	fprintf(stdout, "Testing HTTP Statistics: ");
+
+	http = http_setup(&port, NULL);
+	evhttp_set_cb(http, "/timed", http_stats_cb, NULL);
+
+	/* a request that cannot be parsed */
+	fd = http_connect("127.0.0.1", port);
+	bev = bufferevent_new(fd, http_proxy_readcb, NULL, http_proxy_errorcb,
+	    NULL);
+	bufferevent_enable(bev, EV_READ);
+	bufferevent_write(bev, "illegal request\r\n\r\n", 19);
+
+	event_dispatch();
+
+	bufferevent_free(bev);
+	EVUTIL_CLOSESOCKET(fd);
+
+	evcon = evhttp_connection_new("127.0.0.1", port);
+	if (evcon == NULL)
+		goto fail;
+
+	for (i = 0; i < 3; i++) {
+		test_ok = 0;
+		http_stats_timed = 0;
+		req = evhttp_request_new(http_stats_done, NULL);
+		evhttp_add_header(req->output_headers, "Host", "somehost");
+		if (evhttp_make_request(evcon, req, EVHTTP_REQ_GET,
+			"/timed") == -1)
+			goto fail;
+
+		event_dispatch();
+
+		if (test_ok != 1)
+			goto fail;
+	}
+
+	evhttp_get_stats(http, &stats);
+	if (stats.active_connections != 1 || stats.connections != 2 ||
+	    stats.requests != 4 || stats.parse_errors != 1 ||
+	    stats.bytes_in == 0 || stats.bytes_out == 0 ||
+	    stats.requests_per_sec <= 0)
+		goto fail;
+	/* the bad request never reached a callback */
+	if (stats.phases[EVHTTP_PHASE_TOTAL].count != 4 ||
+	    stats.phases[EVHTTP_PHASE_CALLBACK].count != 3 ||
+	    stats.phases[EVHTTP_PHASE_WRITE].count != 4)
+		goto fail;
+	for (i = 0; i < EVHTTP_STATS_BUCKETS; i++)
+		stats.phases[EVHTTP_PHASE_TOTAL].count -=
+		    stats.phases[EVHTTP_PHASE_TOTAL].buckets[i];
+	if (stats.phases[EVHTTP_PHASE_TOTAL].count != 0)
+		goto fail;
+
+	evhttp_reset_stats(http);
+	evhttp_get_stats(http, &stats);
+	if (stats.active_connections != 1 || stats.requests != 0 ||
+	    stats.phases[EVHTTP_PHASE_TOTAL].count != 0)
+		goto fail;
+
+	evhttp_connection_free(evcon);
+	evhttp_free(http);
+
+	fprintf(stdout, "OK\n");
+	return;
+
+ fail:
+	fprintf(stdout, "FAILED\n");
+	exit(1);
+}
+
+static struct evhttp_request *http_overload_held;
+static int http_overload_active;
+static int http_overload_done;
+static int http_overload_codes[4];
+
+static void
+http_overload_cb(struct evhttp_request *req, void *arg)
+{
+	struct evhttp_stats stats;
+	struct evbuffer *evb;
+
+	/* the server never has more connections than allowed */
+	evhttp_get_stats(http, &stats);
+	if (stats.active_connections > http_overload_active)
+		http_overload_active = stats.active_connections;
+
+	if (arg != NULL) {
+		/* the reply is sent once the test is ready for it */
+		http_overload_held = req;
+		event_loopexit(NULL);
+		return;
+	}
+
+	evb = evbuffer_new();
+	evbuffer_add_printf(evb, "This is funny");
+	evhttp_send_reply(req, HTTP_OK, "Everything is fine", evb);
+	evbuffer_free(evb);
+}
+
+static void
+http_overload_big_cb(struct evhttp_request *req, void *arg)
+{
+	struct evbuffer *evb = evbuffer_new();
+	char block[8192];
+	int i;
+
+	memset(block, 'x', sizeof(block));
+	for (i = 0; i < 1024; i++)
+		evbuffer_add(evb, block, sizeof(block));
+	evhttp_send_reply(req, HTTP_OK, "Everything is fine", evb);
+	evbuffer_free(evb);
+}
+
+static void
+http_overload_request_done(struct evhttp_request *req, void *arg)
+{
+	http_overload_codes[(long)arg] = req->response_code;
+	if (--http_overload_done == 0)
+		event_loopexit(NULL);
+}
+
+static void
+http_overload_request(struct evhttp_connection *evcon, const char *uri,
+    long which)
+{
+	struct evhttp_request *req;
+
+	req = evhttp_request_new(http_overload_request_done, (void *)which);
+	evhttp_add_header(req->output_headers, "Host", "somehost");
+	if (evhttp_make_request(evcon, req, EVHTTP_REQ_GET, uri) == -1) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+}
+
+static void
+http_overload_test(void)
+{
+	struct evhttp_connection *evcon[4];
+	struct evhttp_stats stats;
+	struct evbuffer *evb;
+	struct linger linger;
+	struct timeval tv;
+	const char *big = "GET /big HTTP/1.1\r\nHost: somehost\r\n\r\n";
+	short port = -1;
+	int i, fd;
+
+	fprintf(stdout, "Testing HTTP Overload Protection: ");
+
+	http = http_setup(&port, NULL);
+	evhttp_set_cb(http, "/held", http_overload_cb, http);
+	evhttp_set_cb(http, "/quick", http_overload_cb, NULL);
+	evhttp_set_cb(http, "/big", http_overload_big_cb, NULL);
+	evhttp_set_max_requests(http, 1);
+
+	for (i = 0; i < 4; i++) {
+		evcon[i] = evhttp_connection_new("127.0.0.1", port);
+		if (evcon[i] == NULL)
+			goto fail;
+	}
+
+	/* the first request keeps the server busy */
+	http_overload_done = 1;
+	http_overload_request(evcon[0], "/held", 0);
+	event_dispatch();
+	if (http_overload_held == NULL)
+		goto fail;
+
+	/* and the next one is turned away */
+	http_overload_request(evcon[1], "/quick", 1);
+	event_dispatch();
+	if (http_overload_codes[1] != HTTP_SERVUNAVAIL)
+		goto fail;
+
+	http_overload_done = 1;
+	evb = evbuffer_new();
+	evbuffer_add_printf(evb, "This is funny");
+	evhttp_send_reply(http_overload_held, HTTP_OK, "Everything is fine",
+	    evb);
+	evbuffer_free(evb);
+	event_dispatch();
+	if (http_overload_codes[0] != HTTP_OK)
+		goto fail;
+
+	/* the idle connection of the first request stays until it is needed */
+	evhttp_set_max_requests(http, -1);
+	evhttp_set_max_connections(http, 1);
+	evhttp_get_stats(http, &stats);
+	if (stats.active_connections != 1 || stats.shed != 0 ||
+	    stats.rejected != 1)
+		goto fail;
+
+	/* one connection waits until the other one is done */
+	http_overload_active = 0;
+	http_overload_done = 2;
+	http_overload_request(evcon[2], "/quick", 2);
+	http_overload_request(evcon[3], "/quick", 3);
+	event_dispatch();
+	if (http_overload_codes[2] != HTTP_OK ||
+	    http_overload_codes[3] != HTTP_OK ||
+	    http_overload_active != 1)
+		goto fail;
+
+	/* only the first one needed the idle connection to be closed */
+	evhttp_get_stats(http, &stats);
+	if (stats.shed != 1)
+		goto fail;
+
+	/* everything that was queued has been written */
+	if (http->queued != 0 || http->nrequests != 0)
+		goto fail;
+
+	/* a client that stops reading leaves its reply queued */
+	evhttp_set_max_connections(http, -1);
+	evhttp_set_max_queued(http, 65536);
+	fd = http_connect("127.0.0.1", port);
+	if (write(fd, big, strlen(big)) != (ssize_t)strlen(big))
+		goto fail;
+	timerclear(&tv);
+	tv.tv_usec = 200000;
+	event_loopexit(&tv);
+	event_dispatch();
+	if (http->queued <= 65536)
+		goto fail;
+
+	http_overload_done = 1;
+	http_overload_request(evcon[0], "/quick", 0);
+	event_dispatch();
+	if (http_overload_codes[0] != HTTP_SERVUNAVAIL)
+		goto fail;
+
+	/* and dropping the connection gives the room back */
+	linger.l_onoff = 1;
+	linger.l_linger = 0;
+	setsockopt(fd, SOL_SOCKET, SO_LINGER, (void *)&linger,
+	    sizeof(linger));
+	EVUTIL_CLOSESOCKET(fd);
+	event_loopexit(&tv);
+	event_dispatch();
+	if (http->queued != 0)
+		goto fail;
+
+	http_overload_done = 1;
+	http_overload_request(evcon[0], "/quick", 0);
+	event_dispatch();
+	if (http_overload_codes[0] != HTTP_OK)
+		goto fail;
+
+	for (i = 0; i < 4; i++)
+		evhttp_connection_free(evcon[i]);
+	evhttp_free(http);
+
+	fprintf(stdout, "OK\n");
+	return;
+
+ fail:
+	fprintf(stdout, "FAILED\n");
+	exit(1);
+}
+
+static void
+http_access_log_readcb(int fd, short what, void *arg)
+{
+	event_loopexit(NULL);
+}
+
+static void
+http_access_log_request(struct evhttp_connection *evcon, const char *header)
+{
+	struct evhttp_request *req;
+
+	test_ok = 0;
+	req = evhttp_request_new(http_request_done, NULL);
+	evhttp_add_header(req->output_headers, "Host", "somehost");
+	if (header != NULL)
+		evhttp_add_header(req->output_headers, "X-Test", header);
+	if (evhttp_make_request(evcon, req, EVHTTP_REQ_GET, "/test") == -1) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	event_dispatch();
+
+	if (test_ok != 1) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+}
+
+static void
+http_access_log_test(void)
+{
+	struct evhttp_connection *evcon;
+	struct evhttp_stats stats;
+	struct event ev;
+	short port = -1;
+	char buf[1024], *line;
+	int fds[2], n, len;
+	long bytes, usec;
+
+	fprintf(stdout, "Testing HTTP Access Log: ");
+
+	if (pipe(fds) == -1 || fcntl(fds[1], F_SETFL, O_NONBLOCK) == -1)
+		goto fail;
+
+	http = http_setup(&port, NULL);
+	if (evhttp_set_access_log(http, fds[1],
+		"%h %m %U %s \"%{X-Test}i\" %% %b %D %q", 0) == -1)
+		goto fail;
+
+	evcon = evhttp_connection_new("127.0.0.1", port);
+	if (evcon == NULL)
+		goto fail;
+
+	http_access_log_request(evcon, "hello");
+
+	/* the line is written from a timer */
+	event_set(&ev, fds[0], EV_READ, http_access_log_readcb, NULL);
+	event_add(&ev, NULL);
+	event_dispatch();
+
+	http_access_log_request(evcon, NULL);
+
+	/* and the rest when logging is turned off */
+	evhttp_set_access_log(http, -1, NULL, 0);
+
+	if ((n = read(fds[0], buf, sizeof(buf) - 1)) <= 0)
+		goto fail;
+	buf[n] = '\0';
+
+	line = "127.0.0.1 GET /test 200 \"hello\" % ";
+	len = strlen(line);
+	if (strncmp(buf, line, len) != 0 ||
+	    sscanf(buf + len, "%ld %ld %%q\n", &bytes, &usec) != 2 ||
+	    bytes <= 13 || usec < 0)
+		goto fail;
+	if ((line = strchr(buf, '\n')) == NULL ||
+	    strncmp(line + 1, "127.0.0.1 GET /test 200 \"-\" % ", len - 4) != 0)
+		goto fail;
+
+	/* lines that do not fit into the ring are dropped */
+	if (evhttp_set_access_log(http, fds[1], "%U %U", 8) == -1)
+		goto fail;
+	http_access_log_request(evcon, NULL);
+	evhttp_get_stats(http, &stats);
+	if (stats.log_dropped != 1)
+		goto fail;
+
+	evhttp_connection_free(evcon);
+	evhttp_free(http);
+	close(fds[0]);
+	close(fds[1]);
+
+	fprintf(stdout, "OK\n");
+	return;
+
+ fail:
+	fprintf(stdout, "FAILED\n");
+	exit(1);
+}
+
+/*
+ * URI encoding and query arguments
+ */
+
+static void
+http_uri_test(void)
+{
+	struct evkeyvalq args;
+	struct evhttp_query_iter iter;
+	struct evbuffer *buf;
+	const char *key, *value;
+	size_t keylen, valuelen;
+	char *p, tmp[32];
+	int n = 0;
+
+	fprintf(stdout, "Testing HTTP URI Encoding: ");
+
+	p = evhttp_encode_uri("/a b?c=%\xff");
+	if (strcmp(p, "/a%20b%3Fc=%25%FF"))
+		goto fail;
+	free(p);
+
+	buf = evbuffer_new();
+	evbuffer_add(buf, "x", 1);
+	if (evhttp_encode_uri_buffer(buf, "a&b~", 3) == -1 ||
+	    EVBUFFER_LENGTH(buf) != 6 ||
+	    memcmp(EVBUFFER_DATA(buf), "xa%26b", 6))
+		goto fail;
+	evbuffer_free(buf);
+
+	p = evhttp_decode_uri("/a%20b+%zz%4?c=d+%2fe%4");
+	if (strcmp(p, "/a b+%zz%4?c=d /e%4"))
+		goto fail;
+	free(p);
+
+	/* decoding in place; the length limit is honored */
+	strcpy(tmp, "x+%41%42");
+	if (evhttp_decode_uri_buffer(tmp, tmp, 6, 1) != 4 ||
+	    strcmp(tmp, "x A%"))
+		goto fail;
+
+	evhttp_query_iter_init(&iter, "/path?a=1&bb=%20&c&");
+	while (evhttp_query_next(&iter, &key, &keylen, &value, &valuelen)) {
+		switch (n++) {
+		case 0:
+			if (keylen != 1 || *key != 'a' ||
+			    valuelen != 1 || *value != '1')
+				goto fail;
+			break;
+		case 1:
+			if (keylen != 2 || strncmp(key, "bb", 2) ||
+			    valuelen != 3 || strncmp(value, "%20", 3))
+				goto fail;
+			break;
+		case 2:
+			if (keylen != 1 || *key != 'c' || value != NULL)
+				goto fail;
+			break;
+		default:
+			goto fail;
+		}
+	}
+	if (n != 3)
+		goto fail;
+
+	evhttp_query_iter_init(&iter, "/path");
+	if (evhttp_query_next(&iter, &key, &keylen, &value, &valuelen))
+		goto fail;
+
+	/* parsing stops at the first argument without a value */
+	evhttp_parse_query("/path?q=a%2Cb&empty=&x&y=2", &args);
+	if ((value = evhttp_find_header(&args, "q")) == NULL ||
+	    strcmp(value, "a,b"))
+		goto fail;
+	if ((value = evhttp_find_header(&args, "empty")) == NULL ||
+	    strcmp(value, ""))
+		goto fail;
+	if (evhttp_find_header(&args, "x") != NULL ||
+	    evhttp_find_header(&args, "y") != NULL)
+		goto fail;
+	evhttp_clear_headers(&args);
+
+	fprintf(stdout, "OK\n");
+	return;
+
+ fail:
+	fprintf(stdout, "FAILED\n");
+	exit(1);
+}
+
+/*
+ * Status line and Date header of a reply
+ */
+
+static void
+http_status_cb(struct evhttp_request *req, void *arg)
+{
+	evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+}
+
+static void
+http_status_readcb(struct bufferevent *bev, void *arg)
+{
+	const char *status = "HTTP/1.1 200 OK\r\n";
+
+	if (evbuffer_find(bev->input, (u_char *)"\r\n\r\n", 4) == NULL)
+		return;
+
+	if (EVBUFFER_LENGTH(bev->input) > strlen(status) &&
+	    memcmp(EVBUFFER_DATA(bev->input), status, strlen(status)) == 0 &&
+	    evbuffer_find(bev->input, (u_char *)"\r\nDate: ", 8) != NULL)
+		test_ok++;
+
+	evbuffer_drain(bev->input, EVBUFFER_LENGTH(bev->input));
+	event_loopexit(NULL);
+}
+
+static void
+http_status_test(void)
+{
+	struct bufferevent *bev;
+	int fd;
+	const char *http_request;
+	struct timeval tv;
+	short port = -1;
+
+	test_ok = 0;
+	fprintf(stdout, "Testing HTTP Status Line: ");
+
+	http = http_setup(&port, NULL);
+	evhttp_set_cb(http, "/status", http_status_cb, NULL);
+
+	fd = http_connect("127.0.0.1", port);
+
+	bev = bufferevent_new(fd, http_status_readcb, NULL,
+	    http_errorcb, NULL);
+
+	http_request =
+	    "GET /status HTTP/1.1\r\n"
+	    "Host: somehost\r\n"
+	    "\r\n";
+
+	bufferevent_write(bev, http_request, strlen(http_request));
+	bufferevent_enable(bev, EV_READ);
+
+	event_dispatch();
+
+	/* the Date is kept until its second is over */
+	if (http->date[0] == '\0' || !evtimer_pending(&http->date_ev, NULL))
+		test_ok = 0;
+	evutil_timerclear(&tv);
+	tv.tv_sec = 1;
+	tv.tv_usec = 100000;
+	event_loopexit(&tv);
+	event_dispatch();
+	if (http->date[0] != '\0')
+		test_ok = 0;
+
+	bufferevent_free(bev);
+	close(fd);
+
+	evhttp_free(http);
+
+	if (test_ok != 1) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	fprintf(stdout, "OK\n");
+}
+
+#ifndef WIN32
+/*
+ * Name resolution through evdns
+ */
+
+static int http_dns_queries;
+static int http_dns_aaaa_queries;
+
+static void
+http_dns_server_cb(struct evdns_server_request *req, void *data)
+{
+	struct in_addr ans;
+	int i;
+
+	ans.s_addr = htonl(0x7f000001UL); /* 127.0.0.1 */
+	for (i = 0; i < req->nquestions; ++i) {
+		const char *name = req->questions[i]->name;
+		if (req->questions[i]->type == EVDNS_TYPE_A &&
+		    !strcmp(name, "evhttp.example.com")) {
+			evdns_server_request_add_a_reply(req,
+			    "evhttp.example.com", 1, &ans.s_addr, 300);
+			http_dns_queries++;
+		} else if (req->questions[i]->type == EVDNS_TYPE_AAAA) {
+			http_dns_aaaa_queries++;
+			if (!strcmp(name, "evhttp6.example.com"))
+				evdns_server_request_add_aaaa_reply(req,
+				    name, 1, (void *)&in6addr_loopback, 300);
+		}
+	}
+	evdns_server_request_respond(req, 0);
+}
+
+static void
+http_dns_failed_done(struct evhttp_request *req, void *arg)
+{
+	test_ok = req->response_code == 0;
+	event_loopexit(NULL);
+}
+
+static void
+http_dns_request(const char *address, short port, int reconnect, int fails)
+{
+	struct evhttp_connection *evcon;
+	struct evhttp_request *req;
+
+	evcon = evhttp_connection_new(address, port);
+	if (evcon == NULL) {
+		fprintf(stdout, "FAILED\n");
+		exit(1);
+	}
+
+	/* the connection needs to connect again for the second request */
+	do {
+		test_ok = 0;
+		req = evhttp_request_new(fails ?
+		    http_dns_failed_done : http_request_done, NULL);
+		evhttp_add_header(req->output_headers, "Host", "somehost");
+		if (reconnect)
+			evhttp_add_header(req->output_headers,
+			    "Connection", "close");
+		if (evhttp_make_request(evcon, req,
+			EVHTTP_REQ_GET, "/test") == -1) {
+			fprintf(stdout, "FAILED\n");
+			exit(1);
+		}
+
+		event_dispatch();
+
+		if (test_ok != 1) {
+			fprintf(stdout, "FAILED (%s)\n", address);
+			exit(1);
+		}
+	} while (reconnect--);
+
+	evhttp_connection_free(evcon);
+}
+
+static void
+http_dns_test(void)
+{
+	short port = -1;
+	struct evdns_server_port *dns_port;
+	struct sockaddr_in sin;
+	struct sockaddr_in6 sin6;
+	socklen_t slen = sizeof(sin);
+	char nameserver[32];
+	int sock, fd, aaaa = 1;
+
+	test_ok = 0;
+	http_dns_queries = 0;
+	http_dns_aaaa_queries = 0;
+	fprintf(stdout, "Testing HTTP Client Name Resolution: ");
+
+	http = http_setup(&port, NULL);
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001UL);
+	if (sock == -1 || bind(sock, (struct sockaddr *)&sin, sizeof(sin)) ||
+	    getsockname(sock, (struct sockaddr *)&sin, &slen)) {
+		fprintf(stdout, "FAILED (dns socket)\n");
+		exit(1);
+	}
+	fcntl(sock, F_SETFL, O_NONBLOCK);
+	dns_port = evdns_add_server_port(sock, 0, http_dns_server_cb, NULL);
+
+	snprintf(nameserver, sizeof(nameserver), "127.0.0.1:%d",
+	    ntohs(sin.sin_port));
+	evdns_nameserver_ip_add(nameserver);
+
+	/* the second connect has to use the cached address */
+	http_dns_request("evhttp.example.com", port, 1, 0);
+
+	/* and so does another connection to the same host */
+	http_dns_request("evhttp.example.com", port, 0, 0);
+
+	/* a name without addresses fails without the system resolver */
+	http_dns_request("nowhere.example.com", port, 0, 1);
+
+	/* IPv6 addresses are not looked up, IPv6 only hosts are */
+	fd = socket(AF_INET6, SOCK_STREAM, 0);
+	memset(&sin6, 0, sizeof(sin6));
+	sin6.sin6_family = AF_INET6;
+	sin6.sin6_addr = in6addr_loopback;
+	slen = sizeof(sin6);
+	if (fd != -1 &&
+	    bind(fd, (struct sockaddr *)&sin6, sizeof(sin6)) == 0 &&
+	    getsockname(fd, (struct sockaddr *)&sin6, &slen) == 0) {
+		if (evhttp_accept_socket(http, fd) == -1) {
+			fprintf(stdout, "FAILED\n");
+			exit(1);
+		}
+		http_dns_request("::1", ntohs(sin6.sin6_port), 0, 0);
+		http_dns_request("evhttp6.example.com",
+		    ntohs(sin6.sin6_port), 0, 0);
+		aaaa++;
+	} else if (fd != -1) {
+		/* no IPv6 on this host */
+		close(fd);
+	}
+
+	evdns_close_server_port(dns_port);
+	evdns_shutdown(0);
+	close(sock);
+
+	evhttp_free(http);
+
+	if (http_dns_queries != 1 || http_dns_aaaa_queries != aaaa) {
+		fprintf(stdout, "FAILED (%d queries)\n", http_dns_queries);
+		exit(1);
+	}
+
+	fprintf(stdout, "OK\n");
+}
+#endif
+
+void
+http_suite(void)
+{
+	http_base_test();
+	http_bad_header_test();
+	http_parse_lines_test();
+	http_header_index_test();
+	http_basic_test();
+	http_connection_test(0 /* not-persistent */);
+	http_connection_test(1 /* persistent */);
+	http_close_detection();
+	http_post_test();
+	http_failure_test();
+	http_highport_test();
+	http_dispatcher_test();
+	http_route_test();
+	http_pool_test();
+	http_client_pool_test();
+	http_stream_test();
+	http_chunk_view_test();
+#if defined(HAVE_LIBZ) && defined(HAVE_ZLIB_H)
+	http_gzip_test();
+#endif
+#ifndef WIN32
+	http_pipeline_test();
+#endif
+	http_cache_test();
+	http_idle_test();
+	http_broadcast_test();
+	http_proxy_test();
+	http_unix_test();
+	http_stats_test();
+	http_overload_test();
+	http_access_log_test();
+	http_uri_test();
+	http_status_test();
+#ifndef WIN32
+	http_dns_test();
+#endif
 }